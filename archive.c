@@ -0,0 +1,574 @@
+/*
+ * SPDX-License-Identifier: CC0-1.0
+ *
+ * Author: James Jones
+ */
+
+/* Needed to get fileno(), fdopen() and pread() definitions with -std=c99 */
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#ifdef JAGGD_ZLIB
+#include <zlib.h>
+#endif
+
+#include "archive.h"
+
+#define GZIP_MAGIC 0x8b1f
+#define ZIP_LOCAL_MAGIC 0x04034b50
+#define ZIP_CENTRAL_MAGIC 0x02014b50
+#define ZIP_END_MAGIC 0x06054b50
+
+/* Sizes of the fixed parts of zip headers */
+#define ZIP_LOCAL_SIZE 30
+#define ZIP_CENTRAL_SIZE 46
+#define ZIP_END_SIZE 22
+
+/* Zip archives may end in a comment of up to this many bytes */
+#define ZIP_MAX_COMMENT 0xffff
+
+/* Refuse central directories bigger than this */
+#define ZIP_MAX_DIRECTORY (16 * 1024 * 1024)
+
+#define ARCHIVE_CHUNK_SIZE (64 * 1024)
+
+/* Archives store their numbers little-endian */
+static inline uint32_t read32LE(const uint8_t *ptr)
+{
+	return ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) |
+		((uint32_t)ptr[3] << 24);
+}
+
+static inline uint16_t read16LE(const uint8_t *ptr)
+{
+	return ptr[0] | (ptr[1] << 8);
+}
+
+static bool ReadAt(FILE *fp, off_t offset, void *buf, size_t len)
+{
+	uint8_t *out = buf;
+
+	while (len > 0) {
+		ssize_t got = pread(fileno(fp), out, len, offset);
+
+		if (got < 0) {
+			if (errno == EINTR) continue;
+			return false;
+		}
+
+		if (got == 0) {
+			return false;
+		}
+
+		out += got;
+		len -= got;
+		offset += got;
+	}
+
+	return true;
+}
+
+/* Copy name to entry->name, dropping any directories */
+static void SetEntryName(ArchiveEntry *entry, const char *name, size_t len)
+{
+	size_t i;
+
+	for (i = len; i > 0; i--) {
+		if ((name[i - 1] == '/') || (name[i - 1] == '\\')) {
+			name += i;
+			len -= i;
+			break;
+		}
+	}
+
+	if (len >= sizeof(entry->name)) {
+		len = sizeof(entry->name) - 1;
+	}
+
+	memcpy(entry->name, name, len);
+	entry->name[len] = '\0';
+}
+
+/*
+ * gzip only records the size of its contents, mod 4GB, at the very end. The
+ * name is taken from the archive's own, without the .gz.
+ */
+static bool FindGzipEntry(const char *path, FILE *fp, off_t fileSize,
+			  ArchiveEntry *entry)
+{
+	uint8_t trailer[4];
+	size_t len = strlen(path);
+
+	if ((fileSize < 18) || !ReadAt(fp, fileSize - 4, trailer, 4)) {
+		fprintf(stderr, "'%s' is too short to be a gzip file\n", path);
+		return false;
+	}
+
+	entry->gzip = true;
+	entry->deflated = true;
+	entry->offset = 0;
+	entry->compSize = fileSize;
+	entry->size = read32LE(trailer);
+
+	if ((len > 3) && !strcmp(&path[len - 3], ".gz")) {
+		len -= 3;
+	}
+
+	SetEntryName(entry, path, len);
+
+	return true;
+}
+
+/*
+ * Find the biggest file in a zip archive through its central directory,
+ * as local headers may leave sizes to a descriptor after the data.
+ */
+static bool FindZipEntry(const char *path, FILE *fp, off_t fileSize,
+			 ArchiveEntry *entry)
+{
+	uint8_t *buf = NULL;
+	size_t tailLen, dirLen, pos;
+	uint32_t dirOffset;
+	uint16_t numEntries, i;
+	uint8_t local[ZIP_LOCAL_SIZE];
+	bool found = false;
+	uint32_t localOffset = 0;
+	long end;
+
+	tailLen = (fileSize < (ZIP_END_SIZE + ZIP_MAX_COMMENT)) ?
+		(size_t)fileSize : (ZIP_END_SIZE + ZIP_MAX_COMMENT);
+
+	if (!(buf = malloc(tailLen))) {
+		fprintf(stderr, "Failed to alloc zip directory buffer\n");
+		return false;
+	}
+
+	if (!ReadAt(fp, fileSize - tailLen, buf, tailLen)) {
+		goto corrupt;
+	}
+
+	for (end = (long)tailLen - ZIP_END_SIZE; end >= 0; end--) {
+		if (read32LE(&buf[end]) == ZIP_END_MAGIC) break;
+	}
+
+	if (end < 0) {
+		goto corrupt;
+	}
+
+	numEntries = read16LE(&buf[end + 10]);
+	dirLen = read32LE(&buf[end + 12]);
+	dirOffset = read32LE(&buf[end + 16]);
+
+	if ((dirOffset == 0xffffffffu) || (dirLen > ZIP_MAX_DIRECTORY) ||
+	    (((off_t)dirOffset + (off_t)dirLen) > fileSize)) {
+		fprintf(stderr, "'%s' is a zip64 or damaged zip file\n",
+			path);
+		goto fail;
+	}
+
+	free(buf);
+
+	if (!(buf = malloc(dirLen))) {
+		fprintf(stderr, "Failed to alloc zip directory buffer\n");
+		return false;
+	}
+
+	if (!ReadAt(fp, dirOffset, buf, dirLen)) {
+		goto corrupt;
+	}
+
+	for (i = 0, pos = 0; i < numEntries; i++) {
+		const uint8_t *hdr = &buf[pos];
+		uint16_t flags, method, nameLen;
+		uint32_t size;
+
+		if (((pos + ZIP_CENTRAL_SIZE) > dirLen) ||
+		    (read32LE(hdr) != ZIP_CENTRAL_MAGIC)) {
+			goto corrupt;
+		}
+
+		flags = read16LE(&hdr[8]);
+		method = read16LE(&hdr[10]);
+		size = read32LE(&hdr[24]);
+		nameLen = read16LE(&hdr[28]);
+
+		if ((pos + ZIP_CENTRAL_SIZE + nameLen) > dirLen) {
+			goto corrupt;
+		}
+
+		/* Skip directories, and anything that can't be read */
+		if ((nameLen > 0) &&
+		    (hdr[ZIP_CENTRAL_SIZE + nameLen - 1] != '/') &&
+		    !(flags & 0x1) && ((method == 0) || (method == 8)) &&
+		    (!found || (size > entry->size))) {
+			entry->gzip = false;
+			entry->deflated = (method == 8);
+			entry->compSize = read32LE(&hdr[20]);
+			entry->size = size;
+			localOffset = read32LE(&hdr[42]);
+			SetEntryName(entry, (const char *)&hdr[ZIP_CENTRAL_SIZE],
+				     nameLen);
+			found = true;
+		}
+
+		pos += ZIP_CENTRAL_SIZE + nameLen + read16LE(&hdr[30]) +
+			read16LE(&hdr[32]);
+	}
+
+	if (!found) {
+		fprintf(stderr, "'%s' holds no files jaggd can read. Only "
+			"stored or deflated,\nunencrypted files are "
+			"supported\n", path);
+		goto fail;
+	}
+
+	if ((entry->size == 0xffffffffu) ||
+	    (entry->compSize == 0xffffffffu) ||
+	    !ReadAt(fp, localOffset, local, sizeof(local)) ||
+	    (read32LE(local) != ZIP_LOCAL_MAGIC)) {
+		goto corrupt;
+	}
+
+	entry->offset = (off_t)localOffset + ZIP_LOCAL_SIZE +
+		read16LE(&local[26]) + read16LE(&local[28]);
+
+	if ((entry->offset + (off_t)entry->compSize) > fileSize) {
+		goto corrupt;
+	}
+
+	free(buf);
+	return true;
+
+corrupt:
+	fprintf(stderr, "'%s' is not a valid zip file\n", path);
+
+fail:
+	free(buf);
+	return false;
+}
+
+/*
+ * Check whether fp is a gzip or zip archive, and if so, find the file in it.
+ * *oFound is left false for anything else. Returns false if fp looks like
+ * an archive but can't be read.
+ */
+bool FindArchiveEntry(const char *path, FILE *fp, bool *oFound,
+		      ArchiveEntry *entry)
+{
+	uint8_t magic[4];
+	off_t fileSize;
+
+	*oFound = false;
+	memset(entry, 0, sizeof(*entry));
+
+	if (fseeko(fp, 0, SEEK_END) || ((fileSize = ftello(fp)) < 0) ||
+	    fseeko(fp, 0, SEEK_SET)) {
+		/* Not seekable. Leave it to the caller. */
+		return true;
+	}
+
+	if ((fileSize < (off_t)sizeof(magic)) ||
+	    !ReadAt(fp, 0, magic, sizeof(magic))) {
+		return true;
+	}
+
+	if (read16LE(magic) == GZIP_MAGIC) {
+		if (!FindGzipEntry(path, fp, fileSize, entry)) {
+			return false;
+		}
+	} else if ((read32LE(magic) == ZIP_LOCAL_MAGIC) ||
+		   (read32LE(magic) == ZIP_END_MAGIC)) {
+		if (!FindZipEntry(path, fp, fileSize, entry)) {
+			return false;
+		}
+	} else {
+		return true;
+	}
+
+#ifndef JAGGD_ZLIB
+	if (entry->deflated) {
+		fprintf(stderr, "'%s' is compressed, but jaggd was built "
+			"without zlib\n", path);
+		return false;
+	}
+#endif
+
+	*oFound = true;
+	return true;
+}
+
+/* Takes each piece of the decompressed data. Returns false to stop. */
+typedef bool (*ArchiveSink)(void *data, const uint8_t *buf, size_t len);
+
+static bool Extract(FILE *fp, const ArchiveEntry *entry,
+		    ArchiveSink sink, void *sinkData)
+{
+	uint8_t *in = malloc(ARCHIVE_CHUNK_SIZE);
+	uint64_t pos = 0, produced = 0;
+	bool success = false;
+#ifdef JAGGD_ZLIB
+	uint8_t *out = malloc(ARCHIVE_CHUNK_SIZE);
+	z_stream zs;
+	int ret = Z_OK;
+
+	memset(&zs, 0, sizeof(zs));
+
+	if (!out) {
+		free(in);
+		in = NULL;
+	}
+#endif
+
+	if (!in) {
+		fprintf(stderr, "Failed to alloc decompression buffers\n");
+		return false;
+	}
+
+	if (!entry->deflated) {
+		while (pos < entry->compSize) {
+			size_t len = ((entry->compSize - pos) >
+				      ARCHIVE_CHUNK_SIZE) ?
+				ARCHIVE_CHUNK_SIZE :
+				(size_t)(entry->compSize - pos);
+
+			if (!ReadAt(fp, entry->offset + pos, in, len)) {
+				fprintf(stderr, "Failed to read '%s' from its "
+					"archive\n", entry->name);
+				goto cleanup;
+			}
+
+			if (!sink(sinkData, in, len)) {
+				goto cleanup;
+			}
+
+			pos += len;
+		}
+
+		produced = pos;
+	}
+
+#ifdef JAGGD_ZLIB
+	/* Let zlib skip gzip's header and check its CRC too */
+	if (entry->deflated &&
+	    (inflateInit2(&zs, entry->gzip ? (16 + MAX_WBITS) :
+			  -MAX_WBITS) != Z_OK)) {
+		fprintf(stderr, "Failed to set up decompression\n");
+		goto cleanup;
+	}
+
+	while (entry->deflated && (ret != Z_STREAM_END)) {
+		size_t got;
+
+		if (zs.avail_in == 0) {
+			size_t len = ((entry->compSize - pos) >
+				      ARCHIVE_CHUNK_SIZE) ?
+				ARCHIVE_CHUNK_SIZE :
+				(size_t)(entry->compSize - pos);
+
+			if ((len == 0) ||
+			    !ReadAt(fp, entry->offset + pos, in, len)) {
+				fprintf(stderr, "'%s' is cut short in its "
+					"archive\n", entry->name);
+				goto inflateDone;
+			}
+
+			zs.next_in = in;
+			zs.avail_in = len;
+			pos += len;
+		}
+
+		zs.next_out = out;
+		zs.avail_out = ARCHIVE_CHUNK_SIZE;
+		ret = inflate(&zs, Z_NO_FLUSH);
+
+		if ((ret != Z_OK) && (ret != Z_STREAM_END)) {
+			fprintf(stderr, "Failed to decompress '%s': %s\n",
+				entry->name, zs.msg ? zs.msg : "bad data");
+			goto inflateDone;
+		}
+
+		got = ARCHIVE_CHUNK_SIZE - zs.avail_out;
+		produced += got;
+
+		if ((produced > entry->size) ||
+		    (got && !sink(sinkData, out, got))) {
+			break;
+		}
+	}
+
+inflateDone:
+	if (entry->deflated) {
+		inflateEnd(&zs);
+	}
+
+	if (entry->deflated && (ret != Z_STREAM_END)) {
+		if (produced > entry->size) {
+			fprintf(stderr, "'%s' is bigger than its archive "
+				"says\n", entry->name);
+		}
+
+		goto cleanup;
+	}
+#endif
+
+	if (produced != entry->size) {
+		fprintf(stderr, "'%s' is %s than its archive says\n",
+			entry->name, (produced > entry->size) ?
+			"bigger" : "smaller");
+		goto cleanup;
+	}
+
+	success = true;
+
+cleanup:
+#ifdef JAGGD_ZLIB
+	free(out);
+#endif
+	free(in);
+	return success;
+}
+
+typedef struct {
+	uint8_t *buf;
+	size_t pos;
+	size_t len;
+} MemSink;
+
+static bool ToMemory(void *data, const uint8_t *buf, size_t len)
+{
+	MemSink *ms = data;
+
+	if (len > (ms->len - ms->pos)) {
+		/* Extract() reports the size mismatch */
+		len = ms->len - ms->pos;
+	}
+
+	memcpy(ms->buf + ms->pos, buf, len);
+	ms->pos += len;
+
+	return true;
+}
+
+/* Decompress the whole of entry into buf, which holds entry->size bytes */
+bool ExtractArchive(FILE *fp, const ArchiveEntry *entry, uint8_t *buf)
+{
+	MemSink ms = { .buf = buf, .len = entry->size };
+
+	return Extract(fp, entry, ToMemory, &ms);
+}
+
+typedef struct {
+	FILE *fp;
+	ArchiveEntry entry;
+	int fd;
+} ArchiveStream;
+
+static bool ToPipe(void *data, const uint8_t *buf, size_t len)
+{
+	const ArchiveStream *as = data;
+
+	while (len > 0) {
+		ssize_t put = write(as->fd, buf, len);
+
+		if (put < 0) {
+			if (errno == EINTR) continue;
+
+			/* EPIPE just means the reader has had enough */
+			if (errno != EPIPE) {
+				fprintf(stderr, "Failed to pass on '%s':\n"
+					"  %s\n", as->entry.name,
+					strerror(errno));
+			}
+
+			return false;
+		}
+
+		buf += put;
+		len -= put;
+	}
+
+	return true;
+}
+
+static void *StreamWorker(void *data)
+{
+	ArchiveStream *as = data;
+	sigset_t set;
+
+	/* Get EPIPE rather than a signal if the reader closes early */
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	Extract(as->fp, &as->entry, ToPipe, as);
+
+	close(as->fd);
+	fclose(as->fp);
+	free(as);
+
+	return NULL;
+}
+
+/*
+ * Decompress entry on a thread of its own, returning the read end of a pipe
+ * it is written to. The pipe ends early if the data turns out to be bad.
+ * Takes ownership of fp, even on failure.
+ */
+FILE *StreamArchive(FILE *fp, const ArchiveEntry *entry)
+{
+	ArchiveStream *as = malloc(sizeof(*as));
+	pthread_t worker;
+	FILE *out = NULL;
+	int fds[2];
+
+	if (!as) {
+		fprintf(stderr, "Failed to alloc archive stream\n");
+		fclose(fp);
+		return NULL;
+	}
+
+	if (pipe(fds)) {
+		fprintf(stderr, "Failed to create pipe:\n  %s\n",
+			strerror(errno));
+		free(as);
+		fclose(fp);
+		return NULL;
+	}
+
+	if (!(out = fdopen(fds[0], "rb"))) {
+		fprintf(stderr, "Failed to open pipe:\n  %s\n",
+			strerror(errno));
+		goto fail;
+	}
+
+	as->fp = fp;
+	as->entry = *entry;
+	as->fd = fds[1];
+
+	if (pthread_create(&worker, NULL, StreamWorker, as)) {
+		fprintf(stderr, "Failed to start decompression thread\n");
+		fclose(out);
+		close(fds[1]);
+		free(as);
+		fclose(fp);
+		return NULL;
+	}
+
+	pthread_detach(worker);
+
+	return out;
+
+fail:
+	close(fds[0]);
+	close(fds[1]);
+	free(as);
+	fclose(fp);
+	return NULL;
+}
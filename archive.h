@@ -0,0 +1,37 @@
+/*
+ * SPDX-License-Identifier: CC0-1.0
+ *
+ * Author: James Jones
+ */
+
+#ifndef ARCHIVE_H_
+#define ARCHIVE_H_
+
+#include <sys/types.h> /* off_t */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Reading files straight out of .gz and .zip archives, so ROM libraries
+ * don't have to be extracted to disk first. Archives are recognized by
+ * their contents, not their names. Deflated data needs jaggd to be built
+ * with zlib.
+ */
+
+/* The file an archive holds. For zips with several, the biggest one. */
+typedef struct {
+	bool gzip;
+	bool deflated;		/* Otherwise stored as-is (zip only) */
+	off_t offset;		/* Start of its data in the archive */
+	uint64_t compSize;
+	uint32_t size;		/* Once decompressed */
+	char name[256];		/* Without any directories */
+} ArchiveEntry;
+
+extern bool FindArchiveEntry(const char *path, FILE *fp, bool *oFound,
+			     ArchiveEntry *entry);
+extern bool ExtractArchive(FILE *fp, const ArchiveEntry *entry, uint8_t *buf);
+extern FILE *StreamArchive(FILE *fp, const ArchiveEntry *entry);
+
+#endif /* ARCHIVE_H_ */
@@ -0,0 +1,251 @@
+#!/bin/sh
+#
+# SPDX-License-Identifier: CC0-1.0
+#
+# Author: James Jones
+#
+# Measures how fast jaggd moves data over a matrix of payload sizes, bulk
+# transfer chunk sizes and file formats, writes the results as CSV, and
+# compares them with a baseline. Run through 'make bench', or directly from
+# the top of the source tree:
+#
+#   bench/bench.sh [-o results.csv] [-b baseline.csv] [-t percent] [-n runs]
+#
+# By default the simulated GameDrive (gdsim.c) is used, with its link set up
+# by BENCH_BANDWIDTH (bytes/s), BENCH_LATENCY_US and BENCH_RESET_MS. It
+# stays on the bus through resets, so jaggd waits out its whole reset delay,
+# unless BENCH_RESET_DROP=1 makes it re-enumerate instead. Set
+# BENCH_DEVICE=real to use the first real GameDrive instead. Only wall clock
+# times can be measured then, and its memory and SD card will be written to.
+#
+# Each result is the median of several runs:
+#
+#   ttfb_us       Time to first byte: from startup to the first bulk data
+#                 reaching the device
+#   mb_per_s      Bulk data divided by the time from the first upload or
+#                 write file command to the last data arriving
+#   reset_exec_us From sending a reset to the uploaded program executing
+#   wall_us       Whole jaggd run, for information only
+#
+# With a baseline, any throughput more than the given percentage (default
+# 10) lower, or latency that much higher, is reported and makes the script
+# exit non-zero. Latency changes under a millisecond are ignored, as is
+# throughput for payloads under 1MiB. bench/baseline.csv is used if no other
+# baseline is given; it holds results for the default simulated link, and
+# can be refreshed with -o bench/baseline.csv.
+
+set -e
+
+BENCH_DEVICE=${BENCH_DEVICE:-sim}
+BENCH_SIZES=${BENCH_SIZES:-"65536 1048576 4194304"}
+BENCH_CHUNKS=${BENCH_CHUNKS:-"4096 16384 65536"}
+BENCH_FORMATS=${BENCH_FORMATS:-"bin cof elf"}
+BENCH_BANDWIDTH=${BENCH_BANDWIDTH:-40000000}
+BENCH_LATENCY_US=${BENCH_LATENCY_US:-125}
+BENCH_RESET_MS=${BENCH_RESET_MS:-250}
+BENCH_RESET_DROP=${BENCH_RESET_DROP:-0}
+
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:-"-std=c99 -O2 -Wall -Werror"}
+MAKE=${MAKE:-make}
+
+output=bench/results.csv
+baseline=
+tolerance=10
+runs=3
+
+[ -f bench/baseline.csv ] && baseline=bench/baseline.csv
+
+while getopts o:b:t:n: opt; do
+	case $opt in
+	o) output=$OPTARG ;;
+	b) baseline=$OPTARG ;;
+	t) tolerance=$OPTARG ;;
+	n) runs=$OPTARG ;;
+	*) echo "Usage: bench/bench.sh [-o results.csv] [-b baseline.csv]" \
+		"[-t percent] [-n runs]" >&2
+	   exit 1 ;;
+	esac
+done
+
+if [ ! -f jaggd.c ]; then
+	echo "Run bench/bench.sh from the top of the jaggd source tree" >&2
+	exit 1
+fi
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+echo "Building benchmark binaries..."
+
+$CC $CFLAGS -o "$work/mkpayload" bench/mkpayload.c
+
+# Build jaggd once per chunk size, out of a copy of the tree
+for chunk in $BENCH_CHUNKS; do
+	mkdir "$work/src-$chunk"
+	cp ./*.c ./*.h Makefile "$work/src-$chunk"
+	$MAKE -s -C "$work/src-$chunk" CC="$CC" LDFLAGS="$LDFLAGS" \
+		CFLAGS="$CFLAGS -DXFER_CHUNK_SIZE=$chunk" jaggd >/dev/null
+done
+
+if [ "$BENCH_DEVICE" = sim ]; then
+	$MAKE -s -C "$work/src-$chunk" CC="$CC" LDFLAGS="$LDFLAGS" \
+		CFLAGS="$CFLAGS" sim >/dev/null
+	cp "$work/src-$chunk/libgdsim.so" "$work/libgdsim.so"
+fi
+
+for fmt in $BENCH_FORMATS; do
+	for size in $BENCH_SIZES; do
+		"$work/mkpayload" "$fmt" "$size" "$work/payload-$size.$fmt"
+	done
+done
+
+now_us() {
+	echo $(($(date +%s%N) / 1000))
+}
+
+# Value of key in a line of GDSIM_STATS output
+get_stat() {
+	echo "$2" | tr ' ' '\n' | sed -n "s/^$1=//p"
+}
+
+# Median of the numbers on stdin, or nothing if there are none
+median() {
+	sort -n | awk '{ v[NR] = $1 } END { if (NR) print v[int((NR + 1) / 2)] }'
+}
+
+# run chunk payloadBytes jaggd-args...
+#
+# Run jaggd $runs times and print the median of each measurement as
+# "ttfb_us,mb_per_s,reset_exec_us,wall_us".
+run() {
+	chunk=$1
+	bytes=$2
+	shift 2
+
+	: > "$work/ttfb"; : > "$work/rate"; : > "$work/resetexec"
+	: > "$work/wall"
+
+	i=0
+	while [ $i -lt "$runs" ]; do
+		rm -f "$work/stats"
+		start=$(now_us)
+
+		if [ "$BENCH_DEVICE" = sim ]; then
+			env LD_PRELOAD="$work/libgdsim.so" \
+			    GDSIM_STATS="$work/stats" \
+			    GDSIM_BANDWIDTH="$BENCH_BANDWIDTH" \
+			    GDSIM_LATENCY_US="$BENCH_LATENCY_US" \
+			    GDSIM_RESET_MS="$BENCH_RESET_MS" \
+			    GDSIM_RESET_DROP="$BENCH_RESET_DROP" \
+			    XDG_CACHE_HOME="$work/cache" \
+			    JAGGD_SOCKET="$work/no-daemon" \
+			    "$work/src-$chunk/jaggd" "$@" >/dev/null
+		else
+			env XDG_CACHE_HOME="$work/cache" \
+			    JAGGD_SOCKET="$work/no-daemon" \
+			    "$work/src-$chunk/jaggd" "$@" >/dev/null
+		fi
+
+		wall=$(($(now_us) - start))
+		echo "$wall" >> "$work/wall"
+
+		if [ -f "$work/stats" ]; then
+			line=$(head -n 1 "$work/stats")
+			get_stat ttfb_us "$line" >> "$work/ttfb"
+			get_stat reset_exec_us "$line" >> "$work/resetexec"
+			xfer=$(get_stat xfer_us "$line")
+			got=$(get_stat bulk_bytes "$line")
+			[ -n "$xfer" ] && [ "$xfer" -gt 0 ] &&
+				awk "BEGIN { printf \"%.2f\\n\", $got / $xfer }" \
+				    >> "$work/rate"
+		else
+			awk "BEGIN { printf \"%.2f\\n\", $bytes / $wall }" \
+			    >> "$work/rate"
+		fi
+
+		i=$((i + 1))
+	done
+
+	echo "$(median < "$work/ttfb"),$(median < "$work/rate"),$(median < "$work/resetexec"),$(median < "$work/wall")"
+}
+
+echo "scenario,format,size,chunk,ttfb_us,mb_per_s,reset_exec_us,wall_us" \
+	> "$output"
+
+for chunk in $BENCH_CHUNKS; do
+	for fmt in $BENCH_FORMATS; do
+		# Executables say where they go, raw data goes to cartridge space
+		[ "$fmt" = bin ] && at=",a:\$802000" || at=
+
+		for size in $BENCH_SIZES; do
+			file="$work/payload-$size.$fmt"
+
+			echo "upload $fmt $size bytes, $chunk byte chunks"
+			echo "upload,$fmt,$size,$chunk,$(run "$chunk" "$size" \
+				-u "$file$at")" >> "$output"
+
+			if [ "$fmt" = bin ]; then
+				echo "write file $size bytes, $chunk byte chunks"
+				echo "writefile,$fmt,$size,$chunk,$(run "$chunk" \
+					"$size" -wf "$file")" >> "$output"
+			fi
+		done
+
+		# Reset to exec is about latency, so use the smallest payload
+		set -- $BENCH_SIZES
+		file="$work/payload-$1.$fmt"
+
+		echo "reset and execute $fmt $1 bytes, $chunk byte chunks"
+		echo "reset-exec,$fmt,$1,$chunk,$(run "$chunk" "$1" \
+			-r -ux "$file$at")" >> "$output"
+	done
+done
+
+echo "Results written to $output"
+
+if [ -z "$baseline" ]; then
+	exit 0
+fi
+
+echo "Comparing with $baseline (tolerance $tolerance%)"
+
+awk -F, -v tol="$tolerance" '
+	# Returns how much worse now is than then, in percent, if it is
+	function worse(then, now, higherIsBetter, absMin) {
+		if ((then == "") || (now == "") || (then == 0)) return 0;
+		if (!higherIsBetter && ((now - then) < absMin)) return 0;
+		if (higherIsBetter) return (then - now) * 100 / then;
+		return (now - then) * 100 / then;
+	}
+
+	function check(name, then, now, higherIsBetter) {
+		pct = worse(then, now, higherIsBetter, 1000);
+		if (pct > tol) {
+			printf("REGRESSION %s %s: %s -> %s (%.1f%% worse)\n",
+			       key, name, then, now, pct);
+			regressions++;
+		}
+	}
+
+	FNR == 1 { next }
+	NR == FNR { base[$1 "," $2 "," $3 "," $4] = $0; next }
+
+	{
+		key = $1 "," $2 "," $3 "," $4;
+		if (!(key in base)) next;
+		split(base[key], b, ",");
+		compared++;
+		check("ttfb_us", b[5], $5, 0);
+		# Small transfers are dominated by per-command overhead
+		if (($1 != "reset-exec") && ($3 >= 1048576))
+			check("mb_per_s", b[6], $6, 1);
+		check("reset_exec_us", b[7], $7, 0);
+	}
+
+	END {
+		printf("%d results compared, %d regressions\n",
+		       compared, regressions);
+		exit(regressions ? 1 : 0);
+	}
+' "$baseline" "$output"
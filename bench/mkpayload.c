@@ -0,0 +1,208 @@
+/*
+ * SPDX-License-Identifier: CC0-1.0
+ *
+ * Author: James Jones
+ */
+
+/*
+ * Writes benchmark payloads: raw binaries, or COFF and ELF executables with
+ * the given total amount of loadable data split between a text section in
+ * cartridge space and a data section in RAM, plus a symbol table that
+ * shouldn't be uploaded, or ROM images with the given amount of data after
+ * an $2000 byte blank header. Contents are pseudo-random so that they don't
+ * compress, and the same for every run.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define TEXT_ADDR 0x802000
+#define DATA_ADDR 0x4000
+
+static uint32_t seed = 0x4a616775;
+
+static void WriteRandom(FILE *fp, uint32_t size)
+{
+	uint8_t buf[4096];
+	uint32_t done, i;
+
+	for (done = 0; done < size; done += i) {
+		for (i = 0; (i < sizeof(buf)) && ((done + i) < size); i++) {
+			seed = seed * 1664525 + 1013904223;
+			buf[i] = seed >> 24;
+		}
+
+		fwrite(buf, 1, i, fp);
+	}
+}
+
+static void Put16(FILE *fp, uint16_t val)
+{
+	fputc(val >> 8, fp);
+	fputc(val & 0xff, fp);
+}
+
+static void Put32(FILE *fp, uint32_t val)
+{
+	Put16(fp, val >> 16);
+	Put16(fp, val & 0xffff);
+}
+
+static void PutZeros(FILE *fp, uint32_t count)
+{
+	while (count--) {
+		fputc(0, fp);
+	}
+}
+
+/* Blank header, then data that doesn't start with the padding value */
+static void WriteRom(FILE *fp, uint32_t size)
+{
+	uint32_t i;
+
+	for (i = 0; i < 0x2000; i++) {
+		fputc(0xff, fp);
+	}
+
+	fputc(0x60, fp);
+	WriteRandom(fp, size - 1);
+}
+
+static void CoffSection(FILE *fp, const char *name, uint32_t addr,
+			uint32_t size, uint32_t offset, uint32_t flags)
+{
+	size_t nameLen = strlen(name);
+
+	/* Names are NUL-padded to 8 bytes, without a terminator if 8 long */
+	fwrite(name, 1, nameLen, fp);
+	PutZeros(fp, 8 - nameLen);
+	Put32(fp, addr);	/* Physical address */
+	Put32(fp, addr);	/* Virtual address */
+	Put32(fp, size);
+	Put32(fp, offset);
+	PutZeros(fp, 4 + 4 + 2 + 2); /* Relocations and line numbers */
+	Put32(fp, flags);
+}
+
+static void WriteCoff(FILE *fp, uint32_t textSize, uint32_t dataSize,
+		      uint32_t symSize)
+{
+	const uint32_t textOff = 0x14 + 0x1c + 3 * 0x28;
+	const uint32_t dataOff = textOff + textSize;
+
+	/* File header */
+	Put16(fp, 0x150);
+	Put16(fp, 3);		/* Sections */
+	Put32(fp, 0);		/* Time stamp */
+	Put32(fp, dataOff + dataSize); /* Symbol table */
+	Put32(fp, symSize / 18);
+	Put16(fp, 0x1c);	/* Run header size */
+	Put16(fp, 0);
+
+	/* Run header */
+	Put16(fp, 0x107);
+	Put16(fp, 0);
+	Put32(fp, textSize);
+	Put32(fp, dataSize);
+	Put32(fp, 0x1000);	/* BSS size */
+	Put32(fp, TEXT_ADDR);	/* Entry point */
+	Put32(fp, TEXT_ADDR);
+	Put32(fp, DATA_ADDR);
+
+	CoffSection(fp, ".text", TEXT_ADDR, textSize, textOff, 0x20);
+	CoffSection(fp, ".data", DATA_ADDR, dataSize, dataOff, 0x40);
+	CoffSection(fp, ".bss", DATA_ADDR + dataSize, 0x1000, 0, 0x80);
+
+	WriteRandom(fp, textSize + dataSize + symSize);
+}
+
+static void ElfSegment(FILE *fp, uint32_t offset, uint32_t addr,
+		       uint32_t fileSize, uint32_t memSize, uint32_t flags)
+{
+	Put32(fp, 1);		/* PT_LOAD */
+	Put32(fp, offset);
+	Put32(fp, addr);	/* Virtual address */
+	Put32(fp, addr);	/* Physical address */
+	Put32(fp, fileSize);
+	Put32(fp, memSize);
+	Put32(fp, flags);
+	Put32(fp, 0x1000);	/* Alignment */
+}
+
+static void WriteElf(FILE *fp, uint32_t textSize, uint32_t dataSize,
+		     uint32_t symSize)
+{
+	static const uint8_t ident[16] = {
+		0x7f, 'E', 'L', 'F',
+		1,	/* 32-bit */
+		2,	/* Big-endian */
+		1,	/* Version */
+	};
+	const uint32_t textOff = 0x1000;
+	const uint32_t dataOff = textOff + textSize;
+
+	fwrite(ident, 1, sizeof(ident), fp);
+	Put16(fp, 2);		/* ET_EXEC */
+	Put16(fp, 4);		/* EM_68K */
+	Put32(fp, 1);		/* Version */
+	Put32(fp, TEXT_ADDR);	/* Entry point */
+	Put32(fp, 0x34);	/* Program headers */
+	Put32(fp, 0);		/* Section headers */
+	Put32(fp, 0);		/* Flags */
+	Put16(fp, 0x34);	/* ELF header size */
+	Put16(fp, 0x20);	/* Program header size */
+	Put16(fp, 2);		/* Program headers */
+	Put16(fp, 0x28);	/* Section header size */
+	Put16(fp, 0);		/* Section headers */
+	Put16(fp, 0);		/* Section name table */
+
+	ElfSegment(fp, textOff, TEXT_ADDR, textSize, textSize, 5);
+	ElfSegment(fp, dataOff, DATA_ADDR, dataSize, dataSize + 0x1000, 6);
+
+	PutZeros(fp, textOff - (0x34 + 2 * 0x20));
+	WriteRandom(fp, textSize + dataSize + symSize);
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t size, dataSize;
+	FILE *fp;
+
+	if (argc != 4) {
+		fprintf(stderr, "Usage: mkpayload bin|cof|elf|rom size file\n");
+		return -1;
+	}
+
+	size = strtoul(argv[2], NULL, 0);
+
+	/* An eighth of an executable's data goes to RAM */
+	dataSize = (size / 8) & ~1u;
+
+	if (!(fp = fopen(argv[3], "wb"))) {
+		fprintf(stderr, "Failed to create '%s'\n", argv[3]);
+		return -1;
+	}
+
+	if (!strcmp(argv[1], "bin")) {
+		WriteRandom(fp, size);
+	} else if (!strcmp(argv[1], "cof")) {
+		WriteCoff(fp, size - dataSize, dataSize, size / 4);
+	} else if (!strcmp(argv[1], "elf")) {
+		WriteElf(fp, size - dataSize, dataSize, size / 4);
+	} else if (!strcmp(argv[1], "rom")) {
+		WriteRom(fp, size);
+	} else {
+		fprintf(stderr, "Unknown payload format '%s'\n", argv[1]);
+		fclose(fp);
+		return -1;
+	}
+
+	if (fclose(fp)) {
+		fprintf(stderr, "Failed to write '%s'\n", argv[3]);
+		return -1;
+	}
+
+	return 0;
+}
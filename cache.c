@@ -0,0 +1,97 @@
+/*
+ * SPDX-License-Identifier: CC0-1.0
+ *
+ * Author: James Jones
+ */
+
+/* Needed to get mkdir() definition with -std=c99 */
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+
+static bool MakeDir(const char *path)
+{
+	if (mkdir(path, 0755) && (errno != EEXIST)) {
+		fprintf(stderr, "Failed to create '%s':\n  %s\n",
+			path, strerror(errno));
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Locate the directory jaggd keeps per-host state in: $XDG_CACHE_HOME/jaggd,
+ * or ~/.cache/jaggd if that isn't set. If create is false, failures are
+ * silent and the directory may not exist yet.
+ */
+bool CacheDir(char *path, size_t pathLen, bool create)
+{
+	const char *base = getenv("XDG_CACHE_HOME");
+	int len;
+
+	if (base && (base[0] != '\0')) {
+		if (create && !MakeDir(base)) return false;
+		len = snprintf(path, pathLen, "%s/jaggd", base);
+	} else {
+		const char *home = getenv("HOME");
+
+		if (!home || (home[0] == '\0')) {
+			if (create) {
+				fprintf(stderr, "Neither XDG_CACHE_HOME nor "
+					"HOME is set\n");
+			}
+			return false;
+		}
+
+		len = snprintf(path, pathLen, "%s/.cache", home);
+		if ((len < 0) || ((size_t)len >= pathLen)) goto toolong;
+		if (create && !MakeDir(path)) return false;
+		len = snprintf(path, pathLen, "%s/.cache/jaggd", home);
+	}
+
+	if ((len < 0) || ((size_t)len >= pathLen)) goto toolong;
+
+	return !create || MakeDir(path);
+
+toolong:
+	if (create) fprintf(stderr, "Cache directory path is too long\n");
+	return false;
+}
+
+/* Build the path of a file in the cache directory from a format string */
+bool CachePath(char *path, size_t pathLen, const char *fmt, ...)
+{
+	va_list ap;
+	size_t dirLen;
+	int len;
+
+	if (!CacheDir(path, pathLen, true)) {
+		return false;
+	}
+
+	dirLen = strlen(path);
+
+	if (dirLen + 1 >= pathLen) goto toolong;
+
+	path[dirLen++] = '/';
+
+	va_start(ap, fmt);
+	len = vsnprintf(path + dirLen, pathLen - dirLen, fmt, ap);
+	va_end(ap);
+
+	if ((len < 0) || ((size_t)len >= (pathLen - dirLen))) goto toolong;
+
+	return true;
+
+toolong:
+	fprintf(stderr, "Cache file path is too long\n");
+	return false;
+}
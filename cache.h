@@ -0,0 +1,17 @@
+/*
+ * SPDX-License-Identifier: CC0-1.0
+ *
+ * Author: James Jones
+ */
+
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+extern bool CacheDir(char *path, size_t pathLen, bool create);
+extern bool CachePath(char *path, size_t pathLen, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+#endif /* CACHE_H_ */
@@ -0,0 +1,434 @@
+/*
+ * SPDX-License-Identifier: CC0-1.0
+ *
+ * Author: James Jones
+ */
+
+/* Needed to get socket, fd-passing and ucred definitions with -std=c99 */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "daemon.h"
+
+/*
+ * Clients connect to the daemon over a Unix domain socket and send their
+ * command line along with their stdin, stdout, stderr and current directory
+ * as file descriptors. The daemon runs the command with those in place, so
+ * output and relative paths behave exactly as if the client had run it,
+ * then replies with the exit code.
+ *
+ * Request:  uint32_t argc, then argc x { uint32_t len, len bytes }
+ *           SCM_RIGHTS: stdin, stdout, stderr, cwd
+ * Reply:    int32_t exit code
+ */
+#define NUM_PASSED_FDS 4
+#define MAX_ARGS 256
+#define MAX_ARG_LEN 4096
+
+static volatile sig_atomic_t stopDaemon;
+
+/*
+ * Work out where the daemon listens. Without XDG_RUNTIME_DIR, that is in a
+ * directory of our own under /tmp, which the daemon creates if create is
+ * set, so nobody else can put a socket where clients look for one.
+ */
+static bool SocketAddr(struct sockaddr_un *addr, bool create)
+{
+	const char *path = getenv("JAGGD_SOCKET");
+	const char *runDir = getenv("XDG_RUNTIME_DIR");
+	char dir[64];
+	struct stat st;
+	int len;
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+
+	if (path && (path[0] != '\0')) {
+		len = snprintf(addr->sun_path, sizeof(addr->sun_path),
+			       "%s", path);
+	} else if (runDir && (runDir[0] != '\0')) {
+		len = snprintf(addr->sun_path, sizeof(addr->sun_path),
+			       "%s/jaggd.sock", runDir);
+	} else {
+		snprintf(dir, sizeof(dir), "/tmp/jaggd-%u",
+			 (unsigned int)getuid());
+
+		if (create && mkdir(dir, S_IRWXU) && (errno != EEXIST)) {
+			fprintf(stderr, "Failed to create %s:\n  %s\n",
+				dir, strerror(errno));
+			return false;
+		}
+
+		if (create &&
+		    (lstat(dir, &st) || !S_ISDIR(st.st_mode) ||
+		     (st.st_uid != getuid()) ||
+		     (st.st_mode & (S_IRWXG | S_IRWXO)))) {
+			fprintf(stderr, "%s must be a directory only you can "
+				"use\n", dir);
+			return false;
+		}
+
+		len = snprintf(addr->sun_path, sizeof(addr->sun_path),
+			       "%s/jaggd.sock", dir);
+	}
+
+	if ((len < 0) || ((size_t)len >= sizeof(addr->sun_path))) {
+		fprintf(stderr, "Daemon socket path is too long\n");
+		return false;
+	}
+
+	return true;
+}
+
+/* Only ever talk to our own user's jaggd */
+static bool PeerIsUs(int sock)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	return !getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) &&
+		(len == sizeof(cred)) && (cred.uid == getuid());
+}
+
+static bool ReadAll(int fd, void *buf, size_t len)
+{
+	uint8_t *ptr = buf;
+
+	while (len > 0) {
+		ssize_t res = read(fd, ptr, len);
+
+		if (res < 0 && errno == EINTR) continue;
+		if (res <= 0) return false;
+
+		ptr += res;
+		len -= res;
+	}
+
+	return true;
+}
+
+static bool WriteAll(int fd, const void *buf, size_t len)
+{
+	const uint8_t *ptr = buf;
+
+	while (len > 0) {
+		ssize_t res = write(fd, ptr, len);
+
+		if (res < 0 && errno == EINTR) continue;
+		if (res <= 0) return false;
+
+		ptr += res;
+		len -= res;
+	}
+
+	return true;
+}
+
+/*
+ * Returns true if the command was handled by a daemon, false if there is no
+ * daemon to forward it to and it should be run locally.
+ */
+bool ForwardToDaemon(int argc, char *argv[], int *oExitCode)
+{
+	struct sockaddr_un addr;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int) * NUM_PASSED_FDS)];
+	} ctrl;
+	int fds[NUM_PASSED_FDS] = {
+		STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, -1
+	};
+	uint32_t count = argc;
+	struct iovec iov = { &count, sizeof(count) };
+	struct msghdr msg = { 0 };
+	struct cmsghdr *cmsg;
+	int32_t exitCode;
+	int sock;
+	int i;
+
+	if (!SocketAddr(&addr, false)) {
+		return false;
+	}
+
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		return false;
+	}
+
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+		/* No daemon running */
+		close(sock);
+		return false;
+	}
+
+	/* Our stdio and directory are not for anyone else's process */
+	if (!PeerIsUs(sock)) {
+		fprintf(stderr, "Ignoring %s: it isn't a jaggd daemon run by "
+			"you\n", addr.sun_path);
+		close(sock);
+		return false;
+	}
+
+	if ((fds[3] = open(".", O_RDONLY | O_DIRECTORY)) < 0) {
+		fprintf(stderr, "Failed to open current directory:\n  %s\n",
+			strerror(errno));
+		goto fail;
+	}
+
+	memset(&ctrl, 0, sizeof(ctrl));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctrl.buf;
+	msg.msg_controllen = sizeof(ctrl.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	/* Anything already buffered must come out before the daemon's output */
+	fflush(stdout);
+	fflush(stderr);
+
+	if (sendmsg(sock, &msg, 0) != sizeof(count)) {
+		goto lost;
+	}
+
+	for (i = 0; i < argc; i++) {
+		uint32_t len = strlen(argv[i]);
+
+		if (!WriteAll(sock, &len, sizeof(len)) ||
+		    !WriteAll(sock, argv[i], len)) {
+			goto lost;
+		}
+	}
+
+	if (!ReadAll(sock, &exitCode, sizeof(exitCode))) {
+		goto lost;
+	}
+
+	*oExitCode = exitCode;
+	close(fds[3]);
+	close(sock);
+	return true;
+
+lost:
+	fprintf(stderr, "Lost connection to jaggd daemon at %s\n",
+		addr.sun_path);
+fail:
+	if (fds[3] >= 0) close(fds[3]);
+	close(sock);
+	*oExitCode = -1;
+	return true;
+}
+
+static void FreeArgs(char **args, uint32_t count)
+{
+	uint32_t i;
+
+	for (i = 0; i < count; i++) {
+		free(args[i]);
+	}
+
+	free(args);
+}
+
+static void ServeClient(int conn, DaemonCmdFn runCmd, void *data)
+{
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int) * NUM_PASSED_FDS)];
+	} ctrl;
+	int fds[NUM_PASSED_FDS] = { -1, -1, -1, -1 };
+	uint32_t count = 0;
+	struct iovec iov = { &count, sizeof(count) };
+	struct msghdr msg = { 0 };
+	struct cmsghdr *cmsg;
+	char **args = NULL;
+	uint32_t numArgs = 0;
+	int savedIn = -1, savedOut = -1, savedErr = -1, savedCwd = -1;
+	int32_t exitCode = -1;
+	int i;
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctrl.buf;
+	msg.msg_controllen = sizeof(ctrl.buf);
+
+	if (!PeerIsUs(conn) || (recvmsg(conn, &msg, 0) != sizeof(count))) {
+		return;
+	}
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if ((cmsg->cmsg_level == SOL_SOCKET) &&
+		    (cmsg->cmsg_type == SCM_RIGHTS) &&
+		    (cmsg->cmsg_len == CMSG_LEN(sizeof(fds)))) {
+			memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+		}
+	}
+
+	if ((fds[0] < 0) || (fds[1] < 0) || (fds[2] < 0) || (fds[3] < 0) ||
+	    (count < 1) || (count > MAX_ARGS)) {
+		goto cleanup;
+	}
+
+	if (!(args = calloc(count + 1, sizeof(*args)))) {
+		goto cleanup;
+	}
+
+	for (numArgs = 0; numArgs < count; numArgs++) {
+		uint32_t len;
+
+		if (!ReadAll(conn, &len, sizeof(len)) ||
+		    (len > MAX_ARG_LEN) ||
+		    !(args[numArgs] = malloc(len + 1)) ||
+		    !ReadAll(conn, args[numArgs], len)) {
+			goto cleanup;
+		}
+
+		args[numArgs][len] = '\0';
+	}
+
+	/* Step into the client's shoes */
+	fflush(stdout);
+	fflush(stderr);
+
+	if (((savedCwd = open(".", O_RDONLY | O_DIRECTORY)) < 0) ||
+	    ((savedIn = dup(STDIN_FILENO)) < 0) ||
+	    ((savedOut = dup(STDOUT_FILENO)) < 0) ||
+	    ((savedErr = dup(STDERR_FILENO)) < 0) ||
+	    fchdir(fds[3]) ||
+	    (dup2(fds[0], STDIN_FILENO) < 0) ||
+	    (dup2(fds[1], STDOUT_FILENO) < 0) ||
+	    (dup2(fds[2], STDERR_FILENO) < 0)) {
+		fprintf(stderr, "Failed to take over client's stdio:\n  %s\n",
+			strerror(errno));
+		goto restore;
+	}
+
+	exitCode = runCmd(count, args, data);
+
+	fflush(stdout);
+	fflush(stderr);
+
+restore:
+	if (savedIn >= 0) dup2(savedIn, STDIN_FILENO);
+	if (savedOut >= 0) dup2(savedOut, STDOUT_FILENO);
+	if (savedErr >= 0) dup2(savedErr, STDERR_FILENO);
+	if ((savedCwd >= 0) && fchdir(savedCwd)) {
+		fprintf(stderr, "Failed to restore working directory\n");
+	}
+
+	WriteAll(conn, &exitCode, sizeof(exitCode));
+
+cleanup:
+	if (savedIn >= 0) close(savedIn);
+	if (savedOut >= 0) close(savedOut);
+	if (savedErr >= 0) close(savedErr);
+	if (savedCwd >= 0) close(savedCwd);
+
+	for (i = 0; i < NUM_PASSED_FDS; i++) {
+		if (fds[i] >= 0) close(fds[i]);
+	}
+
+	FreeArgs(args, numArgs);
+}
+
+static void StopDaemon(int sig)
+{
+	stopDaemon = 1;
+}
+
+/*
+ * Serve forwarded commands one at a time until SIGINT or SIGTERM. Commands
+ * are never run concurrently, so each has the device to itself.
+ */
+int RunDaemon(DaemonCmdFn runCmd, void *data)
+{
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	mode_t oldMask;
+	int sock;
+	int exitCode = -1;
+	bool listening;
+
+	if (!SocketAddr(&addr, true)) {
+		return -1;
+	}
+
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		fprintf(stderr, "Failed to create daemon socket:\n  %s\n",
+			strerror(errno));
+		return -1;
+	}
+
+	if (!connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+		fprintf(stderr, "A jaggd daemon is already listening on %s\n",
+			addr.sun_path);
+		close(sock);
+		return -1;
+	}
+
+	/* Whatever is there is stale */
+	unlink(addr.sun_path);
+
+	/* Created private, rather than made private after others could connect */
+	oldMask = umask(S_IRWXG | S_IRWXO);
+	listening = !bind(sock, (struct sockaddr *)&addr, sizeof(addr)) &&
+		!listen(sock, 8);
+	umask(oldMask);
+
+	if (!listening) {
+		fprintf(stderr, "Failed to listen on %s:\n  %s\n",
+			addr.sun_path, strerror(errno));
+		close(sock);
+		return -1;
+	}
+
+	/* No SA_RESTART, so accept() returns when asked to stop */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = StopDaemon;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	/* Clients going away mid-command must not take the daemon with them */
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("Listening on %s\n", addr.sun_path);
+	fflush(stdout);
+
+	while (!stopDaemon) {
+		int conn = accept(sock, NULL, NULL);
+
+		if (conn < 0) {
+			if (errno == EINTR) continue;
+
+			fprintf(stderr, "Failed to accept connection:\n  %s\n",
+				strerror(errno));
+			goto done;
+		}
+
+		ServeClient(conn, runCmd, data);
+		close(conn);
+	}
+
+	printf("Daemon exiting\n");
+	exitCode = 0;
+
+done:
+	close(sock);
+	unlink(addr.sun_path);
+
+	return exitCode;
+}
@@ -0,0 +1,21 @@
+/*
+ * SPDX-License-Identifier: CC0-1.0
+ *
+ * Author: James Jones
+ */
+
+#ifndef DAEMON_H_
+#define DAEMON_H_
+
+#include <stdbool.h>
+
+/*
+ * Runs one forwarded command line with the client's stdout, stderr and
+ * working directory in place, returning its exit code.
+ */
+typedef int (*DaemonCmdFn)(int argc, char *argv[], void *data);
+
+extern bool ForwardToDaemon(int argc, char *argv[], int *oExitCode);
+extern int RunDaemon(DaemonCmdFn runCmd, void *data);
+
+#endif /* DAEMON_H_ */
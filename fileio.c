@@ -4,11 +4,20 @@
  * Author: James Jones
  */
 
+/* Needed to get fileno() and mmap() definitions with -std=c99 */
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 
+#include "archive.h"
 #include "fileio.h"
 
 static inline uint32_t read32BE(const void *ptr)
@@ -21,6 +30,14 @@ static inline uint32_t read32BE(const void *ptr)
 		(uint32_t)data[3];
 }
 
+static inline uint16_t read16BE(const void *ptr)
+{
+	const uint8_t *data = ptr;
+
+	return (uint16_t)data[0] << 8 |
+		(uint16_t)data[1];
+}
+
 static bool IsRomHeader(const JagFile *jf, off_t offset, uint32_t *romExecAddr)
 {
 	uint8_t *ptr;
@@ -60,6 +77,188 @@ static bool IsRomHeader(const JagFile *jf, off_t offset, uint32_t *romExecAddr)
 	return true;
 }
 
+/*
+ * Add a section to a file's section list, merging it into the previous
+ * section when the two are contiguous both in the file and in Jaguar memory.
+ */
+static bool AddSection(JagFile *jf, off_t offset, uint32_t addr,
+		       uint32_t size, bool bss)
+{
+	JagSection *prev = jf->numSections ?
+		&jf->sections[jf->numSections - 1] : NULL;
+
+	if (size == 0) {
+		return true;
+	}
+
+	if (!bss && ((offset < 0) || ((uint64_t)offset + size > jf->length))) {
+		/* Section data runs past the end of the file */
+		return false;
+	}
+
+	if (prev && !prev->bss && !bss &&
+	    ((prev->offset + prev->size) == offset) &&
+	    ((prev->addr + prev->size) == addr)) {
+		prev->size += size;
+		return true;
+	}
+
+	if (jf->numSections >= JAG_MAX_SECTIONS) {
+		return false;
+	}
+
+	jf->sections[jf->numSections].offset = offset;
+	jf->sections[jf->numSections].addr = addr;
+	jf->sections[jf->numSections].size = size;
+	jf->sections[jf->numSections].bss = bss;
+	jf->numSections++;
+
+	return true;
+}
+
+/* Point offset, dataSize and baseAddr at the first section with data */
+static bool UseFirstSection(JagFile *jf)
+{
+	unsigned int i;
+
+	for (i = 0; i < jf->numSections; i++) {
+		if (!jf->sections[i].bss) {
+			jf->offset = jf->sections[i].offset;
+			jf->dataSize = jf->sections[i].size;
+			jf->baseAddr = jf->sections[i].addr;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Build the section list of a COFF file from its section headers, so that
+ * only text and data are uploaded. Symbol tables, debug info and anything
+ * else that only matters to the host are left behind.
+ */
+static bool InferCoffSections(JagFile *jf)
+{
+	static const uint32_t STYP_TEXT = 0x20;
+	static const uint32_t STYP_DATA = 0x40;
+	static const uint32_t STYP_BSS = 0x80;
+	static const size_t SCN_HDR_SIZE = 0x28;
+
+	const uint16_t numScns = read16BE(jf->buf+0x02);
+	const uint16_t optHdrSize = read16BE(jf->buf+0x10);
+	const size_t scnHdrs = 0x14 + optHdrSize;
+	unsigned int i;
+
+	/* Need the run header for the text and data addresses */
+	if ((optHdrSize < 0x1c) ||
+	    ((scnHdrs + numScns * SCN_HDR_SIZE) > jf->length)) {
+		return false;
+	}
+
+	jf->numSections = 0;
+
+	for (i = 0; i < numScns; i++) {
+		const uint8_t *scn = jf->buf + scnHdrs + i * SCN_HDR_SIZE;
+		const uint32_t size = read32BE(scn+0x10);
+		const uint32_t flags = read32BE(scn+0x24);
+		const off_t offset = read32BE(scn+0x14);
+		bool success;
+
+		if (flags & STYP_TEXT) {
+			/*
+			 * Use the run header text base address rather than the
+			 * section header's. JiFFI appears to hard-code the
+			 * latter to 0x4000.
+			 */
+			success = AddSection(jf, offset,
+					     read32BE(jf->buf+0x28),
+					     size, false);
+		} else if (flags & STYP_DATA) {
+			/* run header data base address */
+			success = AddSection(jf, offset,
+					     read32BE(jf->buf+0x2c),
+					     size, false);
+		} else if (flags & STYP_BSS) {
+			/*
+			 * The run header has no BSS address, and the linker
+			 * may place it anywhere, so use the section header's.
+			 */
+			success = AddSection(jf, 0, read32BE(scn+0x08),
+					     size, true);
+		} else {
+			/* Not loaded on the Jaguar */
+			success = true;
+		}
+
+		if (!success) {
+			return false;
+		}
+	}
+
+	return UseFirstSection(jf);
+}
+
+/*
+ * Build the section list of a big-endian 32-bit ELF file from the PT_LOAD
+ * entries of its program header table. Only the file-backed bytes of each
+ * segment are uploaded, to its physical address. Section headers, and so
+ * symbols and debug info, are never looked at.
+ */
+static bool InferElfSegments(JagFile *jf)
+{
+	static const uint8_t ELFCLASS32 = 1;
+	static const uint8_t ELFDATA2MSB = 2;
+	static const uint32_t PT_LOAD = 1;
+	static const size_t PHDR_SIZE = 0x20;
+
+	uint32_t phOff;
+	uint16_t phEntSize, phNum;
+	unsigned int i;
+
+	if ((jf->buf[4] != ELFCLASS32) || (jf->buf[5] != ELFDATA2MSB) ||
+	    (jf->length < 0x34)) {
+		return false;
+	}
+
+	jf->execAddr = read32BE(jf->buf+0x18);
+	phOff = read32BE(jf->buf+0x1c);
+	phEntSize = read16BE(jf->buf+0x2a);
+	phNum = read16BE(jf->buf+0x2c);
+
+	if ((phEntSize < PHDR_SIZE) ||
+	    (((uint64_t)phOff + (uint64_t)phNum * phEntSize) > jf->length)) {
+		return false;
+	}
+
+	jf->numSections = 0;
+
+	for (i = 0; i < phNum; i++) {
+		const uint8_t *ph = jf->buf + phOff + i * phEntSize;
+		const uint32_t offset = read32BE(ph+0x04);
+		const uint32_t paddr = read32BE(ph+0x0c);
+		const uint32_t fileSize = read32BE(ph+0x10);
+		const uint32_t memSize = read32BE(ph+0x14);
+
+		if (read32BE(ph+0x00) != PT_LOAD) {
+			continue;
+		}
+
+		if (!AddSection(jf, offset, paddr, fileSize, false)) {
+			return false;
+		}
+
+		/* The rest of the segment is zero-initialized, like BSS */
+		if ((memSize > fileSize) &&
+		    !AddSection(jf, 0, paddr + fileSize, memSize - fileSize,
+				true)) {
+			return false;
+		}
+	}
+
+	return UseFirstSection(jf);
+}
+
 static bool InferFileInfo(JagFile *jf, const char *fileName)
 {
 	size_t fileNameLen = strlen(fileName);
@@ -85,20 +284,17 @@ static bool InferFileInfo(JagFile *jf, const char *fileName)
 		/* run header exec value */
 		jf->execAddr = read32BE(jf->buf+0x24);
 
+		if (InferCoffSections(jf)) {
+			return true;
+		}
+
 		/*
-		 * run header text base address.
-		 *
-		 * NOTE: Don't use the text section header start address.
-		 * JiFFI appears to hard-code that one to 0x4000.
+		 * Couldn't make sense of the section headers. Send everything
+		 * from the start of text on, and hope for the best.
 		 */
+		jf->numSections = 0;
 		jf->baseAddr = read32BE(jf->buf+0x28);
-
-		/* text section header offset */
 		jf->offset = read32BE(jf->buf+0x44);
-
-		/* XXX Assumes data section is contiguous with text on Jaguar */
-
-		/* XXX Will read & transfer symbol sections too */
 		jf->dataSize = jf->length - jf->offset;
 		return true;
 	}
@@ -106,7 +302,16 @@ static bool InferFileInfo(JagFile *jf, const char *fileName)
 	if ((jf->length > 0x30) && (jf->buf[0] == 0x7f) &&
 	    (jf->buf[1] == 'E') && (jf->buf[2] == 'L') &&
 	    (jf->buf[3] == 'F')) {
-		/* XXX ELF File */
+		/* ELF File */
+		if (InferElfSegments(jf)) {
+			return true;
+		}
+
+		/* Don't leave the segments found so far to be uploaded */
+		jf->numSections = 0;
+
+		fprintf(stderr, "Unsupported ELF file. Uploading it as raw "
+			"data.\n");
 		return false;
 	}
 	
@@ -184,7 +389,14 @@ static bool InferFileInfo(JagFile *jf, const char *fileName)
 	return false;
 }
 
-JagFile *LoadFile(const char *fileName)
+/*
+ * Load a file to upload and work out its format. If map is set, plain files
+ * are mapped rather than read in. A mapped file must not shrink until it is
+ * freed: the system raises SIGBUS on reading mapped pages that are no
+ * longer backed by the file, whatever the mapping's flags. Clear map for
+ * files that may be rewritten while they are being uploaded.
+ */
+JagFile *LoadFile(const char *fileName, bool map)
 {
 	/* Refuse to load files > 17MB in size */
 	static const size_t MAX_SIZE = 17 * 1024 * 1024;
@@ -192,6 +404,8 @@ JagFile *LoadFile(const char *fileName)
 	JagFile *jf = NULL;
 	FILE *hFile = NULL;
 	size_t fileSize = 0;
+	ArchiveEntry entry;
+	bool archive = false;
 	bool done = false;
 
 	hFile = fopen(fileName, "rb");
@@ -202,13 +416,18 @@ JagFile *LoadFile(const char *fileName)
 		goto cleanup;
 	}
 
+	if (!FindArchiveEntry(fileName, hFile, &archive, &entry)) {
+		/* FindArchiveEntry prints its own error messages */
+		goto cleanup;
+	}
+
 	if (fseek(hFile, 0, SEEK_END)) {
 		fprintf(stderr, "Failed to find end of '%s':\n  %s\n",
 			fileName, strerror(errno));
 		goto cleanup;
 	}
 
-	fileSize = ftell(hFile);
+	fileSize = archive ? entry.size : ftell(hFile);
 
 	if (fileSize < 0) {
 		fprintf(stderr, "Failed to query size of '%s':\n  %s\n",
@@ -235,28 +454,72 @@ JagFile *LoadFile(const char *fileName)
 		goto cleanup;
 	}
 
-	jf->buf = malloc(fileSize);
 	jf->length = fileSize;
 
-	if (!jf->buf) {
-		fprintf(stderr, "Failed to alloc %zd bytes for file buffer\n",
-			fileSize);
-		goto cleanup;
+#ifndef _WIN32
+	/*
+	 * Map the file rather than reading it in. Format detection below only
+	 * faults in the header pages it looks at, and the upload then reads
+	 * just the requested window straight out of the page cache.
+	 */
+	if (map && !archive && (fileSize > 0)) {
+		void *mem = mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE,
+				 fileno(hFile), 0);
+
+		if (mem != MAP_FAILED) {
+			jf->buf = mem;
+			jf->mapped = true;
+		}
 	}
+#endif
 
-	if (fread(jf->buf, 1, fileSize, hFile) != fileSize) {
-		fprintf(stderr, "Failed to read %zd bytes from %s:\n  %s\n",
-			fileSize, fileName, strerror(errno));
-		goto cleanup;
+	if (!jf->mapped) {
+		/*
+		 * Not mappable (e.g., a pipe), compressed, or not to be
+		 * mapped. Fall back to reading it all.
+		 */
+		jf->buf = malloc(fileSize);
+
+		if (!jf->buf) {
+			fprintf(stderr, "Failed to alloc %zd bytes for file "
+				"buffer\n", fileSize);
+			goto cleanup;
+		}
+
+		if (archive) {
+			if (!ExtractArchive(hFile, &entry, jf->buf)) {
+				/* ExtractArchive prints its own errors */
+				goto cleanup;
+			}
+		} else if (fread(jf->buf, 1, fileSize, hFile) != fileSize) {
+			fprintf(stderr, "Failed to read %zd bytes from %s:\n"
+				"  %s\n", fileSize, fileName, strerror(errno));
+			goto cleanup;
+		}
 	}
 
-	if (!InferFileInfo(jf, fileName)) {
+	/* Archived files go by their own names */
+	if (!InferFileInfo(jf, archive ? entry.name : fileName)) {
 		jf->baseAddr = 0x4000;
 		jf->execAddr = jf->baseAddr;
 		jf->offset = 0;
 		jf->dataSize = jf->length;
 	}
 
+	/* Headers can claim more data than the file holds */
+	if ((jf->offset < 0) || ((size_t)jf->offset > jf->length)) {
+		fprintf(stderr, "'%s' is truncated: its data starts past the "
+			"end of the file\n", fileName);
+		goto cleanup;
+	}
+
+	if (jf->dataSize > (jf->length - (size_t)jf->offset)) {
+		fprintf(stderr, "'%s' is truncated: uploading the %zu of %zu "
+			"bytes it holds\n", fileName,
+			jf->length - (size_t)jf->offset, jf->dataSize);
+		jf->dataSize = jf->length - (size_t)jf->offset;
+	}
+
 	done = true;
 
 cleanup:
@@ -271,22 +534,78 @@ cleanup:
 	return jf;
 }
 
+/*
+ * Let the kernel know the upload window of a mapped file is about to be read
+ * front to back, so it can start reading ahead before the first transfer.
+ */
+static void PrefetchRange(const JagFile *jf, off_t offset, size_t size,
+			  long pageSize)
+{
+	uintptr_t start, end;
+
+	if (size == 0) {
+		return;
+	}
+
+	start = (uintptr_t)(jf->buf + offset) & ~((uintptr_t)pageSize - 1);
+	end = (uintptr_t)(jf->buf + offset + size);
+
+	/* Purely advisory, so failures are harmless */
+	madvise((void *)start, end - start, MADV_SEQUENTIAL);
+	madvise((void *)start, end - start, MADV_WILLNEED);
+}
+
+void PrefetchFile(const JagFile *jf)
+{
+#ifndef _WIN32
+	long pageSize = sysconf(_SC_PAGESIZE);
+	unsigned int i;
+
+	if (!jf->mapped || (pageSize <= 0)) {
+		return;
+	}
+
+	if (jf->numSections == 0) {
+		PrefetchRange(jf, jf->offset, jf->dataSize, pageSize);
+	}
+
+	for (i = 0; i < jf->numSections; i++) {
+		if (!jf->sections[i].bss) {
+			PrefetchRange(jf, jf->sections[i].offset,
+				      jf->sections[i].size, pageSize);
+		}
+	}
+#endif
+}
+
 void FreeFile(JagFile *jf)
 {
 	if (jf) {
-		free(jf->buf); jf->buf = NULL;
+#ifndef _WIN32
+		if (jf->mapped) {
+			munmap(jf->buf, jf->length);
+		} else
+#endif
+		{
+			free(jf->buf);
+		}
+		jf->buf = NULL;
 		free(jf);
 	}
 }
 
-		const char *dstFileName;
-		uint32_t size;
-		uint32_t bytesUploaded = 0;
-
-FILE *PrepFile(const char *filePath, const char **dstFileName, uint32_t *size)
+/*
+ * Open a file to write to the SD card, and work out its name there, which
+ * dstFileName must have room for. With extract set, a file in an archive
+ * is written rather than the archive itself, decompressed as it is read.
+ */
+FILE *PrepFile(const char *filePath, bool extract, char *dstFileName,
+	       uint32_t *size)
 {
 	long fileSize;
 	const char *fileName;
+	ArchiveEntry entry;
+	bool archive = false;
 	FILE *fp = fopen(filePath, "rb");
 	size_t pathLen = strlen(filePath);
 	size_t i;
@@ -338,14 +657,31 @@ FILE *PrepFile(const char *filePath, const char **dstFileName, uint32_t *size)
 		}
 	} while (i != 0);
 
-	if (strlen(fileName) > 47) {
-		fprintf(stderr, "File name must be <= 47 characters long\n");
+	if (extract && !FindArchiveEntry(filePath, fp, &archive, &entry)) {
+		/* FindArchiveEntry prints its own error messages */
 		fclose(fp);
 		return NULL;
 	}
 
-	*dstFileName = fileName;
+	if (archive) {
+		fileName = entry.name;
+		fileSize = entry.size;
+	}
+
+	if (strlen(fileName) > SD_MAX_NAME) {
+		fprintf(stderr, "File name must be <= %d characters long\n",
+			SD_MAX_NAME);
+		fclose(fp);
+		return NULL;
+	}
+
+	strcpy(dstFileName, fileName);
 	*size = fileSize;
 
+	if (archive) {
+		/* StreamArchive prints its own error messages */
+		return StreamArchive(fp, &entry);
+	}
+
 	return fp;
 }
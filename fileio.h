@@ -12,20 +12,44 @@
 #include <stdbool.h>
 #include <stdio.h>
 
+#define JAG_MAX_SECTIONS 8
+
+/* Longest file name the GameDrive accepts for the SD card */
+#define SD_MAX_NAME 47
+
+/* A part of an executable that is loaded to its own place in Jaguar memory */
+typedef struct {
+	off_t offset;
+	uint32_t addr;
+	uint32_t size;
+	bool bss; /* Not stored in the file, memory should be zeroed instead */
+} JagSection;
+
 typedef struct {
 	/* Local data */
 	uint8_t *buf;
 	size_t length;
+	bool mapped; /* buf is a read-only mapping of the file */
 	off_t offset;
 	size_t dataSize;
 
 	/* Jaguar-side data */
 	uint32_t baseAddr;
 	uint32_t execAddr;
+
+	/*
+	 * Loadable sections, for executable formats that have them. The first
+	 * non-BSS section is also described by offset, dataSize and baseAddr.
+	 * Empty if those describe everything there is to upload.
+	 */
+	JagSection sections[JAG_MAX_SECTIONS];
+	unsigned int numSections;
 } JagFile;
 
-extern JagFile *LoadFile(const char *fileName);
+extern JagFile *LoadFile(const char *fileName, bool map);
+extern void PrefetchFile(const JagFile *jf);
 extern void FreeFile(JagFile *jf);
-extern FILE *PrepFile(const char *filePath, const char **dstFileName, uint32_t *size);
+extern FILE *PrepFile(const char *filePath, bool extract, char *dstFileName,
+		      uint32_t *size);
 
 #endif /* FILEIO_H_ */
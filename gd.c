@@ -0,0 +1,632 @@
+/*
+ * SPDX-License-Identifier: CC0-1.0
+ *
+ * Author: James Jones
+ */
+
+/* Needed to get usleep() definitions with glibc >= 2.19 */
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "usberr.h"
+#include "gd.h"
+#include "trace.h"
+
+libusb_device_handle *IsJagGD(libusb_device *dev)
+{
+	static const char *GD_STR = "RetroHQ Jaguar GameDrive";
+
+	struct libusb_device_descriptor desc;
+	libusb_device_handle *hDev;
+	uint64_t traceStart;
+	char str[256];
+	int strLen;
+	int res;
+
+	if ((res = libusb_get_device_descriptor(dev, &desc)) < 0) {
+		REPORT_USB_ERR(res, "libusb_get_device_descriptor");
+		return NULL;
+	}
+
+	if ((desc.bDeviceClass != 0xef) || /* LIBUSB_CLASS_MISCELLANEOUS */
+	    (desc.bDeviceSubClass != 0x2) || /* ??? */
+	    (desc.bDeviceProtocol != 0x1) || /* ??? */
+	    (desc.idVendor != 0x03eb) || /* Atmel Corp. */
+	    (desc.idProduct != 0x800e) || /* ??? */
+	    (desc.iProduct == 0) /* Valid product string descriptor */) {
+		return NULL;
+	}
+
+	traceStart = TraceNow();
+	res = libusb_open(dev, &hDev);
+
+	if (res != LIBUSB_SUCCESS) {
+		if (res == LIBUSB_ERROR_ACCESS) {
+			fprintf(stderr, "Insufficient permission to open USB "
+				"device. Try running as root.\n");
+			return NULL;
+		}
+
+		REPORT_USB_ERR(res, "libusb_open");
+		return NULL;
+	}
+
+	strLen = libusb_get_string_descriptor_ascii(hDev, desc.iProduct,
+						    (unsigned char *)str,
+						    sizeof(str));
+
+	TraceSpan(traceStart, "usb", "IsJagGD", NULL);
+
+	if (strLen < 0) {
+		REPORT_USB_ERR(strLen, "libusb_get_string_descriptor_ascii");
+	}
+
+	if ((strLen <= 0) || (strLen >= sizeof(str)) || strcmp(str, GD_STR)) {
+		libusb_close(hDev);
+		return NULL;
+	}
+
+	return hDev;
+}
+
+/*
+ * Identify a device by its bus and port path, e.g. "1-4.2", which stays the
+ * same across reconnects as long as it stays plugged into the same port.
+ */
+void GetDeviceKey(libusb_device *dev, char *key, size_t keyLen)
+{
+	uint8_t ports[8];
+	int numPorts = libusb_get_port_numbers(dev, ports, sizeof(ports));
+	size_t len;
+	int i;
+
+	snprintf(key, keyLen, "%" PRIu8, libusb_get_bus_number(dev));
+
+	for (i = 0; i < numPorts; i++) {
+		len = strlen(key);
+		snprintf(key + len, keyLen - len, "%c%" PRIu8,
+			 i ? '.' : '-', ports[i]);
+	}
+}
+
+void CloseGD(libusb_device_handle *hGD)
+{
+	if (hGD) {
+		libusb_release_interface(hGD, 0);
+		libusb_close(hGD); hGD = NULL;
+	}
+}
+
+/*
+ * Open the GameDrive at the given bus/port path, or the first one found if
+ * devKey is NULL. Returns NULL if it isn't there or can't be set up. Nothing
+ * is printed unless something fails, so libjaggd can use it too.
+ */
+libusb_device_handle *OpenGD(libusb_context *usbctx, const char *devKey)
+{
+	libusb_device_handle *hGD = NULL;
+	libusb_device **devs;
+	ssize_t i, nDevs;
+	char key[DEV_KEY_LEN];
+	int config;
+	int res;
+	uint64_t traceStart = TraceNow();
+	uint64_t phaseStart = traceStart;
+
+	if ((nDevs = libusb_get_device_list(usbctx, &devs)) < 0) {
+		REPORT_USB_ERR(nDevs, "libusb_get_device_list");
+		return NULL;
+	}
+
+	TraceSpan(phaseStart, "usb", "enumerate", "\"devices\": %zd", nDevs);
+
+	for (i = 0; i < nDevs; i++) {
+		if (devKey) {
+			GetDeviceKey(devs[i], key, sizeof(key));
+
+			if (strcmp(key, devKey)) {
+				continue;
+			}
+		}
+
+		if ((hGD = IsJagGD(devs[i]))) {
+			break;
+		}
+	}
+
+	libusb_free_device_list(devs, 1 /* Do unref devices */);
+
+	if (!hGD) {
+		TraceSpan(traceStart, "phase", "OpenGD", "\"found\": false");
+		return NULL;
+	}
+
+	phaseStart = TraceNow();
+
+	if ((res = libusb_get_configuration(hGD, &config)) < 0) {
+		REPORT_USB_ERR(res, "libusb_get_configuration");
+		goto fail;
+	}
+
+	if ((config == 0) && ((res = libusb_set_configuration(hGD, 1)) < 0)) {
+		REPORT_USB_ERR(res, "libusb_set_configuration");
+		goto fail;
+	}
+
+	/*
+	 * Claim the erroneously-numbered "0" interface the JagGD uses for its
+	 * control messages.
+	 */
+	if ((res = libusb_claim_interface(hGD, 0)) < 0) {
+		REPORT_USB_ERR(res, "libusb_claim_interface");
+		goto fail;
+	}
+
+	TraceSpan(phaseStart, "usb", "claim interface", NULL);
+	TraceSpan(traceStart, "phase", "OpenGD", "\"found\": true");
+
+	return hGD;
+
+fail:
+	libusb_close(hGD);
+	TraceSpan(traceStart, "phase", "OpenGD", "\"found\": false");
+
+	return NULL;
+}
+
+/*
+ * Consecutive successful polls, once the GameDrive has come back on the bus,
+ * before it is considered ready
+ */
+#define READY_POLLS 3
+#define READY_POLL_INTERVAL_MS 10
+
+typedef struct {
+	const char *devKey;
+	bool left;
+	bool arrived;
+} HotplugState;
+
+static int LIBUSB_CALL HotplugEvent(libusb_context *usbctx,
+				    libusb_device *dev,
+				    libusb_hotplug_event event,
+				    void *data)
+{
+	HotplugState *hs = data;
+	char key[DEV_KEY_LEN];
+
+	GetDeviceKey(dev, key, sizeof(key));
+
+	if (!strcmp(key, hs->devKey)) {
+		if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT) {
+			hs->left = true;
+			hs->arrived = false;
+		} else if (hs->left) {
+			hs->arrived = true;
+		}
+	}
+
+	/* Stay registered */
+	return 0;
+}
+
+static uint32_t ElapsedMs(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000 +
+		(now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/*
+ * Ask the device for its status. This is answered by the GameDrive's USB
+ * controller itself, so it fails only while the device is unavailable, and
+ * succeeding says nothing about whether the Jaguar has finished rebooting.
+ */
+static int PollGD(libusb_device_handle *hGD)
+{
+	uint8_t status[2];
+	uint64_t traceStart = TraceNow();
+	int res = libusb_control_transfer(hGD,
+					  LIBUSB_ENDPOINT_IN |
+					  LIBUSB_REQUEST_TYPE_STANDARD |
+					  LIBUSB_RECIPIENT_DEVICE,
+					  LIBUSB_REQUEST_GET_STATUS,
+					  0, 0, status, sizeof(status),
+					  100 /* 100ms timeout */);
+
+	TraceSpan(traceStart, "usb", "poll", "\"result\": \"%s\"",
+		  libusb_error_name((res < 0) ? res : 0));
+
+	return res;
+}
+
+/*
+ * True if hGD no longer reaches a device, as after the GameDrive was
+ * unplugged or power cycled. It needs opening again, even if it's back.
+ */
+bool GDGone(libusb_device_handle *hGD)
+{
+	return PollGD(hGD) == LIBUSB_ERROR_NO_DEVICE;
+}
+
+/*
+ * Wait up to timeoutMs for the GameDrive to be ready for commands again,
+ * e.g. after a reset, and return how long that took. If the device drops off
+ * the bus and comes back meanwhile, as seen by hotplug events or failed
+ * polls, it is reopened and *phGD updated, and it is ready as soon as it
+ * answers polls again. Otherwise there's no telling when it is ready, so
+ * this waits the whole timeout, and *oReady only says it still answers.
+ * Returns false only if it can't be reopened.
+ */
+bool WaitForGD(libusb_context *usbctx,
+	       libusb_device_handle **phGD,
+	       const char *devKey,
+	       uint32_t timeoutMs,
+	       uint32_t *oWaitedMs,
+	       bool *oReady)
+{
+	HotplugState hs = { .devKey = devKey };
+	uint64_t traceStart = TraceNow();
+	libusb_hotplug_callback_handle hotplug;
+	bool haveHotplug = false;
+	struct timespec start;
+	unsigned int goodPolls = 0;
+	bool answered = false;
+	bool reopened = false;
+	bool gone = false;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		haveHotplug = (libusb_hotplug_register_callback(usbctx,
+				LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+				LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+				0, 0x03eb, 0x800e, LIBUSB_HOTPLUG_MATCH_ANY,
+				HotplugEvent, &hs, &hotplug) ==
+			       LIBUSB_SUCCESS);
+	}
+
+	*oReady = false;
+
+	while (ElapsedMs(&start) < timeoutMs) {
+		int res;
+
+		if (haveHotplug) {
+			struct timeval tv = {
+				.tv_usec = READY_POLL_INTERVAL_MS * 1000
+			};
+
+			libusb_handle_events_timeout_completed(usbctx, &tv,
+							       NULL);
+		} else {
+			usleep(READY_POLL_INTERVAL_MS * 1000);
+		}
+
+		if (hs.left) {
+			gone = true;
+			goodPolls = 0;
+
+			if (!hs.arrived) {
+				continue;
+			}
+
+			hs.left = hs.arrived = false;
+		}
+
+		if (gone) {
+			/* Back on the bus, maybe at a new address. Reopen it. */
+			libusb_device_handle *hGD = OpenGD(usbctx, devKey);
+
+			if (!hGD) {
+				continue;
+			}
+
+			CloseGD(*phGD);
+			*phGD = hGD;
+			gone = false;
+			reopened = true;
+		}
+
+		res = PollGD(*phGD);
+		answered = (res >= 0);
+
+		if (answered) {
+			/* Only answers from after a re-enumeration mean anything */
+			if (reopened && (++goodPolls >= READY_POLLS)) {
+				*oReady = true;
+				break;
+			}
+		} else {
+			goodPolls = 0;
+
+			if (res == LIBUSB_ERROR_NO_DEVICE) {
+				gone = true;
+			}
+		}
+	}
+
+	if (haveHotplug) {
+		libusb_hotplug_deregister_callback(usbctx, hotplug);
+	}
+
+	if (!*oReady && !gone) {
+		/* As ready as it can be told to be after the whole wait */
+		*oReady = answered;
+	}
+
+	*oWaitedMs = ElapsedMs(&start);
+
+	TraceSpan(traceStart, "phase", "wait for GameDrive",
+		  "\"ready\": %s, \"reopened\": %s",
+		  *oReady ? "true" : "false", reopened ? "true" : "false");
+
+	if (gone) {
+		fprintf(stderr, "Jaguar GameDrive %s did not come back\n",
+			devKey);
+		return false;
+	}
+
+	return true;
+}
+
+
+bool CheckMemRange(const char *addrType, uint32_t addr)
+{
+	static const uint32_t JAG_MIN_MEMORY = 0x2000U;
+	static const uint32_t JAG_MAX_MEMORY = 0xE00000;
+
+	if ((addr >= JAG_MIN_MEMORY) && (addr < JAG_MAX_MEMORY)) {
+		return true;
+	}
+
+	fprintf(stderr, "%s address $%" PRIx32 " is out of range.\n",
+		addrType, addr);
+	fprintf(stderr, "Valid memory range: [$%" PRIx32 ", $%" PRIx32 ")\n",
+		JAG_MIN_MEMORY, JAG_MAX_MEMORY);
+
+	return false;
+}
+
+static const uint8_t UPLOAD_EXEC_TEMPLATE[GD_UPLOAD_CMD_SIZE] = { 0x14, 0x02,
+
+#define UPEX_OFF_SIZE_LE 0x02
+	/* Offset 0x2:
+	 * Upload size, little-endian (LE), or 0 for exec-only */
+	0x00, 0x00, 0x00, 0x00,
+
+#define UPEX_OFF_MAGIC0 0x06
+	/* Offset 0x6:
+	 * ??? 0x0605 for exec-only, 0x0e04 for upload */
+	0x06, 0x05,
+
+#define UPEX_OFF_DST_OR_START 0x08
+	/* Offset 0x8:
+	 * Destination addr for upload, exec addr for exec-only, BE */
+	0x00, 0x00, 0x00, 0x00,
+
+#define UPEX_OFF_SIZE_BE_MAGIC1 0x0C
+	/* Offset 0xC:
+	 * Upload size, big-endian (BE), or 0x7a774a00 for exec-only */
+	0x7a, 0x77, 0x4a, 0x00,
+
+#define UPEX_OFF_START_MAGIC2 0x10
+	/* Offset 0x10:
+	 * Exec addr, BE, or 0x00008419 for exec-only */
+	0x00, 0x00, 0x84, 0x19
+};
+
+/* Build an upload command, optionally executing execAddr once complete */
+void SetUploadCmd(uint8_t *uploadExec, uint32_t upSize,
+		  uint32_t baseAddr, uint32_t execAddr)
+{
+	memcpy(uploadExec, UPLOAD_EXEC_TEMPLATE, sizeof(UPLOAD_EXEC_TEMPLATE));
+
+	uploadExec[UPEX_OFF_SIZE_LE+0] = (upSize      ) & 0xff;
+	uploadExec[UPEX_OFF_SIZE_LE+1] = (upSize >>  8) & 0xff;
+	uploadExec[UPEX_OFF_SIZE_LE+2] = (upSize >> 16) & 0xff;
+	uploadExec[UPEX_OFF_SIZE_LE+3] = (upSize >> 24) & 0xff;
+
+	uploadExec[UPEX_OFF_MAGIC0+0] = 0x0e;
+	uploadExec[UPEX_OFF_MAGIC0+1] = 0x04;
+
+	uploadExec[UPEX_OFF_DST_OR_START+0] = (baseAddr >> 24) & 0xff;
+	uploadExec[UPEX_OFF_DST_OR_START+1] = (baseAddr >> 16) & 0xff;
+	uploadExec[UPEX_OFF_DST_OR_START+2] = (baseAddr >>  8) & 0xff;
+	uploadExec[UPEX_OFF_DST_OR_START+3] = (baseAddr      ) & 0xff;
+
+	uploadExec[UPEX_OFF_SIZE_BE_MAGIC1+0] = (upSize >> 24) & 0xff;
+	uploadExec[UPEX_OFF_SIZE_BE_MAGIC1+1] = (upSize >> 16) & 0xff;
+	uploadExec[UPEX_OFF_SIZE_BE_MAGIC1+2] = (upSize >>  8) & 0xff;
+	uploadExec[UPEX_OFF_SIZE_BE_MAGIC1+3] = (upSize      ) & 0xff;
+
+	uploadExec[UPEX_OFF_START_MAGIC2+0] = (execAddr >> 24) & 0xff;
+	uploadExec[UPEX_OFF_START_MAGIC2+1] = (execAddr >> 16) & 0xff;
+	uploadExec[UPEX_OFF_START_MAGIC2+2] = (execAddr >>  8) & 0xff;
+	uploadExec[UPEX_OFF_START_MAGIC2+3] = (execAddr      ) & 0xff;
+}
+
+/* Build an exec-only command */
+void SetExecCmd(uint8_t *uploadExec, uint32_t execAddr)
+{
+	memcpy(uploadExec, UPLOAD_EXEC_TEMPLATE, sizeof(UPLOAD_EXEC_TEMPLATE));
+
+	uploadExec[UPEX_OFF_DST_OR_START+0] = (execAddr >> 24) & 0xff;
+	uploadExec[UPEX_OFF_DST_OR_START+1] = (execAddr >> 16) & 0xff;
+	uploadExec[UPEX_OFF_DST_OR_START+2] = (execAddr >>  8) & 0xff;
+	uploadExec[UPEX_OFF_DST_OR_START+3] = (execAddr      ) & 0xff;
+}
+
+static int ControlCmd(libusb_device_handle *hGD, uint8_t *cmd, uint16_t size)
+{
+	uint64_t traceStart = TraceNow();
+	int res = libusb_control_transfer(hGD,
+				LIBUSB_REQUEST_TYPE_VENDOR |
+				LIBUSB_RECIPIENT_INTERFACE,
+				1, /* Request number */
+				0, /* Value */
+				0, /* Index: Specify interface 0 */
+				cmd, /* Data */
+				size, /* Size */
+				2000 /* 2 second timeout */);
+
+	TraceSpan(traceStart, "usb", "control transfer",
+		  "\"bytes\": %u, \"command\": \"%02x %02x\"",
+		  size, cmd[0], cmd[1]);
+
+	return res;
+}
+
+/*
+ * Command packets that fail are sent again, backing off the way failed bulk
+ * transfers are: up to this many attempts, waiting twice as long before each.
+ */
+#define CMD_MAX_ATTEMPTS 5
+#define CMD_RETRY_DELAY_MS 100
+
+/*
+ * Send a command packet over the control interface, retrying if the device
+ * doesn't take it. Returns false if it never does, or has gone away.
+ */
+bool SendCmd(libusb_device_handle *hGD, uint8_t *cmd, uint16_t size)
+{
+	unsigned int attempt;
+	int res = ControlCmd(hGD, cmd, size);
+
+	for (attempt = 1; (res < 0) && (res != LIBUSB_ERROR_NO_DEVICE) &&
+		     (attempt < CMD_MAX_ATTEMPTS); attempt++) {
+		const unsigned int delayMs =
+			CMD_RETRY_DELAY_MS << (attempt - 1);
+
+		fprintf(stderr, "Command %02x failed: %s. Retrying in %u ms "
+			"(attempt %u of %u)\n", cmd[1], libusb_error_name(res),
+			delayMs, attempt + 1, CMD_MAX_ATTEMPTS);
+		usleep(delayMs * 1000);
+
+		res = ControlCmd(hGD, cmd, size);
+	}
+
+	if (res < 0) {
+		fprintf(stderr, "Failed to send command %02x: %s\n", cmd[1],
+			libusb_error_name(res));
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Send a command packet just once, for callers doing their own retrying.
+ */
+bool TrySendCmd(libusb_device_handle *hGD, uint8_t *cmd, uint16_t size)
+{
+	int res = ControlCmd(hGD, cmd, size);
+
+	if (res < 0) {
+		fprintf(stderr, "Failed to send command %02x: %s\n", cmd[1],
+			libusb_error_name(res));
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * XferResume restart functions. An upload can pick up where it failed by
+ * asking for the rest of the data at the matching address. Other commands
+ * are sent again as they were, so the data has to start over.
+ */
+bool ResumeUpload(void *data, uint64_t offset)
+{
+	const GDUploadResume *up = data;
+	uint8_t uploadExec[GD_UPLOAD_CMD_SIZE];
+
+	SetUploadCmd(uploadExec, up->size - (uint32_t)offset,
+		     up->baseAddr + (uint32_t)offset, up->execAddr);
+
+	return TrySendCmd(up->hGD, uploadExec, sizeof(uploadExec));
+}
+
+bool ResendCmd(void *data, uint64_t offset)
+{
+	const GDCmdResume *rc = data;
+
+	(void)offset;
+
+	return TrySendCmd(rc->hGD, rc->cmd, rc->size);
+}
+
+static const uint8_t WRITE_FILE_TEMPLATE[GD_WRITE_FILE_CMD_SIZE] = {
+	/* Total cmd size = 0x36, cmd = 0x05 */
+	0x36, 0x05,
+
+#define WF_OFF_FILE_NAME 0x02
+	/* Destination file name = max 48 bytes, NUL terminated */
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+
+#define WF_OFF_FILE_SIZE 0x32
+	/* File size (Little endian) */
+	0x00, 0x00, 0x00, 0x00
+};
+
+void SetWriteFileCmd(uint8_t *writeFile, const char *dstFileName,
+		     uint32_t size)
+{
+	memcpy(writeFile, WRITE_FILE_TEMPLATE, sizeof(WRITE_FILE_TEMPLATE));
+	strncpy((char*)&writeFile[WF_OFF_FILE_NAME], dstFileName, 47);
+
+	/*
+	 * Use memcpy rather than a regular write, as the size field is
+	 * not naturally aligned.
+	 */
+	memcpy(&writeFile[WF_OFF_FILE_SIZE], &size, sizeof(size));
+}
+
+static const uint8_t EEPROM_TEMPLATE[GD_EEPROM_CMD_SIZE] = {
+	/* Total cmd size = 0x39, cmd = 0x02 */
+	0x39, 0x02,
+
+	/* Upload size, always zero */
+	0x00, 0x00, 0x00, 0x00,
+
+#define EEP_OFF_SIZE_AND_CMD 0x06
+	/* server cmd size = 0x33, server cmd = 0x06 */
+	0x33, 0x06,
+
+#define EEP_OFF_EEPROM_TYPE 0x08
+	/* 0 = 128b, 1 = 256b or 512b, 2 = 1024b or 2048b */
+	0x00,
+
+#define EEP_OFF_EEPROM_FNAME 0x09
+	/* Filename on SD card, max 48 bytes, includes \0 terminator */
+};
+
+/* Build a command enabling EEPROM saves to the given SD card file */
+void SetEepromCmd(uint8_t *eeprom, uint8_t eepromType, const char *fileName)
+{
+	memcpy(eeprom, EEPROM_TEMPLATE, sizeof(EEPROM_TEMPLATE));
+	eeprom[EEP_OFF_EEPROM_TYPE] = eepromType;
+	strncpy((char *)&eeprom[EEP_OFF_EEPROM_FNAME], fileName,
+		(sizeof(EEPROM_TEMPLATE) - EEP_OFF_EEPROM_FNAME) - 1);
+}
+
+/* Build a command rebooting the Jaguar into the given mode */
+void SetResetCmd(uint8_t *reset, GDBootMode mode)
+{
+	reset[0] = 0x02;
+	reset[1] = mode;
+}
@@ -0,0 +1,86 @@
+/*
+ * SPDX-License-Identifier: CC0-1.0
+ *
+ * Author: James Jones
+ */
+
+#ifndef GD_H_
+#define GD_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libusb-1.0/libusb.h>
+
+/*
+ * Finding, opening and talking to GameDrives: device discovery, waiting for
+ * the device to settle, and building and sending the command packets of the
+ * GameDrive protocol. Bulk data goes through xfer.h.
+ */
+
+/* Start of cartridge space. The Jaguar can't write here itself. */
+#define JAG_ROM_START 0x800000U
+
+/* Enough for "bus-port.port.port..." with the deepest hub chain USB allows */
+#define DEV_KEY_LEN 64
+
+/* Upper bounds on how long the GameDrive may take to settle */
+#define RESET_WAIT_MS 1500
+#define WRITE_FILE_WAIT_MS 500
+
+/* Command packet sizes */
+#define GD_RESET_CMD_SIZE 2
+#define GD_UPLOAD_CMD_SIZE 0x14
+#define GD_WRITE_FILE_CMD_SIZE 0x36
+#define GD_EEPROM_CMD_SIZE 0x39
+
+/* For resending the command behind a bulk transfer that failed part way */
+typedef struct {
+	libusb_device_handle *hGD;
+	uint32_t size;
+	uint32_t baseAddr;
+	uint32_t execAddr;
+} GDUploadResume;
+
+typedef struct {
+	libusb_device_handle *hGD;
+	uint8_t *cmd;
+	uint16_t size;
+} GDCmdResume;
+
+/* What a reset boots into */
+typedef enum {
+	GD_BOOT_MENU = 0x00,	/* The JagGD menu */
+	GD_BOOT_DEBUG = 0x01,	/* The debug stub */
+	GD_BOOT_ROM = 0x06,	/* The loaded ROM, through the Jaguar BIOS */
+} GDBootMode;
+
+extern libusb_device_handle *IsJagGD(libusb_device *dev);
+extern void GetDeviceKey(libusb_device *dev, char *key, size_t keyLen);
+extern libusb_device_handle *OpenGD(libusb_context *usbctx,
+				    const char *devKey);
+extern void CloseGD(libusb_device_handle *hGD);
+extern bool GDGone(libusb_device_handle *hGD);
+extern bool WaitForGD(libusb_context *usbctx,
+		      libusb_device_handle **phGD,
+		      const char *devKey,
+		      uint32_t timeoutMs,
+		      uint32_t *oWaitedMs,
+		      bool *oReady);
+extern bool CheckMemRange(const char *addrType, uint32_t addr);
+
+extern void SetResetCmd(uint8_t *reset, GDBootMode mode);
+extern void SetUploadCmd(uint8_t *uploadExec, uint32_t upSize,
+			 uint32_t baseAddr, uint32_t execAddr);
+extern void SetExecCmd(uint8_t *uploadExec, uint32_t execAddr);
+extern void SetWriteFileCmd(uint8_t *writeFile, const char *dstFileName,
+			    uint32_t size);
+extern void SetEepromCmd(uint8_t *eeprom, uint8_t eepromType,
+			 const char *fileName);
+extern bool SendCmd(libusb_device_handle *hGD, uint8_t *cmd, uint16_t size);
+extern bool TrySendCmd(libusb_device_handle *hGD, uint8_t *cmd, uint16_t size);
+extern bool ResumeUpload(void *data, uint64_t offset);
+extern bool ResendCmd(void *data, uint64_t offset);
+
+#endif /* GD_H_ */
@@ -0,0 +1,1119 @@
+/*
+ * SPDX-License-Identifier: CC0-1.0
+ *
+ * Author: James Jones
+ */
+
+/*
+ * A simulated GameDrive, built as a stand-in for the parts of libusb-1.0
+ * that jaggd uses. Preloading it runs jaggd, unmodified and through its real
+ * transfer code, against software GameDrives instead of USB devices:
+ *
+ *   $ make sim
+ *   $ LD_PRELOAD=./libgdsim.so ./jaggd -ux game.cof
+ *
+ * The simulated devices decode the reset, EEPROM, write file and
+ * upload/execute commands, keep uploads in a copy of the 68000 address
+ * space and write SD card files to a directory. The link's bandwidth and
+ * per-transfer latency can be set so transfer changes can be measured.
+ * Everything is configured through environment variables:
+ *
+ *   GDSIM_DEVICES    Number of GameDrives on the bus (default 1, max 8)
+ *   GDSIM_BANDWIDTH  Bulk bytes per second (default 0, unlimited)
+ *   GDSIM_LATENCY_US Delay before each transfer starts moving (default 0)
+ *   GDSIM_RESET_MS   How long the device ignores polls after a reset
+ *                    (default 0)
+ *   GDSIM_RESET_DROP If 1, the device drops off the bus for GDSIM_RESET_MS
+ *                    after a reset instead, and handles opened before then
+ *                    stop working, as for a GameDrive that re-enumerates
+ *                    (default 0)
+ *   GDSIM_SD_DIR     Directory to write SD card files to. They are
+ *                    discarded if unset. Devices after the first get .1,
+ *                    .2, ... appended, and those must exist too
+ *   GDSIM_MEM_DUMP   File to dump Jaguar memory to at exit. Devices after
+ *                    the first get .1, .2, ... appended
+ *   GDSIM_LOG        File to log decoded commands and statistics to
+ *   GDSIM_FAIL_EVERY Stall every Nth bulk transfer, losing its data, to
+ *                    exercise recovery (default 0, never). As on a real
+ *                    endpoint, transfers keep stalling until the halt is
+ *                    cleared, which also drops the rest of the upload or
+ *                    write file so the command can be sent again
+ *   GDSIM_CMD_FAIL_EVERY Stall every Nth command packet without acting on
+ *                    it (default 0, never)
+ *   GDSIM_STATS      File to append a line of timing statistics to for each
+ *                    device at exit, as key=value pairs:
+ *                      ttfb_us       From libusb_init() to the first bulk
+ *                                    data arriving
+ *                      xfer_us       From the first upload or write file
+ *                                    command to the last bulk data arriving
+ *                      bulk_bytes    Bulk data received
+ *                      reset_exec_us From the first reset to the last
+ *                                    execution, if both happened
+ */
+
+/* Needed to get clock_nanosleep() definitions with -std=c99 */
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include <libusb-1.0/libusb.h>
+
+#define SIM_MAX_DEVICES 8
+
+/* The 68000's 24-bit address space */
+#define SIM_MEM_SIZE (16 * 1024 * 1024)
+
+/* More than jaggd ever keeps in flight */
+#define SIM_MAX_PENDING 64
+
+static const char *GD_STR = "RetroHQ Jaguar GameDrive";
+
+/* A high speed device with the vendor interface jaggd talks to */
+#define SIM_BULK_OUT_EP (LIBUSB_ENDPOINT_OUT | 2)
+
+static const struct libusb_endpoint_descriptor SIM_ENDPOINTS[] = {
+	{
+		.bLength = 7,
+		.bDescriptorType = LIBUSB_DT_ENDPOINT,
+		.bEndpointAddress = LIBUSB_ENDPOINT_IN | 1,
+		.bmAttributes = LIBUSB_TRANSFER_TYPE_BULK,
+		.wMaxPacketSize = 512,
+	},
+	{
+		.bLength = 7,
+		.bDescriptorType = LIBUSB_DT_ENDPOINT,
+		.bEndpointAddress = SIM_BULK_OUT_EP,
+		.bmAttributes = LIBUSB_TRANSFER_TYPE_BULK,
+		.wMaxPacketSize = 512,
+	},
+};
+
+static const struct libusb_interface_descriptor SIM_ALTSETTING = {
+	.bLength = 9,
+	.bDescriptorType = LIBUSB_DT_INTERFACE,
+	.bNumEndpoints = 2,
+	.bInterfaceClass = LIBUSB_CLASS_VENDOR_SPEC,
+	.endpoint = SIM_ENDPOINTS,
+};
+
+static const struct libusb_interface SIM_INTERFACE = {
+	.altsetting = &SIM_ALTSETTING,
+	.num_altsetting = 1,
+};
+
+typedef enum {
+	SINK_NONE,
+	SINK_MEMORY,
+	SINK_SD_FILE,
+} SinkType;
+
+/* State of one simulated GameDrive, shared by every context that sees it */
+typedef struct {
+	unsigned int index;
+	pthread_mutex_t lock;
+	uint8_t *mem;
+
+	/* Where bulk data goes next, as set up by the last command */
+	SinkType sink;
+	uint32_t sinkAddr;
+	uint32_t sinkLeft;
+	uint32_t execAddr;
+	FILE *sdFile;
+
+	/* When queued bulk data will have gone out, and when polls answer */
+	uint64_t busFreeNs;
+	uint64_t readyNs;
+
+	/* For GDSIM_RESET_DROP: when it's back, and how often it has left */
+	uint64_t goneUntilNs;
+	unsigned int attachCount;
+
+	/* Stalled by GDSIM_FAIL_EVERY until the halt is cleared */
+	bool halted;
+	unsigned long bulkAttempts;
+
+	/* Counts command packets for GDSIM_CMD_FAIL_EVERY */
+	unsigned long cmdAttempts;
+
+	uint64_t bulkBytes;
+	unsigned long bulkTransfers;
+	unsigned long commands;
+
+	/* When things first or last happened, 0 if they didn't */
+	uint64_t firstXferCmdNs;
+	uint64_t firstDataNs;
+	uint64_t lastDataNs;
+	uint64_t firstResetNs;
+	uint64_t lastExecNs;
+} SimDevice;
+
+struct libusb_device {
+	libusb_context *ctx;
+	SimDevice *sim;
+};
+
+struct libusb_device_handle {
+	libusb_device *dev;
+
+	/* The device's attachCount when opened */
+	unsigned int attachCount;
+};
+
+typedef struct {
+	struct libusb_transfer *xfer;
+	uint64_t doneNs;
+	bool cancelled;
+} PendingTransfer;
+
+struct libusb_context {
+	libusb_device devices[SIM_MAX_DEVICES];
+
+	/* Submitted transfers, in the order they complete */
+	pthread_mutex_t lock;
+	PendingTransfer pending[SIM_MAX_PENDING];
+	unsigned int numPending;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	unsigned int numContexts;
+
+	unsigned int numDevices;
+	uint64_t bytesPerSec;
+	uint64_t latencyNs;
+	uint64_t resetNs;
+	bool resetDrop;
+	unsigned long failEvery;
+	unsigned long cmdFailEvery;
+	const char *sdDir;
+	const char *memDump;
+	const char *statsName;
+	FILE *log;
+	uint64_t startNs;
+
+	SimDevice devices[SIM_MAX_DEVICES];
+} sim = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void Log(const SimDevice *dev, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void Log(const SimDevice *dev, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (!sim.log) {
+		return;
+	}
+
+	if (dev) {
+		fprintf(sim.log, "[gd%u] ", dev->index);
+	}
+
+	va_start(ap, fmt);
+	vfprintf(sim.log, fmt, ap);
+	va_end(ap);
+	fflush(sim.log);
+}
+
+static uint64_t NowNs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void SleepUntil(uint64_t ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000,
+		.tv_nsec = ns % 1000000000,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL));
+}
+
+static uint64_t EnvNumber(const char *name, uint64_t def)
+{
+	const char *val = getenv(name);
+
+	return (val && *val) ? strtoull(val, NULL, 0) : def;
+}
+
+static uint32_t ReadBE32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+		((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint32_t ReadLE32(const uint8_t *p)
+{
+	return ((uint32_t)p[3] << 24) | ((uint32_t)p[2] << 16) |
+		((uint32_t)p[1] << 8) | p[0];
+}
+
+/* Read the configuration and create the devices. Call with sim.lock held. */
+static int StartSim(void)
+{
+	const char *logName = getenv("GDSIM_LOG");
+	unsigned int i;
+
+	sim.numDevices = EnvNumber("GDSIM_DEVICES", 1);
+	if (sim.numDevices < 1) sim.numDevices = 1;
+	if (sim.numDevices > SIM_MAX_DEVICES) sim.numDevices = SIM_MAX_DEVICES;
+
+	sim.bytesPerSec = EnvNumber("GDSIM_BANDWIDTH", 0);
+	sim.latencyNs = EnvNumber("GDSIM_LATENCY_US", 0) * 1000;
+	sim.resetNs = EnvNumber("GDSIM_RESET_MS", 0) * 1000000;
+	sim.resetDrop = EnvNumber("GDSIM_RESET_DROP", 0) != 0;
+	sim.failEvery = EnvNumber("GDSIM_FAIL_EVERY", 0);
+	sim.cmdFailEvery = EnvNumber("GDSIM_CMD_FAIL_EVERY", 0);
+	sim.sdDir = getenv("GDSIM_SD_DIR");
+	sim.memDump = getenv("GDSIM_MEM_DUMP");
+	sim.statsName = getenv("GDSIM_STATS");
+	sim.startNs = NowNs();
+	sim.log = (logName && *logName) ? fopen(logName, "a") : NULL;
+
+	for (i = 0; i < sim.numDevices; i++) {
+		SimDevice *dev = &sim.devices[i];
+
+		memset(dev, 0, sizeof(*dev));
+		dev->index = i;
+		pthread_mutex_init(&dev->lock, NULL);
+
+		if (!(dev->mem = calloc(1, SIM_MEM_SIZE))) {
+			return LIBUSB_ERROR_NO_MEM;
+		}
+	}
+
+	Log(NULL, "start: %u devices, %" PRIu64 " bytes/s, %" PRIu64
+	    " us latency\n", sim.numDevices, sim.bytesPerSec,
+	    sim.latencyNs / 1000);
+
+	return LIBUSB_SUCCESS;
+}
+
+/* Microseconds from start to end, or an empty string if either is unknown */
+static const char *Micros(char *buf, size_t len, uint64_t start, uint64_t end)
+{
+	if (start && end && (end >= start)) {
+		snprintf(buf, len, "%" PRIu64, (end - start) / 1000);
+	} else {
+		buf[0] = '\0';
+	}
+
+	return buf;
+}
+
+static void WriteStats(FILE *fp, const SimDevice *dev)
+{
+	char ttfb[32], xfer[32], resetExec[32];
+
+	fprintf(fp, "device=%u ttfb_us=%s xfer_us=%s bulk_bytes=%" PRIu64
+		" reset_exec_us=%s\n", dev->index,
+		Micros(ttfb, sizeof(ttfb), sim.startNs, dev->firstDataNs),
+		Micros(xfer, sizeof(xfer), dev->firstXferCmdNs,
+		       dev->lastDataNs),
+		dev->bulkBytes,
+		Micros(resetExec, sizeof(resetExec), dev->firstResetNs,
+		       dev->lastExecNs));
+}
+
+/* Dump memory, report statistics and free the devices */
+static void StopSim(void)
+{
+	FILE *stats = (sim.statsName && *sim.statsName) ?
+		fopen(sim.statsName, "a") : NULL;
+	unsigned int i;
+
+	for (i = 0; i < sim.numDevices; i++) {
+		SimDevice *dev = &sim.devices[i];
+
+		Log(dev, "stop: %lu commands, %lu bulk transfers, %" PRIu64
+		    " bulk bytes\n", dev->commands, dev->bulkTransfers,
+		    dev->bulkBytes);
+
+		/* Contexts that only looked for devices don't count */
+		if (stats && dev->commands) {
+			WriteStats(stats, dev);
+		}
+
+		if (sim.memDump && dev->mem) {
+			char path[4096];
+			FILE *fp;
+
+			if (i) {
+				snprintf(path, sizeof(path), "%s.%u",
+					 sim.memDump, i);
+			} else {
+				snprintf(path, sizeof(path), "%s",
+					 sim.memDump);
+			}
+
+			if ((fp = fopen(path, "wb"))) {
+				fwrite(dev->mem, 1, SIM_MEM_SIZE, fp);
+				fclose(fp);
+			}
+		}
+
+		if (dev->sdFile) fclose(dev->sdFile);
+		free(dev->mem);
+		pthread_mutex_destroy(&dev->lock);
+		memset(dev, 0, sizeof(*dev));
+	}
+
+	if (stats) fclose(stats);
+	if (sim.log) fclose(sim.log);
+	sim.log = NULL;
+}
+
+int libusb_init(libusb_context **ctx)
+{
+	libusb_context *newCtx;
+	unsigned int i;
+	int res = LIBUSB_SUCCESS;
+
+	/* The default context isn't supported */
+	if (!ctx) {
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	if (!(newCtx = calloc(1, sizeof(*newCtx)))) {
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	pthread_mutex_lock(&sim.lock);
+
+	if ((sim.numContexts == 0) && ((res = StartSim()) < 0)) {
+		StopSim();
+		pthread_mutex_unlock(&sim.lock);
+		free(newCtx);
+		return res;
+	}
+
+	sim.numContexts++;
+
+	for (i = 0; i < sim.numDevices; i++) {
+		newCtx->devices[i].ctx = newCtx;
+		newCtx->devices[i].sim = &sim.devices[i];
+	}
+
+	pthread_mutex_unlock(&sim.lock);
+
+	pthread_mutex_init(&newCtx->lock, NULL);
+	*ctx = newCtx;
+
+	return LIBUSB_SUCCESS;
+}
+
+void libusb_exit(libusb_context *ctx)
+{
+	if (!ctx) {
+		return;
+	}
+
+	pthread_mutex_lock(&sim.lock);
+
+	if (--sim.numContexts == 0) {
+		StopSim();
+	}
+
+	pthread_mutex_unlock(&sim.lock);
+
+	pthread_mutex_destroy(&ctx->lock);
+	free(ctx);
+}
+
+const char *libusb_error_name(int errcode)
+{
+	switch (errcode) {
+	case LIBUSB_SUCCESS: return "LIBUSB_SUCCESS";
+	case LIBUSB_ERROR_IO: return "LIBUSB_ERROR_IO";
+	case LIBUSB_ERROR_INVALID_PARAM: return "LIBUSB_ERROR_INVALID_PARAM";
+	case LIBUSB_ERROR_ACCESS: return "LIBUSB_ERROR_ACCESS";
+	case LIBUSB_ERROR_NO_DEVICE: return "LIBUSB_ERROR_NO_DEVICE";
+	case LIBUSB_ERROR_NOT_FOUND: return "LIBUSB_ERROR_NOT_FOUND";
+	case LIBUSB_ERROR_BUSY: return "LIBUSB_ERROR_BUSY";
+	case LIBUSB_ERROR_TIMEOUT: return "LIBUSB_ERROR_TIMEOUT";
+	case LIBUSB_ERROR_OVERFLOW: return "LIBUSB_ERROR_OVERFLOW";
+	case LIBUSB_ERROR_PIPE: return "LIBUSB_ERROR_PIPE";
+	case LIBUSB_ERROR_INTERRUPTED: return "LIBUSB_ERROR_INTERRUPTED";
+	case LIBUSB_ERROR_NO_MEM: return "LIBUSB_ERROR_NO_MEM";
+	case LIBUSB_ERROR_NOT_SUPPORTED: return "LIBUSB_ERROR_NOT_SUPPORTED";
+	default: return "LIBUSB_ERROR_OTHER";
+	}
+}
+
+/* Hotplug isn't simulated, so jaggd falls back to polling */
+int libusb_has_capability(uint32_t capability)
+{
+	return 0;
+}
+
+/* On the bus, and if a handle is given, opened since it last came back */
+static bool Attached(SimDevice *dev, const libusb_device_handle *handle)
+{
+	bool attached;
+
+	pthread_mutex_lock(&dev->lock);
+	attached = (NowNs() >= dev->goneUntilNs) &&
+		(!handle || (handle->attachCount == dev->attachCount));
+	pthread_mutex_unlock(&dev->lock);
+
+	return attached;
+}
+
+ssize_t libusb_get_device_list(libusb_context *ctx, libusb_device ***list)
+{
+	unsigned int i, n = 0;
+
+	if (!(*list = calloc(sim.numDevices + 1, sizeof(**list)))) {
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	for (i = 0; i < sim.numDevices; i++) {
+		if (Attached(ctx->devices[i].sim, NULL)) {
+			(*list)[n++] = &ctx->devices[i];
+		}
+	}
+
+	return n;
+}
+
+void libusb_free_device_list(libusb_device **list, int unref_devices)
+{
+	free(list);
+}
+
+/* Devices live as long as their context, so references aren't counted */
+libusb_device *libusb_ref_device(libusb_device *dev)
+{
+	return dev;
+}
+
+void libusb_unref_device(libusb_device *dev)
+{
+}
+
+int libusb_get_device_descriptor(libusb_device *dev,
+				 struct libusb_device_descriptor *desc)
+{
+	memset(desc, 0, sizeof(*desc));
+	desc->bLength = LIBUSB_DT_DEVICE_SIZE;
+	desc->bDescriptorType = LIBUSB_DT_DEVICE;
+	desc->bcdUSB = 0x0200;
+	desc->bDeviceClass = 0xef;
+	desc->bDeviceSubClass = 0x2;
+	desc->bDeviceProtocol = 0x1;
+	desc->bMaxPacketSize0 = 64;
+	desc->idVendor = 0x03eb;
+	desc->idProduct = 0x800e;
+	desc->iProduct = 2;
+	desc->bNumConfigurations = 1;
+
+	return LIBUSB_SUCCESS;
+}
+
+int libusb_get_active_config_descriptor(libusb_device *dev,
+				       struct libusb_config_descriptor **config)
+{
+	struct libusb_config_descriptor *desc = calloc(1, sizeof(*desc));
+
+	if (!desc) {
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	desc->bLength = LIBUSB_DT_CONFIG_SIZE;
+	desc->bDescriptorType = LIBUSB_DT_CONFIG;
+	desc->bNumInterfaces = 1;
+	desc->bConfigurationValue = 1;
+	desc->interface = &SIM_INTERFACE;
+
+	*config = desc;
+	return LIBUSB_SUCCESS;
+}
+
+void libusb_free_config_descriptor(struct libusb_config_descriptor *config)
+{
+	free(config);
+}
+
+/* Simulated GameDrives hang off ports 1-8 of a hub on bus 1, port 1 */
+uint8_t libusb_get_bus_number(libusb_device *dev)
+{
+	return 1;
+}
+
+uint8_t libusb_get_port_number(libusb_device *dev)
+{
+	return dev->sim->index + 1;
+}
+
+int libusb_get_port_numbers(libusb_device *dev, uint8_t *port_numbers,
+			    int port_numbers_len)
+{
+	if (port_numbers_len < 2) {
+		return LIBUSB_ERROR_OVERFLOW;
+	}
+
+	port_numbers[0] = 1;
+	port_numbers[1] = dev->sim->index + 1;
+
+	return 2;
+}
+
+uint8_t libusb_get_device_address(libusb_device *dev)
+{
+	return dev->sim->index + 2;
+}
+
+int libusb_open(libusb_device *dev, libusb_device_handle **dev_handle)
+{
+	if (!Attached(dev->sim, NULL)) {
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+
+	if (!(*dev_handle = calloc(1, sizeof(**dev_handle)))) {
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	(*dev_handle)->dev = dev;
+
+	pthread_mutex_lock(&dev->sim->lock);
+	(*dev_handle)->attachCount = dev->sim->attachCount;
+	pthread_mutex_unlock(&dev->sim->lock);
+
+	return LIBUSB_SUCCESS;
+}
+
+void libusb_close(libusb_device_handle *dev_handle)
+{
+	free(dev_handle);
+}
+
+libusb_device *libusb_get_device(libusb_device_handle *dev_handle)
+{
+	return dev_handle->dev;
+}
+
+int libusb_get_configuration(libusb_device_handle *dev, int *config)
+{
+	*config = 1;
+	return LIBUSB_SUCCESS;
+}
+
+int libusb_set_configuration(libusb_device_handle *dev_handle,
+			     int configuration)
+{
+	return (configuration == 1) ? LIBUSB_SUCCESS : LIBUSB_ERROR_NOT_FOUND;
+}
+
+int libusb_claim_interface(libusb_device_handle *dev_handle,
+			   int interface_number)
+{
+	return (interface_number == 0) ?
+		LIBUSB_SUCCESS : LIBUSB_ERROR_NOT_FOUND;
+}
+
+int libusb_release_interface(libusb_device_handle *dev_handle,
+			     int interface_number)
+{
+	return LIBUSB_SUCCESS;
+}
+
+int libusb_clear_halt(libusb_device_handle *dev_handle,
+		      unsigned char endpoint)
+{
+	SimDevice *dev = dev_handle->dev->sim;
+
+	pthread_mutex_lock(&dev->lock);
+
+	if (dev->halted) {
+		Log(dev, "clear halt: dropped %" PRIu32 " bytes still "
+		    "expected\n", (dev->sink != SINK_NONE) ? dev->sinkLeft : 0);
+
+		if (dev->sdFile) fclose(dev->sdFile);
+		dev->sdFile = NULL;
+		dev->sink = SINK_NONE;
+		dev->halted = false;
+	}
+
+	pthread_mutex_unlock(&dev->lock);
+
+	return LIBUSB_SUCCESS;
+}
+
+int libusb_get_string_descriptor_ascii(libusb_device_handle *dev_handle,
+				       uint8_t desc_index,
+				       unsigned char *data, int length)
+{
+	int len = strlen(GD_STR);
+
+	if (desc_index != 2) {
+		return LIBUSB_ERROR_PIPE;
+	}
+
+	if (len >= length) {
+		len = length - 1;
+	}
+
+	memcpy(data, GD_STR, len);
+	data[len] = '\0';
+
+	return len;
+}
+
+/* Decode a command packet. Call with dev->lock held. */
+static int HandleCommand(SimDevice *dev, const uint8_t *cmd, uint16_t len)
+{
+	dev->commands++;
+
+	if (dev->sink != SINK_NONE) {
+		Log(dev, "!! command with %" PRIu32 " bytes of data still "
+		    "expected\n", dev->sinkLeft);
+		return LIBUSB_ERROR_PIPE;
+	}
+
+	if ((len == 2) && (cmd[0] == 0x02)) {
+		Log(dev, "reset: %s\n", (cmd[1] == 0x01) ? "debug stub" :
+		    (cmd[1] == 0x06) ? "ROM" : "menu");
+		if (sim.resetDrop) {
+			dev->goneUntilNs = NowNs() + sim.resetNs;
+			dev->attachCount++;
+		} else {
+			dev->readyNs = NowNs() + sim.resetNs;
+		}
+		if (!dev->firstResetNs) dev->firstResetNs = NowNs();
+		return len;
+	}
+
+	if ((len == 0x14) && (cmd[0] == 0x14) && (cmd[1] == 0x02)) {
+		if ((cmd[6] == 0x06) && (cmd[7] == 0x05)) {
+			Log(dev, "exec: $%06" PRIx32 "\n", ReadBE32(&cmd[8]));
+			dev->lastExecNs = NowNs();
+			return len;
+		}
+
+		if (!dev->firstXferCmdNs) dev->firstXferCmdNs = NowNs();
+
+		dev->sink = SINK_MEMORY;
+		dev->sinkLeft = ReadLE32(&cmd[2]);
+		dev->sinkAddr = ReadBE32(&cmd[8]);
+		dev->execAddr = ReadBE32(&cmd[0x10]);
+
+		Log(dev, "upload: %" PRIu32 " bytes to $%06" PRIx32 "\n",
+		    dev->sinkLeft, dev->sinkAddr);
+
+		if (((uint64_t)dev->sinkAddr + dev->sinkLeft) > SIM_MEM_SIZE) {
+			Log(dev, "!! upload past the end of memory\n");
+			dev->sink = SINK_NONE;
+			return LIBUSB_ERROR_PIPE;
+		}
+
+		if (dev->sinkLeft == 0) {
+			dev->sink = SINK_NONE;
+		}
+
+		return len;
+	}
+
+	if ((len == 0x36) && (cmd[0] == 0x36) && (cmd[1] == 0x05)) {
+		char name[49];
+
+		memcpy(name, &cmd[2], 48);
+		name[48] = '\0';
+
+		if (!dev->firstXferCmdNs) dev->firstXferCmdNs = NowNs();
+
+		dev->sink = SINK_SD_FILE;
+		dev->sinkLeft = ReadLE32(&cmd[0x32]);
+
+		Log(dev, "write file: %s, %" PRIu32 " bytes\n",
+		    name, dev->sinkLeft);
+
+		if (sim.sdDir && !strchr(name, '/')) {
+			char path[4096];
+
+			if (dev->index) {
+				snprintf(path, sizeof(path), "%s.%u/%s",
+					 sim.sdDir, dev->index, name);
+			} else {
+				snprintf(path, sizeof(path), "%s/%s",
+					 sim.sdDir, name);
+			}
+
+			if (!(dev->sdFile = fopen(path, "wb"))) {
+				Log(dev, "!! failed to create %s\n", path);
+			}
+		}
+
+		if (dev->sinkLeft == 0) {
+			if (dev->sdFile) fclose(dev->sdFile);
+			dev->sdFile = NULL;
+			dev->sink = SINK_NONE;
+		}
+
+		return len;
+	}
+
+	if ((len == 0x39) && (cmd[0] == 0x39) && (cmd[1] == 0x02) &&
+	    (cmd[6] == 0x33) && (cmd[7] == 0x06)) {
+		char name[0x39 - 9 + 1];
+
+		memcpy(name, &cmd[9], sizeof(name) - 1);
+		name[sizeof(name) - 1] = '\0';
+
+		Log(dev, "eeprom: %s, type %u\n", name, cmd[8]);
+		return len;
+	}
+
+	Log(dev, "!! unknown command, %u bytes\n", len);
+	return LIBUSB_ERROR_PIPE;
+}
+
+/*
+ * Take bulk data into whatever the last command set up. Returns false if the
+ * device wasn't expecting it. Call with dev->lock held.
+ */
+static bool HandleData(SimDevice *dev, const uint8_t *data, uint32_t len)
+{
+	dev->bulkTransfers++;
+	dev->bulkBytes += len;
+	dev->lastDataNs = NowNs();
+	if (!dev->firstDataNs) dev->firstDataNs = dev->lastDataNs;
+
+	if ((dev->sink == SINK_NONE) || (len > dev->sinkLeft)) {
+		Log(dev, "!! %" PRIu32 " bytes of unexpected bulk data\n", len);
+		return false;
+	}
+
+	if (dev->sink == SINK_MEMORY) {
+		memcpy(&dev->mem[dev->sinkAddr], data, len);
+		dev->sinkAddr += len;
+	} else if (dev->sdFile && (fwrite(data, 1, len, dev->sdFile) != len)) {
+		Log(dev, "!! failed to write SD card file\n");
+	}
+
+	dev->sinkLeft -= len;
+
+	if (dev->sinkLeft == 0) {
+		if (dev->sink == SINK_MEMORY) {
+			Log(dev, "upload done%s", dev->execAddr ? "" : "\n");
+
+			if (dev->execAddr) {
+				dev->lastExecNs = NowNs();
+				Log(NULL, ", exec: $%06" PRIx32 "\n",
+				    dev->execAddr);
+			}
+		} else {
+			if (dev->sdFile) fclose(dev->sdFile);
+			dev->sdFile = NULL;
+			Log(dev, "write file done\n");
+		}
+
+		dev->sink = SINK_NONE;
+	}
+
+	return true;
+}
+
+/*
+ * Work out when a bulk transfer submitted now would complete: it starts
+ * moving once the latency has passed and any data queued ahead of it has
+ * gone out, then takes as long as the bandwidth allows. Call with dev->lock
+ * held.
+ */
+static uint64_t ScheduleBulk(SimDevice *dev, uint32_t len)
+{
+	uint64_t start = NowNs() + sim.latencyNs;
+
+	if (dev->busFreeNs > start) {
+		start = dev->busFreeNs;
+	}
+
+	dev->busFreeNs = start;
+
+	if (sim.bytesPerSec) {
+		dev->busFreeNs += (uint64_t)len * 1000000000 / sim.bytesPerSec;
+	}
+
+	return dev->busFreeNs;
+}
+
+int libusb_control_transfer(libusb_device_handle *dev_handle,
+			    uint8_t request_type, uint8_t bRequest,
+			    uint16_t wValue, uint16_t wIndex,
+			    unsigned char *data, uint16_t wLength,
+			    unsigned int timeout)
+{
+	SimDevice *dev = dev_handle->dev->sim;
+	uint64_t doneNs;
+	int res;
+
+	if (!Attached(dev, dev_handle)) {
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+
+	pthread_mutex_lock(&dev->lock);
+
+	/* Control transfers wait for the bulk data ahead of them */
+	doneNs = ScheduleBulk(dev, wLength);
+
+	if ((request_type & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN) {
+		if ((bRequest == LIBUSB_REQUEST_GET_STATUS) &&
+		    (NowNs() < dev->readyNs)) {
+			pthread_mutex_unlock(&dev->lock);
+			SleepUntil(NowNs() + (uint64_t)timeout * 1000000);
+			return LIBUSB_ERROR_TIMEOUT;
+		}
+
+		memset(data, 0, wLength);
+		res = wLength;
+	} else if ((request_type & LIBUSB_REQUEST_TYPE_VENDOR) &&
+		   (bRequest == 1) && (wIndex == 0)) {
+		if (sim.cmdFailEvery &&
+		    ((++dev->cmdAttempts % sim.cmdFailEvery) == 0)) {
+			Log(dev, "!! stalling command packet %lu\n",
+			    dev->cmdAttempts);
+			res = LIBUSB_ERROR_PIPE;
+		} else {
+			res = HandleCommand(dev, data, wLength);
+		}
+	} else {
+		Log(dev, "!! unknown control request %u\n", bRequest);
+		res = LIBUSB_ERROR_PIPE;
+	}
+
+	pthread_mutex_unlock(&dev->lock);
+
+	SleepUntil(doneNs);
+
+	return res;
+}
+
+int libusb_bulk_transfer(libusb_device_handle *dev_handle,
+			 unsigned char endpoint, unsigned char *data,
+			 int length, int *actual_length, unsigned int timeout)
+{
+	SimDevice *dev = dev_handle->dev->sim;
+	uint64_t doneNs;
+	bool ok;
+
+	if (endpoint != SIM_BULK_OUT_EP) {
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+
+	if (!Attached(dev, dev_handle)) {
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+
+	pthread_mutex_lock(&dev->lock);
+	doneNs = ScheduleBulk(dev, length);
+	pthread_mutex_unlock(&dev->lock);
+
+	SleepUntil(doneNs);
+
+	pthread_mutex_lock(&dev->lock);
+	ok = HandleData(dev, data, length);
+	pthread_mutex_unlock(&dev->lock);
+
+	*actual_length = ok ? length : 0;
+
+	return ok ? LIBUSB_SUCCESS : LIBUSB_ERROR_PIPE;
+}
+
+/* There's no kernel to share memory with, so any memory will do */
+unsigned char *libusb_dev_mem_alloc(libusb_device_handle *dev_handle,
+				    size_t length)
+{
+	return malloc(length);
+}
+
+int libusb_dev_mem_free(libusb_device_handle *dev_handle,
+			unsigned char *buffer, size_t length)
+{
+	free(buffer);
+	return LIBUSB_SUCCESS;
+}
+
+struct libusb_transfer *libusb_alloc_transfer(int iso_packets)
+{
+	return calloc(1, sizeof(struct libusb_transfer) +
+		      iso_packets * sizeof(struct libusb_iso_packet_descriptor));
+}
+
+void libusb_free_transfer(struct libusb_transfer *transfer)
+{
+	if (transfer && (transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER)) {
+		free(transfer->buffer);
+	}
+
+	free(transfer);
+}
+
+int libusb_submit_transfer(struct libusb_transfer *transfer)
+{
+	libusb_context *ctx = transfer->dev_handle->dev->ctx;
+	SimDevice *dev = transfer->dev_handle->dev->sim;
+	PendingTransfer *p;
+
+	if (transfer->type != LIBUSB_TRANSFER_TYPE_BULK) {
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	}
+
+	if (transfer->endpoint != SIM_BULK_OUT_EP) {
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+
+	if (!Attached(dev, transfer->dev_handle)) {
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+
+	pthread_mutex_lock(&ctx->lock);
+
+	if (ctx->numPending == SIM_MAX_PENDING) {
+		pthread_mutex_unlock(&ctx->lock);
+		return LIBUSB_ERROR_BUSY;
+	}
+
+	p = &ctx->pending[ctx->numPending++];
+	p->xfer = transfer;
+	p->cancelled = false;
+
+	pthread_mutex_lock(&dev->lock);
+	p->doneNs = ScheduleBulk(dev, transfer->length);
+	pthread_mutex_unlock(&dev->lock);
+
+	pthread_mutex_unlock(&ctx->lock);
+
+	return LIBUSB_SUCCESS;
+}
+
+int libusb_cancel_transfer(struct libusb_transfer *transfer)
+{
+	libusb_context *ctx = transfer->dev_handle->dev->ctx;
+	int res = LIBUSB_ERROR_NOT_FOUND;
+	unsigned int i;
+
+	pthread_mutex_lock(&ctx->lock);
+
+	for (i = 0; i < ctx->numPending; i++) {
+		if (ctx->pending[i].xfer == transfer) {
+			ctx->pending[i].cancelled = true;
+			res = LIBUSB_SUCCESS;
+		}
+	}
+
+	pthread_mutex_unlock(&ctx->lock);
+
+	return res;
+}
+
+/*
+ * Complete the oldest pending transfer once its time comes, or give up at
+ * deadlineNs. Callbacks are made from here, as libusb does.
+ */
+static int HandleEvents(libusb_context *ctx, uint64_t deadlineNs,
+			int *completed)
+{
+	PendingTransfer p;
+	SimDevice *dev;
+
+	if (completed && *completed) {
+		return LIBUSB_SUCCESS;
+	}
+
+	pthread_mutex_lock(&ctx->lock);
+
+	/* Nothing can happen, but don't sleep through a whole timeout */
+	if (ctx->numPending == 0) {
+		uint64_t idleNs = NowNs() + 10000000;
+
+		pthread_mutex_unlock(&ctx->lock);
+		SleepUntil((idleNs < deadlineNs) ? idleNs : deadlineNs);
+		return LIBUSB_SUCCESS;
+	}
+
+	p = ctx->pending[0];
+	pthread_mutex_unlock(&ctx->lock);
+
+	if (!p.cancelled) {
+		SleepUntil((p.doneNs < deadlineNs) ? p.doneNs : deadlineNs);
+
+		if (NowNs() < p.doneNs) {
+			return LIBUSB_SUCCESS;
+		}
+	}
+
+	pthread_mutex_lock(&ctx->lock);
+	p = ctx->pending[0];
+	memmove(&ctx->pending[0], &ctx->pending[1],
+		(ctx->numPending - 1) * sizeof(ctx->pending[0]));
+	ctx->numPending--;
+	pthread_mutex_unlock(&ctx->lock);
+
+	dev = p.xfer->dev_handle->dev->sim;
+
+	if (p.cancelled) {
+		p.xfer->status = LIBUSB_TRANSFER_CANCELLED;
+		p.xfer->actual_length = 0;
+	} else {
+		pthread_mutex_lock(&dev->lock);
+
+		dev->bulkAttempts++;
+
+		if (!dev->halted && sim.failEvery &&
+		    ((dev->bulkAttempts % sim.failEvery) == 0)) {
+			Log(dev, "!! stalling bulk transfer %lu\n",
+			    dev->bulkAttempts);
+			dev->halted = true;
+		}
+
+		if (dev->halted) {
+			p.xfer->status = LIBUSB_TRANSFER_STALL;
+			p.xfer->actual_length = 0;
+		} else if (HandleData(dev, p.xfer->buffer, p.xfer->length)) {
+			p.xfer->status = LIBUSB_TRANSFER_COMPLETED;
+			p.xfer->actual_length = p.xfer->length;
+		} else {
+			p.xfer->status = LIBUSB_TRANSFER_STALL;
+			p.xfer->actual_length = 0;
+		}
+
+		pthread_mutex_unlock(&dev->lock);
+	}
+
+	p.xfer->callback(p.xfer);
+
+	return LIBUSB_SUCCESS;
+}
+
+int libusb_handle_events_timeout_completed(libusb_context *ctx,
+					   struct timeval *tv,
+					   int *completed)
+{
+	/* libusb waits up to 60 seconds when not given a timeout */
+	uint64_t timeoutNs = tv ? ((uint64_t)tv->tv_sec * 1000000000 +
+				   (uint64_t)tv->tv_usec * 1000) :
+		60ull * 1000000000;
+
+	return HandleEvents(ctx, NowNs() + timeoutNs, completed);
+}
+
+int libusb_handle_events_completed(libusb_context *ctx, int *completed)
+{
+	return libusb_handle_events_timeout_completed(ctx, NULL, completed);
+}
+
+int libusb_handle_events(libusb_context *ctx)
+{
+	return libusb_handle_events_timeout_completed(ctx, NULL, NULL);
+}
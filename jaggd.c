@@ -4,547 +4,2002 @@
  * Author: James Jones
  */
 
-/* Needed to get usleep() definition with glibc >= 2.19 */
+/* Needed to get usleep() and getline() definitions with glibc >= 2.19 */
 #define _DEFAULT_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <errno.h>
 #include <string.h>
 #include <stdbool.h>
 #include <inttypes.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <time.h>
 
 #include <libusb-1.0/libusb.h>
 
 #include "usberr.h"
+#include "gd.h"
 #include "fileio.h"
 #include "opts.h"
+#include "xfer.h"
+#include "shadow.h"
+#include "pack.h"
+#include "daemon.h"
+#include "watch.h"
+#include "sync.h"
+#include "trace.h"
 
-libusb_device_handle *IsJagGD(libusb_device *dev)
+typedef struct {
+	bool first;
+
+	/*
+	 * When a single operation is split into several bulk uploads, the
+	 * bytes sent by earlier uploads and the overall size.
+	 */
+	uint64_t base;
+	uint64_t total;
+
+	/* Where to send the percentage, if not to the console */
+	void (*report)(void *data, uint32_t percent);
+	void *reportData;
+} Progress;
+
+static void ShowProgress(void *data, uint64_t done, uint64_t total)
+{
+	Progress *prog = data;
+	uint32_t percent;
+
+	if (prog->total) {
+		done += prog->base;
+		total = prog->total;
+	}
+
+	percent = (done * 100u) / total;
+
+	if (prog->report) {
+		prog->report(prog->reportData, percent);
+		return;
+	}
+
+	if (!prog->first) printf("\b\b\b");
+	else prog->first = false;
+	printf("%2" PRIu32 "%%", percent);
+	fflush(stdout);
+}
+
+/* One contiguous block of an upload, and the parts of it that need sending */
+typedef struct {
+	uint8_t *data;
+	uint32_t addr;
+	uint32_t size;
+
+	DeltaRange fullRange;
+	DeltaRange *ranges;
+	unsigned int numRanges;
+} UploadPiece;
+
+/*
+ * Everything needed to carry out one set of options, worked out up front so
+ * that none of it has to happen while the device waits.
+ */
+typedef struct {
+	Options *o;
+
+	uint8_t reset[GD_RESET_CMD_SIZE];
+	uint8_t eeprom[GD_EEPROM_CMD_SIZE];
+	uint8_t writeFile[GD_WRITE_FILE_CMD_SIZE];
+
+	/* -wf source file */
+	FILE *fp;
+	char dstFileName[SD_MAX_NAME + 1];
+	uint32_t writeSize;
+
+	/* -sync directory listing. Files are checked as they are sent. */
+	SyncPlan sync;
+
+	/* -u file, and its packed form if -uz pays off */
+	JagFile *jf;
+	PackedImage packed;
+
+	/* -u -: the data is read from stdin while it is sent */
+	bool stream;
+
+	/* How to send bulk data. Set up once the device is known. */
+	XferLink link;
+
+	/* The reset was carried out while this was being prepared */
+	bool resetDone;
+
+	/*
+	 * Where progress goes while executing, if not to the console. Other
+	 * output is suppressed when set.
+	 */
+	void (*report)(void *data, uint32_t percent);
+	void *reportData;
+} Command;
+
+/* Console output for a command, unless it is reporting elsewhere */
+static void Say(const Command *cmd, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void Say(const Command *cmd, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (cmd->report) {
+		return;
+	}
+
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+}
+
+static void FreeCommand(Command *cmd)
+{
+	/* Close the write-to-memory-card file */
+	if (cmd->fp) fclose(cmd->fp);
+	cmd->fp = NULL;
+
+	FreeSyncPlan(&cmd->sync);
+
+	FreePackedImage(&cmd->packed);
+
+	/* Free file data */
+	FreeFile(cmd->jf); cmd->jf = NULL;
+}
+
+static GDBootMode BootMode(const Options *o)
+{
+	return o->debug ? GD_BOOT_DEBUG :
+		o->bootRom ? GD_BOOT_ROM : GD_BOOT_MENU;
+}
+
+/*
+ * Load and check everything o refers to and build its command packets. This
+ * doesn't touch the device, so it can run while another command's data is
+ * still streaming out.
+ */
+static bool PrepareCommand(Options *o, Command *cmd)
+{
+	uint64_t traceStart = TraceNow();
+	uint64_t phaseStart;
+	unsigned int i;
+
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->o = o;
+
+	if (o->reset) {
+		SetResetCmd(cmd->reset, BootMode(o));
+	}
+
+	if (o->eepromName) {
+		SetEepromCmd(cmd->eeprom, o->eepromType, o->eepromName);
+	}
+
+	if (o->writeFileName) {
+		cmd->fp = PrepFile(o->writeFileName, true, cmd->dstFileName,
+				   &cmd->writeSize);
+
+		if (!cmd->fp) {
+			/* PrepFile prints its own error messages */
+			goto fail;
+		}
+
+		SetWriteFileCmd(cmd->writeFile, cmd->dstFileName,
+				cmd->writeSize);
+	}
+
+	if (o->syncDir && !ScanSyncDir(o->syncDir, &cmd->sync)) {
+		/* ScanSyncDir prints its own error messages */
+		goto fail;
+	}
+
+	if (o->fileName && !strcmp(o->fileName, "-")) {
+		if (o->exec == 0x0) {
+			o->exec = o->base;
+		}
+
+		if (!CheckMemRange("Base upload", o->base)) {
+			goto fail;
+		}
+
+		cmd->stream = true;
+	} else if (o->fileName) {
+		char escName[256];
+		JagFile *jf;
+
+		/*
+		 * A watched file gets rewritten by the next build, maybe while
+		 * it's being sent, so work from a copy of it instead. So does
+		 * the daemon, which mustn't die with its client's file.
+		 */
+		phaseStart = TraceNow();
+		jf = cmd->jf = LoadFile(o->fileName,
+					!o->watch && !o->copyFiles);
+		TraceSpan(phaseStart, "phase", "LoadFile", "\"file\": \"%s\"",
+			  TraceEscape(escName, sizeof(escName), o->fileName));
+
+		if (!jf) {
+			/* LoadFile prints its own error messages */
+			goto fail;
+		}
+
+		if (o->exec == 0x0) {
+			o->exec = jf->execAddr;
+		}
+
+		if (o->base != 0x0) {
+			/* Sections keep their places relative to each other */
+			for (i = 0; i < jf->numSections; i++) {
+				jf->sections[i].addr += o->base - jf->baseAddr;
+			}
+
+			jf->baseAddr = o->base;
+		}
+
+		if (!CheckMemRange("Base upload", jf->baseAddr)) {
+			goto fail;
+		}
+
+		for (i = 0; i < jf->numSections; i++) {
+			if (!jf->sections[i].bss &&
+			    !CheckMemRange("Section upload",
+					   jf->sections[i].addr)) {
+				goto fail;
+			}
+		}
+
+		if (o->offset != 0xffffffffu) {
+			if (o->offset > jf->length) {
+				fprintf(stderr, "Offset %" PRIu32
+						"exceeds file length %zu\n",
+					o->offset, jf->length);
+				goto fail;
+			}
+
+			jf->offset = o->offset;
+		}
+
+		if (((o->offset != 0xffffffffu) || (o->size != 0x0)) &&
+		    jf->numSections) {
+			/*
+			 * An explicit window into the file. Upload it as-is,
+			 * regardless of any sections.
+			 */
+			jf->numSections = 0;
+			jf->dataSize = jf->length - jf->offset;
+		}
+
+		if (o->size != 0x0) {
+			if ((o->size + jf->offset) > jf->length) {
+				fprintf(stderr, "Size %" PRIu32 " + offset %"
+					        PRId64 " exceeds file length "
+						"%zu\n",
+					o->size, (int64_t)jf->offset,
+					jf->length);
+				goto fail;
+			}
+			jf->dataSize = o->size;
+		}
+
+		PrefetchFile(jf);
+	}
+
+	if (o->pack && o->bootRom) {
+		fprintf(stderr, "Packed uploads can't be started via reboot\n");
+		goto fail;
+	}
+
+	if (o->bootRom) {
+		o->exec = 0xffffffff;
+	} else if (o->boot && !CheckMemRange("Execution address", o->exec)) {
+		goto fail;
+	}
+
+	if (cmd->jf && o->pack && (cmd->jf->numSections > 1)) {
+		unsigned int numLoaded = 0;
+
+		for (i = 0; i < cmd->jf->numSections; i++) {
+			if (!cmd->jf->sections[i].bss) numLoaded++;
+		}
+
+		if (numLoaded > 1) {
+			printf("Not packing: file has %u separately placed "
+			       "sections\n", numLoaded);
+			o->pack = false;
+		}
+	}
+
+	if (cmd->jf && o->pack) {
+		/* Leaves packed empty if packing doesn't pay off */
+		phaseStart = TraceNow();
+		PackImage(cmd->jf->buf + cmd->jf->offset, cmd->jf->dataSize,
+			  cmd->jf->baseAddr, o->exec, &cmd->packed);
+		TraceSpan(phaseStart, "phase", "pack", "\"packed\": %zu",
+			  cmd->packed.size);
+	}
+
+	TraceSpan(traceStart, "phase", "prepare", NULL);
+	return true;
+
+fail:
+	FreeCommand(cmd);
+	TraceSpan(traceStart, "phase", "prepare", "\"failed\": true");
+	return false;
+}
+
+/*
+ * Send a file to the SD card using a prepared write file command packet.
+ */
+static bool WriteSDFile(libusb_context *usbctx,
+			libusb_device_handle **phGD,
+			const char *devKey,
+			const Command *cmd,
+			uint8_t *writeFile,
+			FILE *fp,
+			const char *dstFileName,
+			uint32_t size)
+{
+	Progress progress = {
+		.first = true,
+		.report = cmd->report,
+		.reportData = cmd->reportData,
+	};
+	/* There's no writing part of a file, so retries start it over */
+	GDCmdResume resend = {
+		.hGD = *phGD,
+		.cmd = writeFile,
+		.size = GD_WRITE_FILE_CMD_SIZE,
+	};
+	const XferResume resume = {
+		.restart = ResendCmd,
+		.data = &resend,
+		.fromStart = true,
+	};
+	uint64_t traceStart = TraceNow();
+	char escName[SYNC_MAX_NAME * 6 + 1];
+	uint32_t waitedMs;
+	XferResult res;
+	bool ready;
+
+	Say(cmd, "WRITE FILE (%s)...", dstFileName);
+	fflush(stdout);
+
+	if (!SendCmd(*phGD, writeFile, GD_WRITE_FILE_CMD_SIZE)) {
+		return false;
+	}
+
+	res = BulkUploadFile(usbctx, *phGD, &cmd->link, fp, size, &resume,
+			     ShowProgress, &progress);
+
+	if (res == XFER_SOURCE_FAILED) {
+		fprintf(stderr, "\nFailed to read data from local file\n");
+	}
+
+	if (res != XFER_OK) {
+		return false;
+	}
+
+	/* jaggd sleeps 0.5 seconds here. Likewise, use it as a limit. */
+	if (!WaitForGD(usbctx, phGD, devKey, WRITE_FILE_WAIT_MS,
+		       &waitedMs, &ready)) {
+		return false;
+	}
+
+	Say(cmd, "\nOK! (%s after %" PRIu32 " ms)\n",
+	    ready ? "ready" : "not confirmed ready", waitedMs);
+
+	TraceSpan(traceStart, "phase", "write file",
+		  "\"file\": \"%s\", \"bytes\": %" PRIu32,
+		  TraceEscape(escName, sizeof(escName), dstFileName), size);
+
+	return true;
+}
+
+/*
+ * Upload -u - data from stdin as it arrives. The upload command gives the
+ * size up front, so if stdin ends early the GameDrive is left waiting for
+ * the rest until it is reset.
+ */
+static bool UploadStream(libusb_context *usbctx,
+			 libusb_device_handle *hGD,
+			 const char *devKey,
+			 const Command *cmd)
+{
+	const Options *o = cmd->o;
+	Progress progress = {
+		.first = true,
+		.report = cmd->report,
+		.reportData = cmd->reportData,
+	};
+	uint64_t traceStart = TraceNow();
+	uint8_t uploadExec[GD_UPLOAD_CMD_SIZE];
+	XferResult res;
+
+	Say(cmd, "UPLOADING STDIN %" PRIu32 " BYTES TO $%" PRIx32,
+	    o->size, o->base);
+
+	if (o->bootRom) {
+		Say(cmd, " REBOOT");
+	} else if (o->exec != o->base) {
+		Say(cmd, " ENTRY $%" PRIx32, o->exec);
+	}
+
+	if (o->boot) {
+		Say(cmd, " EXECUTE");
+	}
+
+	Say(cmd, "...");
+	fflush(stdout);
+
+	SetUploadCmd(uploadExec, o->size, o->base, o->boot ? o->exec : 0x0);
+
+	if (!SendCmd(hGD, uploadExec, sizeof(uploadExec))) {
+		return false;
+	}
+
+	res = BulkUploadStream(usbctx, hGD, &cmd->link, STDIN_FILENO,
+			       o->size, ShowProgress, &progress);
+
+	/* Whatever did arrive no longer matches any shadow */
+	InvalidateShadows(devKey, o->base, o->base + o->size);
+
+	if (res == XFER_SOURCE_FAILED) {
+		fprintf(stderr, "\nstdin ended before %" PRIu32 " bytes were "
+			"read. Reset the GameDrive before retrying\n",
+			o->size);
+		return false;
+	}
+
+	if (res != XFER_OK) {
+		fprintf(stderr, "Reset the GameDrive before retrying\n");
+		return false;
+	}
+
+	TraceSpan(traceStart, "phase", "upload",
+		  "\"bytes\": %" PRIu32 ", \"stream\": true", o->size);
+
+	Say(cmd, "\nOK!\n");
+
+	return true;
+}
+
+/* Hashes a sync's files ahead of the ones being sent */
+typedef struct {
+	SyncPlan *plan;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int numChecked;
+	bool stop;
+} SyncChecker;
+
+static void *CheckSyncFiles(void *data)
+{
+	SyncChecker *checker = data;
+	char escName[SYNC_MAX_NAME * 6 + 1];
+	uint64_t traceStart;
+	unsigned int i;
+
+	for (i = 0; i < checker->plan->numFiles; i++) {
+		bool stop;
+
+		pthread_mutex_lock(&checker->lock);
+		stop = checker->stop;
+		pthread_mutex_unlock(&checker->lock);
+
+		if (stop) {
+			break;
+		}
+
+		/* Files that can't be read are left SYNC_UNCHECKED */
+		traceStart = TraceNow();
+		CheckSyncFile(checker->plan, i);
+		TraceSpan(traceStart, "phase", "sync check",
+			  "\"file\": \"%s\", \"changed\": %s",
+			  TraceEscape(escName, sizeof(escName),
+				      checker->plan->files[i].name),
+			  (checker->plan->files[i].state == SYNC_CHANGED) ?
+			  "true" : "false");
+
+		pthread_mutex_lock(&checker->lock);
+		checker->numChecked = i + 1;
+		pthread_cond_signal(&checker->cond);
+		pthread_mutex_unlock(&checker->lock);
+	}
+
+	return NULL;
+}
+
+/*
+ * Send the new and changed files of a -sync directory, then record what the
+ * SD card now holds. The GameDrive takes one write file command at a time
+ * and has to finish writing each file before it takes another, so instead
+ * the host side is overlapped with the transfers: a second thread reads and
+ * hashes the next files while the current one is on the wire. Stops at the
+ * first file that fails.
+ */
+static bool SyncFiles(libusb_context *usbctx,
+		      libusb_device_handle **phGD,
+		      const char *devKey,
+		      Command *cmd)
+{
+	SyncPlan *plan = &cmd->sync;
+	SyncChecker checker = {
+		.plan = plan,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	unsigned int numSent = 0, numUnchanged = 0, i;
+	uint64_t traceStart = TraceNow();
+	pthread_t thread;
+	bool threaded;
+	bool success = true;
+
+	Say(cmd, "SYNC %s (%u files)\n", plan->dir, plan->numFiles);
+
+	LoadSyncManifest(devKey, plan);
+
+	threaded = !pthread_create(&thread, NULL, CheckSyncFiles, &checker);
+
+	if (!threaded) {
+		CheckSyncFiles(&checker);
+	}
+
+	for (i = 0; i < plan->numFiles; i++) {
+		SyncEntry *e = &plan->files[i];
+		uint8_t writeFile[GD_WRITE_FILE_CMD_SIZE];
+		char path[4096];
+		char dstFileName[SD_MAX_NAME + 1];
+		uint32_t size;
+		FILE *fp;
+
+		pthread_mutex_lock(&checker.lock);
+		while (checker.numChecked <= i) {
+			pthread_cond_wait(&checker.cond, &checker.lock);
+		}
+		pthread_mutex_unlock(&checker.lock);
+
+		if (e->state == SYNC_UNCHECKED) {
+			/* CheckSyncFile() printed why */
+			success = false;
+			break;
+		}
+
+		if (e->state == SYNC_UNCHANGED) {
+			numUnchanged++;
+			continue;
+		}
+
+		snprintf(path, sizeof(path), "%s/%s", plan->dir, e->name);
+
+		/* Sync mirrors the directory, so archives are sent as-is */
+		if (!(fp = PrepFile(path, false, dstFileName, &size))) {
+			/* PrepFile prints its own error messages */
+			success = false;
+			break;
+		}
+
+		SetWriteFileCmd(writeFile, dstFileName, size);
+
+		/*
+		 * Checkpoint before and after each file, so a sync that is
+		 * interrupted, even by a crash, picks up with the file it was
+		 * writing and never takes a partly written file as sent
+		 */
+		e->state = SYNC_FAILED;
+		CheckpointSyncManifest(devKey, plan, i + 1);
+
+		if (WriteSDFile(usbctx, phGD, devKey, cmd, writeFile, fp,
+				dstFileName, size)) {
+			e->state = SYNC_SENT;
+			CheckpointSyncManifest(devKey, plan, i + 1);
+			numSent++;
+		} else {
+			success = false;
+		}
+
+		fclose(fp);
+
+		if (!success) {
+			break;
+		}
+	}
+
+	if (threaded) {
+		pthread_mutex_lock(&checker.lock);
+		checker.stop = true;
+		pthread_mutex_unlock(&checker.lock);
+
+		pthread_join(thread, NULL);
+	}
+
+	SaveSyncManifest(devKey, plan);
+
+	Say(cmd, "SYNC %s: %u sent, %u unchanged\n",
+	    success ? "DONE" : "STOPPED", numSent, numUnchanged);
+
+	TraceSpan(traceStart, "phase", "sync",
+		  "\"sent\": %u, \"unchanged\": %u", numSent, numUnchanged);
+
+	return success;
+}
+
+/*
+ * Reboot the Jaguar as cmd->reset says, and wait for the GameDrive to come
+ * back. Only cmd's options, reset packet and reporting are used, so this
+ * can run while the rest of the command is still being prepared.
+ */
+static bool ResetGD(libusb_context *usbctx,
+		    libusb_device_handle **phGD,
+		    const char *devKey,
+		    Command *cmd)
+{
+	const Options *o = cmd->o;
+	uint64_t traceStart = TraceNow();
+	uint32_t waitedMs;
+	bool ready;
+
+	Say(cmd, "Reboot");
+	if (o->debug) {
+		Say(cmd, " (Debug Console)\n");
+	} else if (o->bootRom) {
+		Say(cmd, " (ROM)\n");
+	} else {
+		Say(cmd, "\n");
+	}
+
+	/*
+	 * Send a reset command over the control interface.
+	 */
+	if (!SendCmd(*phGD, cmd->reset, sizeof(cmd->reset))) {
+		return false;
+	}
+
+	/* Nothing uploaded before the reset can be relied on now */
+	InvalidateShadows(devKey, 0x0, 0xffffffffu);
+
+	/*
+	 * jaggd sleeps 1.5 seconds here. Presumably it improves
+	 * stability? Wait until the device answers instead, but never
+	 * for longer than that.
+	 */
+	if (!WaitForGD(usbctx, phGD, devKey, RESET_WAIT_MS,
+		       &waitedMs, &ready)) {
+		return false;
+	}
+
+	Say(cmd, "GameDrive %s after %" PRIu32 " ms\n",
+	    ready ? "ready" : "not confirmed ready", waitedMs);
+
+	TraceSpan(traceStart, "phase", "reset",
+		  "\"waited_ms\": %" PRIu32, waitedMs);
+
+	return true;
+}
+
+/*
+ * --calibrate sends this much to cartridge space with each combination of
+ * chunk size and queue depth. Chunk sizes are rounded down to whole packets.
+ */
+#define CALIBRATE_ADDR JAG_ROM_START
+#define CALIBRATE_SIZE (2 * 1024 * 1024)
+
+static const size_t CALIBRATE_CHUNKS[] = {
+	4 * 1024, 16 * 1024, 64 * 1024, XFER_MAX_CHUNK_SIZE
+};
+static const unsigned int CALIBRATE_DEPTHS[] = { 2, 4, 8, 16 };
+
+/*
+ * Find the chunk size and queue depth that move data fastest to this
+ * GameDrive through this host controller, and save them for later runs.
+ * Smaller settings win unless a bigger one is clearly faster, since they
+ * use less memory and start the bus moving sooner.
+ */
+static bool Calibrate(libusb_context *usbctx,
+		      libusb_device_handle *hGD,
+		      const char *devKey,
+		      Command *cmd)
 {
-	static const char *GD_STR = "RetroHQ Jaguar GameDrive";
+	const size_t numChunks = sizeof(CALIBRATE_CHUNKS) /
+		sizeof(CALIBRATE_CHUNKS[0]);
+	const size_t numDepths = sizeof(CALIBRATE_DEPTHS) /
+		sizeof(CALIBRATE_DEPTHS[0]);
+	uint8_t uploadExec[GD_UPLOAD_CMD_SIZE];
+	XferLink best = cmd->link;
+	double bestRate = 0.0;
+	bool ok = true;
+	uint8_t *buf;
+	size_t c, d;
+
+	if (!(buf = calloc(1, CALIBRATE_SIZE))) {
+		fprintf(stderr, "Failed to alloc calibration buffer\n");
+		return false;
+	}
+
+	Say(cmd, "CALIBRATING bulk endpoint $%02x, %u byte packets, %u KB "
+	    "to $%x per run\n", cmd->link.endpoint, cmd->link.maxPacketSize,
+	    CALIBRATE_SIZE / 1024, CALIBRATE_ADDR);
+
+	for (c = 0; ok && (c < numChunks); c++) {
+		for (d = 0; ok && (d < numDepths); d++) {
+			XferLink trial = cmd->link;
+			struct timespec start, end;
+			double rate;
+
+			SetXferChunkSize(&trial, CALIBRATE_CHUNKS[c]);
+			trial.depth = CALIBRATE_DEPTHS[d];
+
+			clock_gettime(CLOCK_MONOTONIC, &start);
+
+			SetUploadCmd(uploadExec, CALIBRATE_SIZE, CALIBRATE_ADDR,
+				     0x0);
+
+			if (!SendCmd(hGD, uploadExec, sizeof(uploadExec))) {
+				ok = false;
+				break;
+			}
+
+			/* A retried run would skew the timing, so don't */
+			if (BulkUpload(usbctx, hGD, &trial, buf, CALIBRATE_SIZE,
+				       NULL, NULL, NULL) != XFER_OK) {
+				ok = false;
+				break;
+			}
+
+			clock_gettime(CLOCK_MONOTONIC, &end);
+
+			rate = CALIBRATE_SIZE /
+				((end.tv_sec - start.tv_sec) +
+				 (end.tv_nsec - start.tv_nsec) / 1e9);
+
+			Say(cmd, "  %6zu byte chunks, depth %2u: %8.2f MB/s\n",
+			    trial.chunkSize, trial.depth, rate / 1e6);
+
+			/* Needs to beat the best so far by 5% */
+			if (rate > (bestRate * 1.05)) {
+				best = trial;
+				bestRate = rate;
+			}
+		}
+	}
+
+	free(buf);
+
+	/* The test data landed here */
+	InvalidateShadows(devKey, CALIBRATE_ADDR,
+			  CALIBRATE_ADDR + CALIBRATE_SIZE);
+
+	if (!ok) {
+		fprintf(stderr, "Calibration failed. Settings are unchanged\n");
+		return false;
+	}
+
+	cmd->link = best;
+	SaveXferTuning(devKey, &best);
+
+	Say(cmd, "CALIBRATED: %zu byte chunks, depth %u, %.2f MB/s\n",
+	    best.chunkSize, best.depth, bestRate / 1e6);
+
+	return true;
+}
+
+/*
+ * Carry out a prepared command on an open GameDrive. If the device has to
+ * be reopened along the way, *phGD is updated.
+ */
+static bool ExecuteCommand(libusb_context *usbctx,
+			   libusb_device_handle **phGD,
+			   const char *devKey,
+			   Command *cmd)
+{
+	libusb_device_handle *hGD = *phGD;
+	Options *o = cmd->o;
+	JagFile *jf = cmd->jf;
+	uint8_t uploadExec[GD_UPLOAD_CMD_SIZE];
+	uint64_t traceStart;
+
+	/* Start from what calibration found last time, unless told to use -q */
+	GetXferLink(hGD, &cmd->link);
+	LoadXferTuning(devKey, &cmd->link);
+
+	if (o->queueDepth) {
+		cmd->link.depth = o->queueDepth;
+	}
+
+	if (o->reset && !cmd->resetDone) {
+		if (!ResetGD(usbctx, phGD, devKey, cmd)) {
+			return false;
+		}
+
+		hGD = *phGD;
+	}
+
+	if (o->calibrate) {
+		traceStart = TraceNow();
+
+		if (!Calibrate(usbctx, hGD, devKey, cmd)) {
+			return false;
+		}
+
+		TraceSpan(traceStart, "phase", "calibrate",
+			  "\"chunk\": %zu, \"depth\": %u",
+			  cmd->link.chunkSize, cmd->link.depth);
+	}
+
+	if (o->eepromName) {
+		Say(cmd, "Setting EEPROM file: '%s', %s bytes...",
+		    o->eepromName, (o->eepromType == 0) ? "128" :
+		    (o->eepromType == 1) ? "256/512" : "1024/2048");
+		fflush(stdout);
+
+		/*
+		 * Send enable EEPROM command over the control interface.
+		 */
+		if (!SendCmd(hGD, cmd->eeprom, sizeof(cmd->eeprom))) {
+			return false;
+		}
+
+		Say(cmd, "OK\n");
+	}
+
+	if (cmd->fp) {
+		SyncEntry written = {
+			.size = cmd->writeSize,
+			.state = SYNC_CHANGED,
+		};
+		bool success = true;
+
+		strcpy(written.name, cmd->dstFileName);
+
+		if (o->resume) {
+			/* CheckWriteFile prints its own error messages */
+			success = CheckWriteFile(devKey, o->writeFileName,
+						 &written);
+		}
+
+		if (success && (written.state == SYNC_UNCHANGED)) {
+			Say(cmd, "WRITE FILE (%s) ALREADY ON SD CARD\n",
+			    cmd->dstFileName);
+		} else if (success) {
+			/* Until the whole file is there, the card's copy isn't */
+			written.state = SYNC_FAILED;
+			RecordWriteFile(devKey, &written);
+
+			success = WriteSDFile(usbctx, phGD, devKey, cmd,
+					      cmd->writeFile, cmd->fp,
+					      cmd->dstFileName,
+					      cmd->writeSize);
+
+			/* Only --resume hashed the file to record it by */
+			if (success && o->resume) {
+				written.state = SYNC_SENT;
+				RecordWriteFile(devKey, &written);
+			}
+		}
+
+		fclose(cmd->fp); cmd->fp = NULL;
+
+		if (!success) {
+			return false;
+		}
+
+		hGD = *phGD;
+	}
+
+	if (cmd->sync.dir) {
+		if (!SyncFiles(usbctx, phGD, devKey, cmd)) {
+			return false;
+		}
+
+		hGD = *phGD;
+	}
+
+	if (jf) {
+		const uint32_t execAddr = o->boot ? o->exec : 0x0;
+		const PackedImage *packed = &cmd->packed;
+		const bool delta = o->delta && !packed->blob;
+		/* Fill packs down to next to nothing anyway */
+		const bool sparse = o->sparse && !packed->blob;
+		Progress progress = {
+			.first = true,
+			.report = cmd->report,
+			.reportData = cmd->reportData,
+		};
+		UploadPiece pieces[JAG_MAX_SECTIONS];
+		unsigned int numPieces = 0;
+		unsigned int numRanges = 0;
+		uint64_t fullSize = 0;
+		uint32_t bssSize = 0;
+		bool execSent = false;
+		bool failed = false;
+		unsigned int i, p;
+
+		traceStart = TraceNow();
+
+		if (packed->blob) {
+			/* Send the unpacker instead, and run it */
+			pieces[0].data = packed->blob;
+			pieces[0].addr = packed->addr;
+			pieces[0].size = packed->size;
+			numPieces = 1;
+		} else if (jf->numSections == 0) {
+			pieces[0].data = jf->buf + jf->offset;
+			pieces[0].addr = jf->baseAddr;
+			pieces[0].size = jf->dataSize;
+			numPieces = 1;
+		}
+
+		for (i = 0; !packed->blob && (i < jf->numSections); i++) {
+			if (jf->sections[i].bss) {
+				bssSize += jf->sections[i].size;
+				continue;
+			}
+
+			pieces[numPieces].data = jf->buf + jf->sections[i].offset;
+			pieces[numPieces].addr = jf->sections[i].addr;
+			pieces[numPieces].size = jf->sections[i].size;
+			numPieces++;
+		}
+
+		for (p = 0; p < numPieces; p++) {
+			UploadPiece *piece = &pieces[p];
+
+			fullSize += piece->size;
+
+			piece->fullRange.offset = 0;
+			piece->fullRange.size = piece->size;
+			piece->ranges = &piece->fullRange;
+			piece->numRanges = 1;
+
+			if (delta) {
+				size_t shadowSize = 0;
+				uint8_t *shadow = LoadShadow(devKey, piece->addr,
+							     &shadowSize);
+
+				if (!shadow ||
+				    !ComputeDelta(shadow, shadowSize,
+						  piece->data, piece->size,
+						  &piece->ranges,
+						  &piece->numRanges)) {
+					piece->ranges = &piece->fullRange;
+					piece->numRanges = 1;
+				}
+
+				free(shadow);
+			}
+
+			if (sparse) {
+				DeltaRange *ranges;
+				unsigned int num;
+
+				if (SkipFill(piece->data, piece->ranges,
+					     piece->numRanges, &ranges, &num)) {
+					if (piece->ranges != &piece->fullRange) {
+						free(piece->ranges);
+					}
+
+					piece->ranges = ranges;
+					piece->numRanges = num;
+				}
+			}
+
+			for (i = 0; i < piece->numRanges; i++) {
+				progress.total += piece->ranges[i].size;
+			}
+			numRanges += piece->numRanges;
+		}
+
+		TraceSpan(traceStart, "phase", "delta",
+			  "\"ranges\": %u, \"bytes\": %" PRIu64,
+			  numRanges, progress.total);
+
+		Say(cmd, "UPLOADING %s %" PRIu64 " BYTES TO $%" PRIx32,
+		    o->fileName, packed->blob ? (uint64_t)jf->dataSize :
+		    fullSize, jf->baseAddr);
+		if (jf->offset && (jf->numSections == 0)) {
+			Say(cmd, " OFFSET $%" PRIx64, (int64_t)jf->offset);
+		}
+
+		if (numPieces > 1) {
+			Say(cmd, " IN %u SECTIONS", numPieces);
+		}
+
+		if (bssSize) {
+			Say(cmd, " SKIPPING %" PRIu32 " BSS BYTES", bssSize);
+		}
+
+		if (o->bootRom) {
+			Say(cmd, " REBOOT");
+		} else if (o->exec != jf->baseAddr) {
+			Say(cmd, " ENTRY $%" PRIx32, o->exec);
+		}
+
+		if (execAddr) {
+			Say(cmd, " EXECUTE");
+		}
+
+		if (packed->blob) {
+			Say(cmd, " PACKED %zu BYTES AT $%" PRIx32,
+			    packed->size, packed->addr);
+		}
+
+		if ((delta || sparse) && (progress.total < fullSize)) {
+			if (numRanges) {
+				Say(cmd, " %s %u RANGES %" PRIu64 " BYTES",
+				    !sparse ? "DELTA" : !delta ? "SPARSE" :
+				    "DELTA SPARSE", numRanges, progress.total);
+			} else {
+				Say(cmd, delta ? " UNCHANGED" : " ALL FILL");
+			}
+		}
+
+		Say(cmd, "...");
+		fflush(stdout);
+
+		traceStart = TraceNow();
+
+		for (p = 0; !failed && (p < numPieces); p++) {
+			const UploadPiece *piece = &pieces[p];
+
+			for (i = 0; i < piece->numRanges; i++) {
+				const DeltaRange *range = &piece->ranges[i];
+				const bool last = (p == (numPieces - 1)) &&
+					(i == (piece->numRanges - 1));
+				GDUploadResume up = {
+					.hGD = hGD,
+					.size = range->size,
+					.baseAddr = piece->addr + range->offset,
+				};
+				const XferResume resume = {
+					.restart = ResumeUpload,
+					.data = &up,
+				};
+
+				if (last) {
+					up.execAddr = packed->blob ?
+						packed->addr : execAddr;
+					execSent = true;
+				}
+
+				SetUploadCmd(uploadExec, up.size, up.baseAddr,
+					     up.execAddr);
+
+				/*
+				 * Announce the data, then send it to the bulk
+				 * endpoint
+				 */
+				if (!SendCmd(hGD, uploadExec,
+					     sizeof(uploadExec)) ||
+				    BulkUpload(usbctx, hGD, &cmd->link,
+					       piece->data + range->offset,
+					       range->size, &resume,
+					       ShowProgress, &progress) !=
+				    XFER_OK) {
+					failed = true;
+					break;
+				}
+				progress.base += range->size;
+			}
+		}
+
+		if (!execSent && o->boot && !failed) {
+			/* Nothing changed. Just run it. */
+			SetExecCmd(uploadExec, o->exec);
+			failed = !SendCmd(hGD, uploadExec, sizeof(uploadExec));
+		}
+
+		TraceSpan(traceStart, "phase", "upload",
+			  "\"bytes\": %" PRIu64, progress.total);
+
+		traceStart = TraceNow();
+
+		for (p = 0; p < numPieces; p++) {
+			if (pieces[p].ranges != &pieces[p].fullRange) {
+				free(pieces[p].ranges);
+			}
+
+			/*
+			 * Skipped fill wasn't written, so memory there may not
+			 * match the shadow. Nor may anything after a failure.
+			 */
+			if (delta && !sparse && !failed) {
+				SaveShadow(devKey, pieces[p].addr,
+					   pieces[p].data, pieces[p].size);
+			} else {
+				InvalidateShadows(devKey, pieces[p].addr,
+						  pieces[p].addr +
+						  pieces[p].size);
+			}
+		}
+
+		if (packed->blob) {
+			/* The payload lands here once unpacked */
+			InvalidateShadows(devKey, jf->baseAddr,
+					  jf->baseAddr + jf->dataSize);
+		}
+
+		TraceSpan(traceStart, "phase", "shadows", NULL);
+
+		if (failed) {
+			fprintf(stderr, "Upload failed. Reset the GameDrive "
+				"before retrying\n");
+			return false;
+		}
+
+		Say(cmd, "\nOK!\n");
+	} else if (cmd->stream) {
+		if (!UploadStream(usbctx, hGD, devKey, cmd)) {
+			return false;
+		}
+	} else if (o->boot) {
+		SetExecCmd(uploadExec, o->exec);
+
+		if (o->bootRom) {
+			Say(cmd, "REBOOTING...");
+		} else {
+			Say(cmd, "EXECUTING $%" PRIx32 "...", o->exec);
+		}
+		fflush(stdout);
+
+		if (!SendCmd(hGD, uploadExec, sizeof(uploadExec))) {
+			return false;
+		}
+
+		Say(cmd, "\nOK!\n");
+	}
+
+	if (o->boot) {
+		/*
+		 * Whatever runs now is free to scribble over RAM, so only
+		 * shadows of cartridge space can be trusted from here on.
+		 */
+		InvalidateShadows(devKey, 0x0, JAG_ROM_START);
+	}
+
+	return true;
+}
+
+typedef struct {
+	Options *o;
+	Command *cmd;
+	bool ok;
+} PrepareJob;
+
+static void *PrepareWorker(void *data)
+{
+	PrepareJob *job = data;
+
+	job->ok = PrepareCommand(job->o, job->cmd);
+
+	return NULL;
+}
+
+/*
+ * Make sure the local files o names can be read at all before rebooting the
+ * Jaguar for them, so a mistyped name doesn't cost a reset. Loading them
+ * properly still happens alongside the reset.
+ */
+static bool CheckFiles(const Options *o)
+{
+	const char *names[] = { o->fileName, o->writeFileName, o->syncDir };
+	size_t i;
+
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (names[i] && strcmp(names[i], "-") &&
+		    access(names[i], R_OK)) {
+			fprintf(stderr, "Failed to open '%s':\n  %s\n",
+				names[i], strerror(errno));
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Carry out everything requested in o on an open GameDrive. Returns the
+ * process exit code.
+ */
+static int RunCommands(libusb_context *usbctx,
+		       libusb_device_handle **phGD,
+		       const char *devKey,
+		       Options *o)
+{
+	Command cmd;
+	PrepareJob job = { .o = o, .cmd = &cmd };
+	pthread_t worker;
+	bool success;
+
+	/*
+	 * The reset and the wait for the GameDrive to come back take far
+	 * longer than loading and packing files, so do those meanwhile on a
+	 * second thread. The upload can then start as soon as the device is
+	 * ready. Files that aren't there at all are caught first, but one
+	 * that turns out to be bad is only noticed after the reset.
+	 */
+	if (o->reset && !CheckFiles(o)) {
+		return -1;
+	}
+
+	if (o->reset && !pthread_create(&worker, NULL, PrepareWorker, &job)) {
+		Command resetCmd = { .o = o };
+		bool resetOk;
+
+		SetResetCmd(resetCmd.reset, BootMode(o));
+		resetOk = ResetGD(usbctx, phGD, devKey, &resetCmd);
+
+		pthread_join(worker, NULL);
+
+		if (!job.ok) {
+			return -1;
+		}
+
+		if (!resetOk) {
+			FreeCommand(&cmd);
+			return -1;
+		}
+
+		cmd.resetDone = true;
+	} else if (!PrepareCommand(o, &cmd)) {
+		return -1;
+	}
+
+	success = ExecuteCommand(usbctx, phGD, devKey, &cmd);
+
+	FreeCommand(&cmd);
+
+	return success ? 0 : -1;
+}
+
+/*
+ * One line of a batch file, parsed and prepared.
+ */
+typedef struct {
+	FILE *in;
+	unsigned int *lineNum;
+	unsigned int defaultDepth;
+	bool copyFiles;
+
+	Options opts;
+	Command cmd;
+	bool eof;
+	bool ok;
+} BatchStep;
+
+/* Read, parse and prepare the next command line in a batch */
+static void *PrepareStep(void *data)
+{
+	BatchStep *step = data;
+	char *line = NULL;
+	size_t lineCap = 0;
+	const char *start;
+
+	step->ok = false;
+	step->eof = false;
+
+	do {
+		if (getline(&line, &lineCap, step->in) < 0) {
+			if (ferror(step->in)) {
+				fprintf(stderr, "Failed to read batch file\n");
+			} else {
+				step->eof = true;
+				step->ok = true;
+			}
+
+			free(line);
+			return NULL;
+		}
+
+		(*step->lineNum)++;
+
+		for (start = line; (*start == ' ') || (*start == '\t') ||
+			     (*start == '\r') || (*start == '\n'); start++);
+
+		/* Skip blank lines and comments */
+	} while ((*start == '\0') || (*start == '#'));
+
+	if (!ParseLine(start, &step->opts)) {
+		/* ParseLine() prints usage on failure */
+		fprintf(stderr, "Invalid command on batch line %u\n",
+			*step->lineNum);
+		free(line);
+		return NULL;
+	}
+
+	free(line);
 
-	struct libusb_device_descriptor desc;
-	libusb_device_handle *hDev;
-	char str[256];
-	int strLen;
-	int res;
+	if (step->opts.batchName || step->opts.daemon || step->opts.watch ||
+	    step->opts.traceName ||
+	    (step->opts.fileName && !strcmp(step->opts.fileName, "-"))) {
+		fprintf(stderr, "Batch line %u: -b, --daemon, --watch, --trace "
+			"and -u - can't be used in a batch\n", *step->lineNum);
+		FreeOptions(&step->opts);
+		return NULL;
+	}
+
+	if (!step->opts.queueDepth) {
+		step->opts.queueDepth = step->defaultDepth;
+	}
 
-	CHECKED_USB(libusb_get_device_descriptor(dev, &desc));
+	step->opts.copyFiles = step->copyFiles;
 
-	if ((desc.bDeviceClass != 0xef) || /* LIBUSB_CLASS_MISCELLANEOUS */
-	    (desc.bDeviceSubClass != 0x2) || /* ??? */
-	    (desc.bDeviceProtocol != 0x1) || /* ??? */
-	    (desc.idVendor != 0x03eb) || /* Atmel Corp. */
-	    (desc.idProduct != 0x800e) || /* ??? */
-	    (desc.iProduct == 0) /* Valid product string descriptor */) {
+	if (!PrepareCommand(&step->opts, &step->cmd)) {
+		fprintf(stderr, "Batch line %u failed\n", *step->lineNum);
+		FreeOptions(&step->opts);
 		return NULL;
 	}
 
-	res = libusb_open(dev, &hDev);
+	step->ok = true;
+	return NULL;
+}
 
-	if (res != LIBUSB_SUCCESS) {
-		if (res == LIBUSB_ERROR_ACCESS) {
-			printf("Insufficient permission to open USB device. "
-			       "Try running as root.\n");
-			return NULL;
+static void FreeStep(BatchStep *step)
+{
+	if (step->ok && !step->eof) {
+		FreeCommand(&step->cmd);
+		FreeOptions(&step->opts);
+	}
+
+	step->ok = false;
+}
+
+/*
+ * Carry out each line of a batch file in turn. Every line is prepared on a
+ * separate thread while the previous line is being executed, so loading,
+ * packing and opening the next line's files overlaps the current line's
+ * transfers. Stops at the first line that fails.
+ */
+static int RunBatch(libusb_context *usbctx,
+		    libusb_device_handle **phGD,
+		    const char *devKey,
+		    const Options *o)
+{
+	BatchStep steps[2];
+	BatchStep *cur = &steps[0];
+	BatchStep *next = &steps[1];
+	unsigned int lineNum = 0;
+	FILE *in;
+	int exitCode = -1;
+
+	if (!strcmp(o->batchName, "-")) {
+		/*
+		 * Read through a private stream so no read-ahead is left in
+		 * stdin's buffer, which a daemon reuses across clients.
+		 */
+		int fd = dup(STDIN_FILENO);
+
+		in = (fd >= 0) ? fdopen(fd, "r") : NULL;
+
+		if (!in && (fd >= 0)) {
+			close(fd);
 		}
+	} else {
+		in = fopen(o->batchName, "r");
+	}
 
-		DO_USB_ERR(res, "libusb_open");
+	if (!in) {
+		fprintf(stderr, "Failed to open batch file '%s':\n  %s\n",
+			o->batchName, strerror(errno));
+		return -1;
 	}
 
-	CHECKED_USB_RES(strLen, libusb_get_string_descriptor_ascii(hDev,
-			desc.iProduct, (unsigned char *)str, sizeof(str)));
+	memset(steps, 0, sizeof(steps));
+	steps[0].in = steps[1].in = in;
+	steps[0].lineNum = steps[1].lineNum = &lineNum;
+	steps[0].defaultDepth = steps[1].defaultDepth = o->queueDepth;
+	steps[0].copyFiles = steps[1].copyFiles = o->copyFiles;
 
-	if ((strLen <= 0) || (strLen >= sizeof(str)) || strcmp(str, GD_STR)) {
-		libusb_close(hDev);
-		return NULL;
+	PrepareStep(cur);
+
+	while (cur->ok && !cur->eof) {
+		BatchStep *tmp;
+		pthread_t preparer;
+		bool threaded;
+		bool success;
+
+		/* Only one step reads from the file at a time */
+		threaded = !pthread_create(&preparer, NULL, PrepareStep, next);
+
+		success = ExecuteCommand(usbctx, phGD, devKey, &cur->cmd);
+		FreeStep(cur);
+
+		if (threaded) {
+			pthread_join(preparer, NULL);
+		} else if (success) {
+			PrepareStep(next);
+		}
+
+		if (!success) {
+			fprintf(stderr, "Batch line failed, stopping\n");
+			FreeStep(next);
+			goto cleanup;
+		}
+
+		tmp = cur;
+		cur = next;
+		next = tmp;
 	}
 
-	printf("Found Jaguar GameDrive - bus: %" PRIu8 " port: %" PRIu8
-	       " device: %" PRIu8 "\n",
-	       libusb_get_bus_number(dev),
-	       libusb_get_port_number(dev),
-	       libusb_get_device_address(dev));
+	if (cur->eof) {
+		exitCode = 0;
+	}
+
+cleanup:
+	fclose(in);
+
+	return exitCode;
+}
+
+/* How long a changed file must stay untouched before it is used */
+#define WATCH_QUIET_MS 200
+
+/*
+ * Carry out o, then again each time one of its files changes, over the same
+ * connection to the GameDrive. A failed run, e.g. of a half-built file that
+ * slipped past the quiet period, just waits for the next change. Runs until
+ * interrupted.
+ */
+static int RunWatch(libusb_context *usbctx,
+		    libusb_device_handle **phGD,
+		    const char *devKey,
+		    const Options *o)
+{
+	const char *paths[2];
+	unsigned int numPaths = 0;
+	Watch *watch;
+
+	if (o->fileName) paths[numPaths++] = o->fileName;
+	if (o->writeFileName) paths[numPaths++] = o->writeFileName;
+
+	/* Start watching first so changes made during the first run count */
+	if (!(watch = WatchFiles(paths, numPaths))) {
+		return -1;
+	}
+
+	do {
+		/* PrepareCommand() fills in defaults, so start over each time */
+		Options iter = *o;
+
+		if (RunCommands(usbctx, phGD, devKey, &iter)) {
+			fprintf(stderr, "Failed, waiting for changes\n");
+		}
 
-	return hDev;
+		printf("\nWatching for changes, Ctrl-C to stop\n");
+		fflush(stdout);
+	} while (WaitForChange(watch, WATCH_QUIET_MS));
+
+	FreeWatch(watch);
+
+	return 0;
 }
 
-static void CloseGD(libusb_device_handle *hGD)
+/*
+ * Run either a batch file or a single set of commands.
+ */
+static int RunOptions(libusb_context *usbctx,
+		      libusb_device_handle **phGD,
+		      const char *devKey,
+		      Options *o)
 {
-	if (hGD) {
-		libusb_release_interface(hGD, 0);
-		libusb_close(hGD); hGD = NULL;
+	if (o->batchName) {
+		return RunBatch(usbctx, phGD, devKey, o);
+	}
+
+	if (o->watch) {
+		return RunWatch(usbctx, phGD, devKey, o);
 	}
+
+	return RunCommands(usbctx, phGD, devKey, o);
 }
 
-static libusb_device_handle *OpenGD(libusb_context *usbctx)
+/* Most GameDrives one run will drive at once */
+#define MAX_GAMEDRIVES 16
+
+/* True if devList selects more than one GameDrive, or possibly could */
+static bool IsMultiDevice(const char *devList)
 {
-	libusb_device_handle *hGD = NULL;
+	return devList && (!strcmp(devList, "all") || strchr(devList, ','));
+}
+
+/* Check whether key is one of the comma-separated entries of devList */
+static bool KeyInList(const char *devList, const char *key)
+{
+	const size_t keyLen = strlen(key);
+	const char *entry = devList;
+
+	while (entry) {
+		const char *end = strchr(entry, ',');
+		size_t len = end ? (size_t)(end - entry) : strlen(entry);
+
+		if ((len == keyLen) && !strncmp(entry, key, len)) {
+			return true;
+		}
+
+		entry = end ? end + 1 : NULL;
+	}
+
+	return false;
+}
+
+/*
+ * Find the GameDrives selected by devList, either "all" or a comma-separated
+ * list of bus/port paths, and return their paths.
+ */
+static unsigned int ListGDs(const char *devList,
+			    char keys[][DEV_KEY_LEN],
+			    unsigned int maxKeys)
+{
+	const bool all = !strcmp(devList, "all");
+	libusb_context *usbctx = NULL;
 	libusb_device **devs;
 	ssize_t i, nDevs;
-	int config;
+	unsigned int numKeys = 0;
+	int res;
+
+	if ((res = libusb_init(&usbctx)) < 0) {
+		REPORT_USB_ERR(res, "libusb_init");
+		return 0;
+	}
+
+	if ((nDevs = libusb_get_device_list(usbctx, &devs)) < 0) {
+		REPORT_USB_ERR(nDevs, "libusb_get_device_list");
+		libusb_exit(usbctx);
+		return 0;
+	}
 
-	CHECKED_USB_RES(nDevs, libusb_get_device_list(usbctx, &devs));
+	for (i = 0; (i < nDevs) && (numKeys < maxKeys); i++) {
+		libusb_device_handle *hDev;
 
-	for (i = 0; i < nDevs; i++) {
-		if ((hGD = IsJagGD(devs[i]))) {
-			break;
+		GetDeviceKey(devs[i], keys[numKeys], DEV_KEY_LEN);
+
+		if (!all && !KeyInList(devList, keys[numKeys])) {
+			continue;
 		}
 
+		if ((hDev = IsJagGD(devs[i]))) {
+			libusb_close(hDev);
+			numKeys++;
+		}
 	}
 
 	libusb_free_device_list(devs, 1 /* Do unref devices */);
+	libusb_exit(usbctx);
 
-	if (!hGD) {
-		return NULL;
-	}
+	return numKeys;
+}
 
-	CHECKED_USB(libusb_get_configuration(hGD, &config));
+static void ShowFound(libusb_device_handle *hGD)
+{
+	libusb_device *dev = libusb_get_device(hGD);
 
-	if (config == 0) {
-		CHECKED_USB(libusb_set_configuration(hGD, 1));
-	}
+	printf("Found Jaguar GameDrive - bus: %" PRIu8 " port: %" PRIu8
+	       " device: %" PRIu8 "\n", libusb_get_bus_number(dev),
+	       libusb_get_port_number(dev), libusb_get_device_address(dev));
+}
+
+typedef struct FanOut FanOut;
+
+typedef struct {
+	FanOut *fan;
+	char key[DEV_KEY_LEN];
 
 	/*
-	 * Claim the erroneously-numbered "0" interface the JagGD uses for its
-	 * control messages.
+	 * Each device gets its own libusb context, so its transfers are only
+	 * ever handled by its own worker thread.
 	 */
-	CHECKED_USB(libusb_claim_interface(hGD, 0));
+	libusb_context *usbctx;
+	libusb_device_handle *hGD;
 
-	return hGD;
-}
+	/* A copy of the shared command, with a file handle of its own */
+	Command cmd;
 
-static bool CheckMemRange(const char *addrType, uint32_t addr)
+	uint32_t percent;
+	bool done;
+	bool success;
+} FanOutDevice;
+
+struct FanOut {
+	pthread_mutex_t lock;
+	FanOutDevice devs[MAX_GAMEDRIVES];
+	unsigned int numDevs;
+};
+
+/* Redraw the status line. Called with the lock held. */
+static void ShowFanOut(const FanOut *fan)
 {
-	static const uint32_t JAG_MIN_MEMORY = 0x2000U;
-	static const uint32_t JAG_MAX_MEMORY = 0xE00000;
+	unsigned int i;
+
+	printf("\r");
+
+	for (i = 0; i < fan->numDevs; i++) {
+		const FanOutDevice *fd = &fan->devs[i];
 
-	if ((addr >= JAG_MIN_MEMORY) && (addr < JAG_MAX_MEMORY)) {
-		return true;
+		if (!fd->done) {
+			printf("%s:%3" PRIu32 "%%  ", fd->key, fd->percent);
+		} else {
+			printf("%s: %s  ", fd->key, fd->success ? "done" : "FAILED");
+		}
 	}
 
-	fprintf(stderr, "%s address $%" PRIx32 " is out of range.\n",
-		addrType, addr);
-	fprintf(stderr, "Valid memory range: [$%" PRIx32 ", $%" PRIx32 ")\n",
-		JAG_MIN_MEMORY, JAG_MAX_MEMORY);
+	fflush(stdout);
+}
 
-	return false;
+static void FanOutProgress(void *data, uint32_t percent)
+{
+	FanOutDevice *fd = data;
+
+	pthread_mutex_lock(&fd->fan->lock);
+	if (percent != fd->percent) {
+		fd->percent = percent;
+		ShowFanOut(fd->fan);
+	}
+	pthread_mutex_unlock(&fd->fan->lock);
 }
 
-int main(int argc, char *argv[])
+static void *FanOutWorker(void *data)
 {
-	libusb_context *usbctx = NULL;
-	libusb_device_handle *hGD = NULL;
-	JagFile *jf = NULL;
-	FILE *fp = NULL;
-	char *oFileName = NULL;
-	char *oEepromName = NULL;
-	char *oWriteFileName = NULL;
-	uint32_t oBase = 0x0;
-	uint32_t oSize = 0x0;
-	uint32_t oOffset = 0xffffffffu;
-	uint32_t oExec = 0x0;
-	int transferSize;
-	int exitCode = -1;
-	bool oReset = false;
-	bool oDebug = false;
-	bool oBoot = false;
-	bool oBootRom = false;
-	uint8_t oEepromType = 0;
-	static const uint32_t MAX_TRANSFER_SIZE = 16 * 1024;
-
-	uint8_t reset[] = { 0x02, 0x00 };
-	uint8_t writeFile[0x36] = {
-		/* Total cmd size = 0x36, cmd = 0x05 */
-		0x36, 0x05,
-
-#define WF_OFF_FILE_NAME 0x02
-		/* Destination file name = max 48 bytes, NUL terminated */
-		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-
-#define WF_OFF_FILE_SIZE 0x32
-		/* File size (Little endian) */
-		0x00, 0x00, 0x00, 0x00
-	};
-	uint8_t eeprom[0x39] = {
-		/* Total cmd size = 0x39, cmd = 0x02 */
-		0x39, 0x02,
+	FanOutDevice *fd = data;
+	bool success = false;
 
-		/* Upload size, always zero */
-		0x00, 0x00, 0x00, 0x00,
+	/*
+	 * Every device reads the file through a stream of its own, opened the
+	 * way PrepareCommand() opened the shared one, archives and all.
+	 */
+	if (fd->cmd.o->writeFileName &&
+	    !(fd->cmd.fp = PrepFile(fd->cmd.o->writeFileName, true,
+				    fd->cmd.dstFileName,
+				    &fd->cmd.writeSize))) {
+		/* PrepFile prints its own error messages */
+		fprintf(stderr, "%s: Failed to prepare write file\n",
+			fd->key);
+	} else {
+		success = ExecuteCommand(fd->usbctx, &fd->hGD, fd->key,
+					 &fd->cmd);
+	}
 
-#define EEP_OFF_SIZE_AND_CMD 0x06
-		/* server cmd size = 0x33, server cmd = 0x06 */
-		0x33, 0x06,
+	if (fd->cmd.fp) fclose(fd->cmd.fp);
+	fd->cmd.fp = NULL;
 
-#define EEP_OFF_EEPROM_TYPE 0x08
-		/* 0 = 128b, 1 = 256b or 512b, 2 = 1024b or 2048b */
-		0x00,
+	pthread_mutex_lock(&fd->fan->lock);
+	fd->done = true;
+	fd->success = success;
+	ShowFanOut(fd->fan);
+	pthread_mutex_unlock(&fd->fan->lock);
 
-#define EEP_OFF_EEPROM_FNAME 0x09
-		/* Filename on SD card, max 48 bytes, includes \0 terminator */
-	};
-	uint8_t uploadExec[] = { 0x14, 0x02,
-
-#define UPEX_OFF_SIZE_LE 0x02
-		/* Offset 0x2:
-		 * Upload size, little-endian (LE), or 0 for exec-only */
-		0x00, 0x00, 0x00, 0x00,
-
-#define UPEX_OFF_MAGIC0 0x06
-		/* Offset 0x6:
-		 * ??? 0x0605 for exec-only, 0x0e04 for upload */
-		0x06, 0x05,
-
-#define UPEX_OFF_DST_OR_START 0x08
-		/* Offset 0x8:
-		 * Destination addr for upload, exec addr for exec-only, BE */
-		0x00, 0x00, 0x00, 0x00,
-
-#define UPEX_OFF_SIZE_BE_MAGIC1 0x0C
-		/* Offset 0xC:
-		 * Upload size, big-endian (BE), or 0x7a774a00 for exec-only */
-		0x7a, 0x77, 0x4a, 0x00,
-
-#define UPEX_OFF_START_MAGIC2 0x10
-		/* Offset 0x10:
-		 * Exec addr, BE, or 0x00008419 for exec-only */
-		0x00, 0x00, 0x84, 0x19
-	};
+	return NULL;
+}
 
-	printf("JagGD Version %d.%d.%d\n\n",
-	       JAGGD_MAJOR, JAGGD_MINOR, JAGGD_MICRO);
+/*
+ * Carry out o on several GameDrives at once. Files are loaded once and the
+ * same buffers are uploaded to every device, each by its own worker thread.
+ * A device that can't be opened, or fails part way, is reported as failed
+ * and the others carry on.
+ */
+static int RunFanOut(Options *o)
+{
+	char keys[MAX_GAMEDRIVES][DEV_KEY_LEN];
+	pthread_t workers[MAX_GAMEDRIVES];
+	bool started[MAX_GAMEDRIVES] = { false };
+	FanOut *fan = NULL;
+	Command cmd;
+	unsigned int numKeys, i;
+	int exitCode = -1;
 
-	if (!ParseOptions(argc, argv, &oReset, &oDebug, &oBoot, &oBootRom,
-			  &oFileName, &oBase, &oSize, &oOffset, &oExec,
-			  &oEepromName, &oEepromType, &oWriteFileName)) {
-		/* ParseOptions() prints usage on failure */
+	if (o->batchName || o->daemon || o->watch || o->syncDir ||
+	    (o->fileName && !strcmp(o->fileName, "-"))) {
+		fprintf(stderr, "-b, -sync, -u -, --daemon and --watch work with "
+			"one GameDrive at a time\n");
 		return -1;
 	}
 
-	CHECKED_USB(libusb_init(&usbctx));
-
-	hGD = OpenGD(usbctx);
+	numKeys = ListGDs(o->devices, keys, MAX_GAMEDRIVES);
 
-	if (hGD == NULL) {
-		fprintf(stderr, "Jaguar GameDrive not found\n");
-		goto cleanup;
+	if (numKeys == 0) {
+		fprintf(stderr, "No matching Jaguar GameDrives found\n");
+		return -1;
 	}
 
-	if (oReset) {
-		printf("Reboot");
-		if (oDebug) {
-			/* Boot into the debug stub */
-			reset[1] = 0x01;
-			printf(" (Debug Console)\n");
-		} else if (oBootRom) {
-			/* Boot the currently loaded ROM from the Jaguar BIOS */
-			reset[1] = 0x06;
-			printf(" (ROM)\n");
-		} else {
-			/* Boot into the JagGD menu */
-			reset[1] = 0x00;
-			printf("\n");
-		}
+	if (strcmp(o->devices, "all")) {
+		const char *entry = o->devices;
+		bool missing = false;
 
-		/*
-		 * Send a reset command over the control interface.
-		 */
-		CHECKED_USB(libusb_control_transfer(hGD,
-					LIBUSB_REQUEST_TYPE_VENDOR |
-					LIBUSB_RECIPIENT_INTERFACE,
-					1, /* Request number */
-					0, /* Value */
-					0, /* Index: Specify interface 0 */
-					reset, /* Data */
-					sizeof(reset), /* Size */
-					2000 /* 2 second timeout */));
-
-		/* jaggd does this. Presumably it improves stability? */
-		sleep(1);
-		usleep(500000);
-	}
-
-	if (oEepromName) {
-		eeprom[EEP_OFF_EEPROM_TYPE] = oEepromType;
-		strncpy((char *)&eeprom[EEP_OFF_EEPROM_FNAME], oEepromName,
-			(sizeof(eeprom) - EEP_OFF_EEPROM_FNAME) - 1);
-
-		printf("Setting EEPROM file: '%s', %s bytes...", oEepromName,
-		       (oEepromType == 0) ? "128" : (oEepromType == 1) ? "256/512" :
-		       "1024/2048");
-		fflush(stdout);
+		/* Every device asked for by name must be there */
+		while (entry) {
+			const char *end = strchr(entry, ',');
+			int len = end ? (int)(end - entry) : (int)strlen(entry);
 
-		/*
-		 * Send enable EEPROM command over the control interface.
-		 */
-		CHECKED_USB(libusb_control_transfer(hGD,
-					LIBUSB_REQUEST_TYPE_VENDOR |
-					LIBUSB_RECIPIENT_INTERFACE,
-					1, /* Request number */
-					0, /* Value */
-					0, /* Index: Specify interface 0 */
-					eeprom, /* Data */
-					sizeof(eeprom), /* Size */
-					2000 /* 2 second timeout */));
-
-		printf("OK\n");
-	}
-
-	if (oWriteFileName) {
-		uint8_t bytes[MAX_TRANSFER_SIZE];
-		const char *dstFileName;
-		uint32_t size;
-		uint32_t bytesUploaded = 0;
-		uint32_t percent;
-		bool first = true;
+			for (i = 0; i < numKeys; i++) {
+				if ((strlen(keys[i]) == (size_t)len) &&
+				    !strncmp(keys[i], entry, len)) {
+					break;
+				}
+			}
+
+			if (i >= numKeys) {
+				fprintf(stderr, "Jaguar GameDrive %.*s not "
+					"found\n", len, entry);
+				missing = true;
+			}
 
-		fp = PrepFile(oWriteFileName, &dstFileName, &size);
+			entry = end ? end + 1 : NULL;
+		}
 
-		if (!fp) {
-			/* PrepFile prints its own error messages */
-			goto cleanup;
+		if (missing) {
+			return -1;
 		}
+	}
 
-		strncpy((char*)&writeFile[WF_OFF_FILE_NAME], dstFileName, 47);
+	if (!PrepareCommand(o, &cmd)) {
+		return -1;
+	}
 
-		/*
-		 * Use memcpy rather than a regular write, as the size field is
-		 * not naturally aligned.
-		 */
-		memcpy(&writeFile[WF_OFF_FILE_SIZE], &size, sizeof(size));
+	if (!(fan = calloc(1, sizeof(*fan)))) {
+		fprintf(stderr, "Failed to alloc fan-out state\n");
+		goto cleanup;
+	}
 
-		printf("WRITE FILE (%s)...", dstFileName);
-		fflush(stdout);
+	pthread_mutex_init(&fan->lock, NULL);
 
-		CHECKED_USB(libusb_control_transfer(hGD,
-					LIBUSB_REQUEST_TYPE_VENDOR |
-					LIBUSB_RECIPIENT_INTERFACE,
-					1, /* Request number */
-					0, /* Value */
-					0, /* Index: Specify interface 0 */
-					writeFile, /* Data */
-					sizeof(writeFile), /* Size */
-					2000 /* 2 second timeout */));
-
-		while (bytesUploaded < size) {
-			uint32_t bytesToTransfer = size - bytesUploaded;
-			if (bytesToTransfer > MAX_TRANSFER_SIZE)
-				bytesToTransfer = MAX_TRANSFER_SIZE;
-
-			if (fread(&bytes[0], 1, bytesToTransfer, fp) !=
-			    bytesToTransfer) {
-				fprintf(stderr,
-					"Failed to read data from local file\n");
-				goto cleanup;
-			}
+	for (i = 0; i < numKeys; i++) {
+		FanOutDevice *fd = &fan->devs[i];
+		int res;
+
+		fd->fan = fan;
+		strcpy(fd->key, keys[i]);
+		fan->numDevs++;
 
-			CHECKED_USB(libusb_bulk_transfer(hGD,
-					LIBUSB_ENDPOINT_OUT |
-					/* XXX 2 == Bulk out endpoint number */
-					(LIBUSB_ENDPOINT_ADDRESS_MASK & 2),
-					&bytes[0],
-					bytesToTransfer,
-					&transferSize,
-					1000 * 60 * 2 /* 2 minute timeout */));
-			bytesUploaded += transferSize;
-			percent = ((uint64_t)bytesUploaded * 100u) / size;
-			if (!first) printf("\b\b\b");
-			else first = false;
-			printf("%2" PRIu32 "%%", percent);
-			fflush(stdout);
+		if ((res = libusb_init(&fd->usbctx)) < 0) {
+			REPORT_USB_ERR(res, "libusb_init");
+			fd->usbctx = NULL;
+		} else if (!(fd->hGD = OpenGD(fd->usbctx, fd->key))) {
+			fprintf(stderr, "Failed to open GameDrive %s\n",
+				fd->key);
+		} else {
+			ShowFound(fd->hGD);
 		}
 
-		fclose(fp); fp = NULL;
+		/* The others carry on without it, and it's reported FAILED */
+		fd->done = !fd->hGD;
 
-		/* jaggd does this. Presumably it improves stability? */
-		usleep(500000);
-		printf("\nOK!\n");
+		fd->cmd = cmd;
+		fd->cmd.fp = NULL;
+		fd->cmd.report = FanOutProgress;
+		fd->cmd.reportData = fd;
 	}
 
-	if (oFileName) {
-		jf = LoadFile(oFileName);
+	printf("\nSending to %u GameDrives...\n", fan->numDevs);
 
-		if (!jf) {
-			/* LoadFile prints its own error messages */
-			goto cleanup;
-		}
+	pthread_mutex_lock(&fan->lock);
+	ShowFanOut(fan);
+	pthread_mutex_unlock(&fan->lock);
 
-		if (oExec == 0x0) {
-			oExec = jf->execAddr;
+	for (i = 0; i < fan->numDevs; i++) {
+		if (fan->devs[i].done) {
+			continue;
 		}
 
-		if (oBase != 0x0) {
-			jf->baseAddr = oBase;
+		if (pthread_create(&workers[i], NULL, FanOutWorker,
+				   &fan->devs[i])) {
+			fprintf(stderr, "\nFailed to start worker for %s\n",
+				fan->devs[i].key);
+			break;
 		}
+		started[i] = true;
+	}
 
-		if (!CheckMemRange("Base upload", jf->baseAddr)) {
-			goto cleanup;
+	exitCode = 0;
+
+	for (i = 0; i < fan->numDevs; i++) {
+		if (started[i]) {
+			pthread_join(workers[i], NULL);
 		}
+	}
 
-		if (oOffset != 0xffffffffu) {
-			if (oOffset > jf->length) {
-				fprintf(stderr, "Offset %" PRIu32
-						"exceeds file length %zu\n",
-					oOffset, jf->length);
-				goto cleanup;
-			}
+	printf("\n\n");
+
+	for (i = 0; i < fan->numDevs; i++) {
+		const FanOutDevice *fd = &fan->devs[i];
 
-			jf->offset = oOffset;
+		printf("%s: %s\n", fd->key, fd->success ? "OK!" : "FAILED");
+
+		if (!fd->success) {
+			exitCode = -1;
 		}
+	}
 
-		if (oSize != 0x0) {
-			if ((oSize + jf->offset) > jf->length) {
-				fprintf(stderr, "Size %" PRIu32 " + offset %"
-					        PRId64 " exceeds file length "
-						"%zu\n",
-					oSize, (int64_t)jf->offset,
-					jf->length);
-				goto cleanup;
+cleanup:
+	if (fan) {
+		for (i = 0; i < fan->numDevs; i++) {
+			CloseGD(fan->devs[i].hGD);
+
+			if (fan->devs[i].usbctx) {
+				libusb_exit(fan->devs[i].usbctx);
 			}
-			jf->dataSize = oSize;
 		}
+
+		pthread_mutex_destroy(&fan->lock);
+		free(fan);
 	}
 
-	if (oBootRom) {
-		oExec = 0xffffffff;
-	} else if (oBoot && !CheckMemRange("Execution address", oExec)) {
-		goto cleanup;
+	FreeCommand(&cmd);
+
+	return exitCode;
+}
+
+typedef struct {
+	libusb_context *usbctx;
+	libusb_device_handle *hGD;
+	const char *devKey;
+} DaemonDevice;
+
+/* Run a command line forwarded to the daemon by another jaggd process */
+static int RunForwarded(int argc, char *argv[], void *data)
+{
+	DaemonDevice *dd = data;
+	Options opts;
+	int exitCode;
+
+	if (!ParseOptions(argc, argv, &opts)) {
+		/* ParseOptions() prints usage on failure */
+		return -1;
 	}
 
-	if (jf) {
-		const uint32_t upSize = jf->dataSize;
-		const uint32_t baseAddr = jf->baseAddr;
-		const uint32_t execAddr = oBoot ? oExec : 0x0;
+	if (opts.daemon) {
+		fprintf(stderr, "A jaggd daemon is already running\n");
+		FreeOptions(&opts);
+		return -1;
+	}
 
+	/* It would tie up the daemon until the daemon itself is stopped */
+	if (opts.watch) {
+		fprintf(stderr, "--watch can't be run through the jaggd daemon. "
+			"Stop the daemon first\n");
+		FreeOptions(&opts);
+		return -1;
+	}
 
-		uploadExec[UPEX_OFF_SIZE_LE+0] = (upSize      ) & 0xff;
-		uploadExec[UPEX_OFF_SIZE_LE+1] = (upSize >>  8) & 0xff;
-		uploadExec[UPEX_OFF_SIZE_LE+2] = (upSize >> 16) & 0xff;
-		uploadExec[UPEX_OFF_SIZE_LE+3] = (upSize >> 24) & 0xff;
+	if (opts.devices && strcmp(opts.devices, dd->devKey)) {
+		fprintf(stderr, "This jaggd daemon only serves GameDrive %s\n",
+			dd->devKey);
+		FreeOptions(&opts);
+		return -1;
+	}
 
-		uploadExec[UPEX_OFF_MAGIC0+0] = 0x0e;
-		uploadExec[UPEX_OFF_MAGIC0+1] = 0x04;
+	/* The daemon's own trace, if any, already covers this run */
+	if (opts.traceName && TraceNow()) {
+		fprintf(stderr, "The jaggd daemon is already recording a "
+			"trace\n");
+		FreeOptions(&opts);
+		return -1;
+	}
 
-		uploadExec[UPEX_OFF_DST_OR_START+0] = (baseAddr >> 24) & 0xff;
-		uploadExec[UPEX_OFF_DST_OR_START+1] = (baseAddr >> 16) & 0xff;
-		uploadExec[UPEX_OFF_DST_OR_START+2] = (baseAddr >>  8) & 0xff;
-		uploadExec[UPEX_OFF_DST_OR_START+3] = (baseAddr      ) & 0xff;
+	if (opts.traceName && !TraceOpen(opts.traceName)) {
+		FreeOptions(&opts);
+		return -1;
+	}
 
-		uploadExec[UPEX_OFF_SIZE_BE_MAGIC1+0] = (upSize >> 24) & 0xff;
-		uploadExec[UPEX_OFF_SIZE_BE_MAGIC1+1] = (upSize >> 16) & 0xff;
-		uploadExec[UPEX_OFF_SIZE_BE_MAGIC1+2] = (upSize >>  8) & 0xff;
-		uploadExec[UPEX_OFF_SIZE_BE_MAGIC1+3] = (upSize      ) & 0xff;
+	/*
+	 * The GameDrive may have been unplugged or the Jaguar power cycled
+	 * since the last command, leaving a handle that only gets
+	 * LIBUSB_ERROR_NO_DEVICE. Open it again if it's back.
+	 */
+	if (!dd->hGD || GDGone(dd->hGD)) {
+		CloseGD(dd->hGD);
+		dd->hGD = OpenGD(dd->usbctx, dd->devKey);
+	}
 
-		uploadExec[UPEX_OFF_START_MAGIC2+0] = (execAddr >> 24) & 0xff;
-		uploadExec[UPEX_OFF_START_MAGIC2+1] = (execAddr >> 16) & 0xff;
-		uploadExec[UPEX_OFF_START_MAGIC2+2] = (execAddr >>  8) & 0xff;
-		uploadExec[UPEX_OFF_START_MAGIC2+3] = (execAddr      ) & 0xff;
+	if (!dd->hGD) {
+		fprintf(stderr, "Jaguar GameDrive %s not found. It will be "
+			"looked for again on the next command\n", dd->devKey);
+		exitCode = -1;
+	} else {
+		opts.copyFiles = true;
+		exitCode = RunOptions(dd->usbctx, &dd->hGD, dd->devKey,
+				      &opts);
+	}
 
-		printf("UPLOADING %s %zd BYTES TO $%" PRIx32, oFileName,
-		       jf->dataSize, jf->baseAddr);
-		if (jf->offset) {
-			printf(" OFFSET $%" PRIx64, (int64_t)jf->offset);
-		}
+	if (opts.traceName) {
+		TraceClose();
+	}
 
-		if (oBootRom) {
-			printf(" REBOOT");
-		} else if (oExec != baseAddr) {
-			printf(" ENTRY $%" PRIx32, oExec);
-		}
+	FreeOptions(&opts);
 
-		if (execAddr) {
-			printf(" EXECUTE");
+	return exitCode;
+}
+
+int main(int argc, char *argv[])
+{
+	libusb_context *usbctx = NULL;
+	libusb_device_handle *hGD = NULL;
+	Options opts;
+	char devKey[DEV_KEY_LEN];
+	uint64_t traceStart;
+	int exitCode = -1;
+	int res;
+
+	printf("JagGD Version %d.%d.%d\n\n",
+	       JAGGD_MAJOR, JAGGD_MINOR, JAGGD_MICRO);
+
+	if (!ParseOptions(argc, argv, &opts)) {
+		/* ParseOptions() prints usage on failure */
+		return -1;
+	}
+
+	if (IsMultiDevice(opts.devices)) {
+		if (!opts.traceName || TraceOpen(opts.traceName)) {
+			exitCode = RunFanOut(&opts);
+			TraceClose();
 		}
 
-		printf("...");
-		fflush(stdout);
-	} else if (oBoot) {
-		uploadExec[UPEX_OFF_DST_OR_START+0] = (oExec >> 24) & 0xff;
-		uploadExec[UPEX_OFF_DST_OR_START+1] = (oExec >> 16) & 0xff;
-		uploadExec[UPEX_OFF_DST_OR_START+2] = (oExec >>  8) & 0xff;
-		uploadExec[UPEX_OFF_DST_OR_START+3] = (oExec      ) & 0xff;
-
-		if (oBootRom) {
-			printf("REBOOTING...");
+		FreeOptions(&opts);
+		return exitCode;
+	}
+
+	/*
+	 * Let a running daemon do the work if there is one. It records the
+	 * trace too, relative to this process' working directory.
+	 */
+	if (!opts.daemon && ForwardToDaemon(argc, argv, &exitCode)) {
+		FreeOptions(&opts);
+		return exitCode;
+	}
+
+	if (opts.traceName && !TraceOpen(opts.traceName)) {
+		FreeOptions(&opts);
+		return -1;
+	}
+
+	traceStart = TraceNow();
+
+	if ((res = libusb_init(&usbctx)) < 0) {
+		REPORT_USB_ERR(res, "libusb_init");
+		usbctx = NULL;
+		goto cleanup;
+	}
+
+	TraceSpan(traceStart, "usb", "libusb_init", NULL);
+
+	hGD = OpenGD(usbctx, opts.devices);
+
+	if (hGD == NULL) {
+		if (opts.devices) {
+			fprintf(stderr, "Jaguar GameDrive %s not found\n",
+				opts.devices);
 		} else {
-			printf("EXECUTING $%" PRIx32 "...", oExec);
+			fprintf(stderr, "Jaguar GameDrive not found\n");
 		}
-		fflush(stdout);
+		goto cleanup;
 	}
 
-	if (jf || oBoot) {
-		uint32_t bytesUploaded = 0;
-		uint32_t percent;
-		bool first = true;
+	ShowFound(hGD);
+	GetDeviceKey(libusb_get_device(hGD), devKey, sizeof(devKey));
 
-		/*
-		 * Send an upload command over the control interface.
-		 */
-		CHECKED_USB(libusb_control_transfer(hGD,
-					LIBUSB_REQUEST_TYPE_VENDOR |
-					LIBUSB_RECIPIENT_INTERFACE,
-					1, /* Request number */
-					0, /* Value */
-					0, /* Index: Specify interface 0 */
-					uploadExec, /* Data */
-					sizeof(uploadExec), /* Size */
-					2000 /* 2 second timeout */));
-
-		/*
-		 * Send the data to the bulk endpoint
-		 */
-		while (jf && (bytesUploaded < jf->dataSize)) {
-			static const int MAX_TRANSFER_SIZE = 16 * 1024;
-			int bytesToTransfer = jf->dataSize - bytesUploaded;
-			if (bytesToTransfer > MAX_TRANSFER_SIZE)
-				bytesToTransfer = MAX_TRANSFER_SIZE;
-
-			CHECKED_USB(libusb_bulk_transfer(hGD,
-					LIBUSB_ENDPOINT_OUT |
-					/* XXX 2 == Bulk out endpoint number */
-					(LIBUSB_ENDPOINT_ADDRESS_MASK & 2),
-					jf->buf + jf->offset + bytesUploaded,
-					bytesToTransfer,
-					&transferSize,
-					1000 * 60 * 2 /* 2 minute timeout */));
-			bytesUploaded += transferSize;
-			percent = ((uint64_t)bytesUploaded * 100u) / jf->dataSize;
-			if (!first) printf("\b\b\b");
-			else first = false;
-			printf("%2" PRIu32 "%%", percent);
-			fflush(stdout);
-		}
-
-		printf("\nOK!\n");
-	}
-
-	/* Success */
-	exitCode = 0;
+	if (opts.daemon) {
+		DaemonDevice dd = { usbctx, hGD, devKey };
 
-cleanup:
-	/* Close the write-to-memory-card file */
-	if (fp) fclose(fp);
+		exitCode = RunDaemon(RunForwarded, &dd);
 
-	/* Free file data */
-	FreeFile(jf);
+		/* May have been reopened along the way */
+		hGD = dd.hGD;
+	} else {
+		exitCode = RunOptions(usbctx, &hGD, devKey, &opts);
+	}
 
+cleanup:
 	/* Shut down the device */
 	CloseGD(hGD);
 
 	/* Shut down libusb */
-	libusb_exit(usbctx); usbctx = NULL;
+	if (usbctx) {
+		libusb_exit(usbctx); usbctx = NULL;
+	}
 
-	free(oWriteFileName); oWriteFileName = NULL;
-	free(oEepromName); oEepromName = NULL;
-	free(oFileName); oFileName = NULL;
+	TraceClose();
+	FreeOptions(&opts);
 
 	return exitCode;
 }
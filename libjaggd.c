@@ -0,0 +1,605 @@
+/*
+ * SPDX-License-Identifier: CC0-1.0
+ *
+ * Author: James Jones
+ */
+
+/* Needed to get strdup() definitions with -std=c99 */
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "usberr.h"
+#include "gd.h"
+#include "fileio.h"
+#include "xfer.h"
+#include "shadow.h"
+#include "libjaggd.h"
+
+typedef enum {
+	OP_RESET,
+	OP_UPLOAD_FILE,
+	OP_UPLOAD_DATA,
+	OP_EXEC,
+	OP_WRITE_FILE,
+	OP_EEPROM,
+} OpType;
+
+struct JagGDOp {
+	JagGD *gd;
+	JagGDOp *next;
+	OpType type;
+	JagGDStatus status;
+
+	char *fileName;		/* OP_UPLOAD_FILE, OP_WRITE_FILE, OP_EEPROM */
+	const uint8_t *data;	/* OP_UPLOAD_DATA */
+	size_t size;
+	uint32_t addr;
+	uint32_t execAddr;
+	bool exec;
+	uint8_t arg;		/* Boot mode or EEPROM type */
+
+	JagGDProgressFn progress;
+	void *progressData;
+};
+
+struct JagGD {
+	libusb_context *usbctx;
+	libusb_device_handle *hGD;
+	char devKey[DEV_KEY_LEN];
+	XferLink link;
+
+	pthread_t worker;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/* Signalled on submission and completion */
+	JagGDOp *head;
+	JagGDOp *tail;
+	bool stop;
+};
+
+/* Adds up the progress of an operation sent in several bulk uploads */
+typedef struct {
+	const JagGDOp *op;
+	uint64_t base;
+	uint64_t total;
+} OpProgress;
+
+static void ReportProgress(void *data, uint64_t done, uint64_t total)
+{
+	OpProgress *prog = data;
+
+	(void)total;
+	prog->op->progress(prog->op->progressData, prog->base + done,
+			   prog->total);
+}
+
+static bool Upload(JagGD *gd, const JagGDOp *op, OpProgress *prog,
+		   const uint8_t *data, uint32_t size, uint32_t addr,
+		   uint32_t execAddr)
+{
+	uint8_t uploadExec[GD_UPLOAD_CMD_SIZE];
+	GDUploadResume up = {
+		.hGD = gd->hGD,
+		.size = size,
+		.baseAddr = addr,
+		.execAddr = execAddr,
+	};
+	const XferResume resume = { .restart = ResumeUpload, .data = &up };
+	XferResult res;
+
+	SetUploadCmd(uploadExec, size, addr, execAddr);
+
+	/* BulkUpload only reads from the buffer */
+	res = !SendCmd(gd->hGD, uploadExec, sizeof(uploadExec)) ?
+		XFER_USB_FAILED :
+		BulkUpload(gd->usbctx, gd->hGD, &gd->link, (uint8_t *)data,
+			   size, &resume, op->progress ? ReportProgress : NULL,
+			   prog);
+	prog->base += size;
+
+	InvalidateShadows(gd->devKey, addr, addr + size);
+
+	return res == XFER_OK;
+}
+
+/* As in jaggd, only shadows of cartridge space outlive starting code */
+static bool Exec(JagGD *gd, uint32_t execAddr)
+{
+	uint8_t uploadExec[GD_UPLOAD_CMD_SIZE];
+
+	SetExecCmd(uploadExec, execAddr);
+
+	if (!SendCmd(gd->hGD, uploadExec, sizeof(uploadExec))) {
+		return false;
+	}
+
+	InvalidateShadows(gd->devKey, 0x0, JAG_ROM_START);
+
+	return true;
+}
+
+static bool RunReset(JagGD *gd, const JagGDOp *op)
+{
+	static const GDBootMode BOOT_MODES[] = {
+		[JAGGD_BOOT_MENU] = GD_BOOT_MENU,
+		[JAGGD_BOOT_DEBUG] = GD_BOOT_DEBUG,
+		[JAGGD_BOOT_ROM] = GD_BOOT_ROM,
+	};
+	uint8_t reset[GD_RESET_CMD_SIZE];
+	uint32_t waitedMs;
+	bool ready;
+
+	SetResetCmd(reset, BOOT_MODES[op->arg]);
+
+	if (!SendCmd(gd->hGD, reset, sizeof(reset))) {
+		return false;
+	}
+
+	InvalidateShadows(gd->devKey, 0x0, 0xffffffffu);
+
+	return WaitForGD(gd->usbctx, &gd->hGD, gd->devKey, RESET_WAIT_MS,
+			 &waitedMs, &ready);
+}
+
+static bool RunUploadFile(JagGD *gd, const JagGDOp *op)
+{
+	OpProgress prog = { .op = op };
+	/* Not mapped: the host may well rebuild the file while it's sent */
+	JagFile *jf = LoadFile(op->fileName, false);
+	unsigned int i, last = 0;
+	bool ok;
+
+	if (!jf) {
+		/* LoadFile prints its own error messages */
+		return false;
+	}
+
+	if (op->addr != 0x0) {
+		/* Sections keep their places relative to each other */
+		for (i = 0; i < jf->numSections; i++) {
+			jf->sections[i].addr += op->addr - jf->baseAddr;
+		}
+
+		jf->baseAddr = op->addr;
+	}
+
+	if (!CheckMemRange("Base upload", jf->baseAddr) ||
+	    (op->exec && !CheckMemRange("Execution address", jf->execAddr))) {
+		FreeFile(jf);
+		return false;
+	}
+
+	if (jf->numSections == 0) {
+		prog.total = jf->dataSize;
+		ok = Upload(gd, op, &prog, jf->buf + jf->offset, jf->dataSize,
+			    jf->baseAddr, op->exec ? jf->execAddr : 0x0);
+		FreeFile(jf);
+		return ok;
+	}
+
+	for (i = 0; i < jf->numSections; i++) {
+		if (!jf->sections[i].bss) {
+			if (!CheckMemRange("Section upload",
+					   jf->sections[i].addr)) {
+				FreeFile(jf);
+				return false;
+			}
+
+			prog.total += jf->sections[i].size;
+			last = i;
+		}
+	}
+
+	/* The last section sent starts the program, as in jaggd */
+	for (i = 0; i < jf->numSections; i++) {
+		const JagSection *s = &jf->sections[i];
+
+		if (!s->bss &&
+		    !Upload(gd, op, &prog, jf->buf + s->offset, s->size,
+			    s->addr, (op->exec && (i == last)) ?
+			    jf->execAddr : 0x0)) {
+			FreeFile(jf);
+			return false;
+		}
+	}
+
+	if (op->exec) {
+		InvalidateShadows(gd->devKey, 0x0, JAG_ROM_START);
+	}
+
+	FreeFile(jf);
+	return true;
+}
+
+static bool RunWriteFile(JagGD *gd, const JagGDOp *op)
+{
+	OpProgress prog = { .op = op };
+	uint8_t writeFile[GD_WRITE_FILE_CMD_SIZE];
+	char dstFileName[SD_MAX_NAME + 1];
+	uint32_t size, waitedMs;
+	GDCmdResume resend = {
+		.hGD = gd->hGD,
+		.cmd = writeFile,
+		.size = sizeof(writeFile),
+	};
+	const XferResume resume = {
+		.restart = ResendCmd,
+		.data = &resend,
+		.fromStart = true,
+	};
+	XferResult res;
+	bool ready;
+	FILE *fp;
+
+	if (!(fp = PrepFile(op->fileName, true, dstFileName, &size))) {
+		/* PrepFile prints its own error messages */
+		return false;
+	}
+
+	prog.total = size;
+	SetWriteFileCmd(writeFile, dstFileName, size);
+
+	res = !SendCmd(gd->hGD, writeFile, sizeof(writeFile)) ?
+		XFER_USB_FAILED :
+		BulkUploadFile(gd->usbctx, gd->hGD, &gd->link, fp, size,
+			       &resume, op->progress ? ReportProgress : NULL,
+			       &prog);
+	fclose(fp);
+
+	if (res == XFER_SOURCE_FAILED) {
+		fprintf(stderr, "Failed to read data from local file\n");
+	}
+
+	if (res != XFER_OK) {
+		return false;
+	}
+
+	return WaitForGD(gd->usbctx, &gd->hGD, gd->devKey, WRITE_FILE_WAIT_MS,
+			 &waitedMs, &ready);
+}
+
+static bool RunOp(JagGD *gd, const JagGDOp *op)
+{
+	uint8_t eeprom[GD_EEPROM_CMD_SIZE];
+	OpProgress prog = { .op = op, .total = op->size };
+
+	switch (op->type) {
+	case OP_RESET:
+		return RunReset(gd, op);
+
+	case OP_UPLOAD_FILE:
+		return RunUploadFile(gd, op);
+
+	case OP_UPLOAD_DATA:
+		if (!Upload(gd, op, &prog, op->data, op->size, op->addr,
+			    op->execAddr)) {
+			return false;
+		}
+		if (op->execAddr) {
+			InvalidateShadows(gd->devKey, 0x0, JAG_ROM_START);
+		}
+		return true;
+
+	case OP_EXEC:
+		return Exec(gd, op->execAddr);
+
+	case OP_WRITE_FILE:
+		return RunWriteFile(gd, op);
+
+	case OP_EEPROM:
+		SetEepromCmd(eeprom, op->arg, op->fileName);
+		return SendCmd(gd->hGD, eeprom, sizeof(eeprom));
+	}
+
+	return false;
+}
+
+/* Runs each submitted operation in turn until the GameDrive is closed */
+static void *Worker(void *data)
+{
+	JagGD *gd = data;
+	JagGDOp *op;
+	bool ok;
+
+	pthread_mutex_lock(&gd->lock);
+
+	for (;;) {
+		while (!gd->head && !gd->stop) {
+			pthread_cond_wait(&gd->cond, &gd->lock);
+		}
+
+		if (!(op = gd->head)) {
+			break;
+		}
+
+		pthread_mutex_unlock(&gd->lock);
+		ok = RunOp(gd, op);
+		pthread_mutex_lock(&gd->lock);
+
+		/* Leave it queued until now so Close() waits for it */
+		if (!(gd->head = op->next)) {
+			gd->tail = NULL;
+		}
+
+		op->status = ok ? JAGGD_DONE : JAGGD_FAILED;
+		pthread_cond_broadcast(&gd->cond);
+	}
+
+	pthread_mutex_unlock(&gd->lock);
+	return NULL;
+}
+
+JagGD *JagGDOpen(const char *devKey)
+{
+	JagGD *gd = calloc(1, sizeof(*gd));
+	int res;
+
+	if (!gd) {
+		fprintf(stderr, "Failed to alloc GameDrive\n");
+		return NULL;
+	}
+
+	if ((res = libusb_init(&gd->usbctx)) < 0) {
+		REPORT_USB_ERR(res, "libusb_init");
+		free(gd);
+		return NULL;
+	}
+
+	if (!(gd->hGD = OpenGD(gd->usbctx, devKey))) {
+		fprintf(stderr, "Jaguar GameDrive not found\n");
+		goto fail;
+	}
+
+	GetDeviceKey(libusb_get_device(gd->hGD), gd->devKey,
+		     sizeof(gd->devKey));
+	GetXferLink(gd->hGD, &gd->link);
+	LoadXferTuning(gd->devKey, &gd->link);
+
+	pthread_mutex_init(&gd->lock, NULL);
+	pthread_cond_init(&gd->cond, NULL);
+
+	if (pthread_create(&gd->worker, NULL, Worker, gd)) {
+		fprintf(stderr, "Failed to start GameDrive worker thread\n");
+		pthread_cond_destroy(&gd->cond);
+		pthread_mutex_destroy(&gd->lock);
+		goto fail;
+	}
+
+	return gd;
+
+fail:
+	CloseGD(gd->hGD);
+	libusb_exit(gd->usbctx);
+	free(gd);
+	return NULL;
+}
+
+void JagGDClose(JagGD *gd)
+{
+	if (!gd) {
+		return;
+	}
+
+	pthread_mutex_lock(&gd->lock);
+	gd->stop = true;
+	pthread_cond_broadcast(&gd->cond);
+	pthread_mutex_unlock(&gd->lock);
+
+	pthread_join(gd->worker, NULL);
+
+	pthread_cond_destroy(&gd->cond);
+	pthread_mutex_destroy(&gd->lock);
+
+	CloseGD(gd->hGD);
+	libusb_exit(gd->usbctx);
+	free(gd);
+}
+
+const char *JagGDDeviceKey(const JagGD *gd)
+{
+	return gd->devKey;
+}
+
+static JagGDOp *NewOp(JagGD *gd, OpType type, const char *fileName)
+{
+	JagGDOp *op = calloc(1, sizeof(*op));
+
+	if (!op) {
+		fprintf(stderr, "Failed to alloc GameDrive operation\n");
+		return NULL;
+	}
+
+	if (fileName && !(op->fileName = strdup(fileName))) {
+		fprintf(stderr, "Failed to alloc file name\n");
+		free(op);
+		return NULL;
+	}
+
+	op->gd = gd;
+	op->type = type;
+	op->status = JAGGD_PENDING;
+
+	return op;
+}
+
+static JagGDOp *Submit(JagGDOp *op)
+{
+	JagGD *gd;
+
+	if (!op) {
+		return NULL;
+	}
+
+	gd = op->gd;
+
+	pthread_mutex_lock(&gd->lock);
+
+	if (gd->tail) {
+		gd->tail->next = op;
+	} else {
+		gd->head = op;
+	}
+
+	gd->tail = op;
+	pthread_cond_broadcast(&gd->cond);
+	pthread_mutex_unlock(&gd->lock);
+
+	return op;
+}
+
+JagGDOp *JagGDReset(JagGD *gd, JagGDBoot boot)
+{
+	JagGDOp *op;
+
+	if ((boot != JAGGD_BOOT_MENU) && (boot != JAGGD_BOOT_DEBUG) &&
+	    (boot != JAGGD_BOOT_ROM)) {
+		fprintf(stderr, "Invalid boot mode %d\n", (int)boot);
+		return NULL;
+	}
+
+	if ((op = NewOp(gd, OP_RESET, NULL))) {
+		op->arg = boot;
+	}
+
+	return Submit(op);
+}
+
+JagGDOp *JagGDUploadFile(JagGD *gd,
+			 const char *fileName,
+			 uint32_t baseAddr,
+			 bool exec,
+			 JagGDProgressFn progress,
+			 void *progressData)
+{
+	JagGDOp *op;
+
+	if ((op = NewOp(gd, OP_UPLOAD_FILE, fileName))) {
+		op->addr = baseAddr;
+		op->exec = exec;
+		op->progress = progress;
+		op->progressData = progressData;
+	}
+
+	return Submit(op);
+}
+
+JagGDOp *JagGDUploadData(JagGD *gd,
+			 const void *data,
+			 size_t size,
+			 uint32_t addr,
+			 uint32_t execAddr,
+			 JagGDProgressFn progress,
+			 void *progressData)
+{
+	JagGDOp *op;
+
+	if ((size == 0) || (size > UINT32_MAX)) {
+		fprintf(stderr, "Invalid upload size %zu\n", size);
+		return NULL;
+	}
+
+	if (!CheckMemRange("Upload", addr) ||
+	    (execAddr && !CheckMemRange("Execution address", execAddr))) {
+		return NULL;
+	}
+
+	if ((op = NewOp(gd, OP_UPLOAD_DATA, NULL))) {
+		op->data = data;
+		op->size = size;
+		op->addr = addr;
+		op->execAddr = execAddr;
+		op->progress = progress;
+		op->progressData = progressData;
+	}
+
+	return Submit(op);
+}
+
+JagGDOp *JagGDExec(JagGD *gd, uint32_t addr)
+{
+	JagGDOp *op;
+
+	if (!CheckMemRange("Execution address", addr)) {
+		return NULL;
+	}
+
+	if ((op = NewOp(gd, OP_EXEC, NULL))) {
+		op->execAddr = addr;
+	}
+
+	return Submit(op);
+}
+
+JagGDOp *JagGDWriteFile(JagGD *gd,
+			const char *fileName,
+			JagGDProgressFn progress,
+			void *progressData)
+{
+	JagGDOp *op;
+
+	if ((op = NewOp(gd, OP_WRITE_FILE, fileName))) {
+		op->progress = progress;
+		op->progressData = progressData;
+	}
+
+	return Submit(op);
+}
+
+JagGDOp *JagGDSetEeprom(JagGD *gd, const char *sdName, uint8_t type)
+{
+	JagGDOp *op;
+
+	if (type > 2) {
+		fprintf(stderr, "Invalid EEPROM type %" PRIu8 "\n", type);
+		return NULL;
+	}
+
+	if ((op = NewOp(gd, OP_EEPROM, sdName))) {
+		op->arg = type;
+	}
+
+	return Submit(op);
+}
+
+JagGDStatus JagGDPoll(JagGDOp *op)
+{
+	JagGDStatus status;
+
+	pthread_mutex_lock(&op->gd->lock);
+	status = op->status;
+	pthread_mutex_unlock(&op->gd->lock);
+
+	return status;
+}
+
+JagGDStatus JagGDWait(JagGDOp *op)
+{
+	JagGD *gd = op->gd;
+	JagGDStatus status;
+
+	pthread_mutex_lock(&gd->lock);
+
+	while (op->status == JAGGD_PENDING) {
+		pthread_cond_wait(&gd->cond, &gd->lock);
+	}
+
+	status = op->status;
+	pthread_mutex_unlock(&gd->lock);
+
+	return status;
+}
+
+void JagGDFreeOp(JagGDOp *op)
+{
+	if (!op) {
+		return;
+	}
+
+	JagGDWait(op);
+	free(op->fileName);
+	free(op);
+}
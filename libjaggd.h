@@ -0,0 +1,140 @@
+/*
+ * SPDX-License-Identifier: CC0-1.0
+ *
+ * Author: James Jones
+ */
+
+#ifndef LIBJAGGD_H_
+#define LIBJAGGD_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * libjaggd: drive a Jaguar GameDrive from another program, without running
+ * jaggd. Build it with 'make lib' and link with libjaggd.a or libjaggd.so,
+ * plus -lusb-1.0 -lpthread (and -lz, unless built with ZLIB=0) for the
+ * static library.
+ *
+ * Each open GameDrive has a worker thread of its own. Resets, uploads and
+ * the rest are submitted to it and carried out one after another in the
+ * order they were submitted. Submitting never blocks on the device: it
+ * returns an operation that can be polled or waited for.
+ *
+ * Errors are printed to stderr, as jaggd prints them, and nothing else is
+ * printed. As in jaggd, failed bulk transfers and command packets are
+ * retried, and if that doesn't help the operation fails, as it does for
+ * anything else such as a file that can't be read. The library never ends
+ * the process.
+ *
+ * Only the JagGD* functions below are exported from libjaggd.so.
+ *
+ * Uploads go through the same transfer settings and memory caches as jaggd,
+ * so it stays safe to mix the library with 'jaggd --delta' and --calibrate.
+ */
+
+/* Marks the library's API, the only symbols libjaggd.so exports */
+#if defined(__GNUC__)
+#define JAGGD_API __attribute__((visibility("default")))
+#else
+#define JAGGD_API
+#endif
+
+typedef struct JagGD JagGD;
+typedef struct JagGDOp JagGDOp;
+
+/* What a reset boots into */
+typedef enum {
+	JAGGD_BOOT_MENU,	/* The JagGD menu */
+	JAGGD_BOOT_DEBUG,	/* The debug stub */
+	JAGGD_BOOT_ROM,		/* The loaded ROM, through the Jaguar BIOS */
+} JagGDBoot;
+
+typedef enum {
+	JAGGD_PENDING,
+	JAGGD_DONE,
+	JAGGD_FAILED,
+} JagGDStatus;
+
+/*
+ * Called on the GameDrive's worker thread as data reaches the device, with
+ * the number of bytes sent so far out of the total for the operation.
+ */
+typedef void (*JagGDProgressFn)(void *data, uint64_t done, uint64_t total);
+
+/*
+ * Open the GameDrive at the given bus/port path, as given to 'jaggd -dev'
+ * and shown by 'lsusb -t' (e.g. "1-4.2"), or the first one found if devKey
+ * is NULL. Returns NULL if there is none.
+ */
+extern JAGGD_API JagGD *JagGDOpen(const char *devKey);
+
+/*
+ * Finish every operation already submitted, then close the GameDrive. Free
+ * its operations first.
+ */
+extern JAGGD_API void JagGDClose(JagGD *gd);
+
+/* The bus/port path of an open GameDrive */
+extern JAGGD_API const char *JagGDDeviceKey(const JagGD *gd);
+
+/*
+ * Submit operations. Each returns NULL if the operation couldn't be queued,
+ * otherwise an operation to pass to JagGDFreeOp() when done with it.
+ */
+extern JAGGD_API JagGDOp *JagGDReset(JagGD *gd, JagGDBoot boot);
+
+/*
+ * Upload a file in any format jaggd understands, which may be in a .gz or
+ * .zip archive. baseAddr moves it from where the file says it goes, and is
+ * ignored if 0. The file's entry point is started afterwards if exec is set.
+ */
+extern JAGGD_API JagGDOp *JagGDUploadFile(JagGD *gd,
+					  const char *fileName,
+					  uint32_t baseAddr,
+					  bool exec,
+					  JagGDProgressFn progress,
+					  void *progressData);
+
+/*
+ * Upload size bytes from data to addr, then start execAddr unless it is 0.
+ * data must stay valid until the operation completes.
+ */
+extern JAGGD_API JagGDOp *JagGDUploadData(JagGD *gd,
+					  const void *data,
+					  size_t size,
+					  uint32_t addr,
+					  uint32_t execAddr,
+					  JagGDProgressFn progress,
+					  void *progressData);
+
+/* Start the code at addr */
+extern JAGGD_API JagGDOp *JagGDExec(JagGD *gd, uint32_t addr);
+
+/*
+ * Copy a local file to the SD card, under the same name without its path.
+ * As with 'jaggd -wf', the file in a .gz or .zip archive is copied instead.
+ */
+extern JAGGD_API JagGDOp *JagGDWriteFile(JagGD *gd,
+					 const char *fileName,
+					 JagGDProgressFn progress,
+					 void *progressData);
+
+/*
+ * Back the EEPROM with sdName on the SD card. type is 0 for 128B, 1 for
+ * 256B/512B and 2 for 1KB/2KB.
+ */
+extern JAGGD_API JagGDOp *JagGDSetEeprom(JagGD *gd, const char *sdName,
+					 uint8_t type);
+
+/* Check on an operation without blocking */
+extern JAGGD_API JagGDStatus JagGDPoll(JagGDOp *op);
+
+/* Block until an operation completes, then return how it went */
+extern JAGGD_API JagGDStatus JagGDWait(JagGDOp *op);
+
+/* Wait for an operation to complete if it hasn't, then free it */
+extern JAGGD_API void JagGDFreeOp(JagGDOp *op);
+
+#endif /* LIBJAGGD_H_ */
@@ -20,19 +20,64 @@ static void usage(void)
 	printf("-r         Reboot\n");
 	printf("-rd        Reboot to debug stub\n");
 	printf("-rr        Reboot and keep current ROM\n");
-	printf("-wf file   Write file to SD card\n\n");
+	printf("-wf file   Write file to SD card\n");
+	printf("--resume   Skip -wf if an earlier -wf or -sync finished "
+	       "writing the same\n");
+	printf("           file to the SD card\n");
+	printf("-sync dir  Write the files in dir to the SD card, skipping "
+	       "those already\n");
+	printf("           written unchanged by an earlier -sync\n");
+	printf("-q depth   Keep up to depth USB transfers in flight "
+	       "(default 4 or as\n");
+	printf("           calibrated, max 32)\n");
+	printf("--calibrate\n");
+	printf("           Find the fastest USB transfer size and queue depth "
+	       "for this\n");
+	printf("           GameDrive and use them from now on. Overwrites 2MB "
+	       "of cartridge\n");
+	printf("           space\n\n");
 
 	printf("From stub mode (all ROM, RAM > $2000) --\n");
 	printf("-u[x[r]] file[,a:addr,s:size,o:offset,x:entry]\n");
 	printf("           Upload to address with size and file offset and "
 	       "optionally execute\n");
-	printf("           directly or via reboot\n");
+	printf("           directly or via reboot. With file '-', stream "
+	       "s:size bytes from\n");
+	printf("           stdin to a:addr as they arrive\n");
+	printf("-uz file[,a:addr,s:size,o:offset,x:entry]\n");
+	printf("           Upload compressed with a 68k unpacker and "
+	       "execute. Falls back to\n");
+	printf("           a plain upload when that wouldn't be faster\n");
 	printf("-e file[,size]\n");
 	printf("           Enable EEPROM file on memory card with given size "
 	       "in bytes (default 128)\n");
+	printf("--delta    Upload only the blocks that changed since the last "
+	       "--delta upload\n");
+	printf("           to the same address on this GameDrive\n");
+	printf("--sparse   Skip runs of 64KB or more of $00 or $FF padding. "
+	       "Memory there\n");
+	printf("           keeps whatever it held before\n");
 	printf("-x addr    Execute from address\n");
 	printf("-xr        Execute via reboot\n\n");
 
+	printf("-dev list  Use the GameDrives at the given comma-separated "
+	       "bus/port paths\n");
+	printf("           (e.g. 1-4.2), or 'all' of them, rather than the "
+	       "first one found\n");
+	printf("-b file    Run the commands on each line of file in turn, "
+	       "or from stdin if\n");
+	printf("           file is '-'\n");
+	printf("--watch    Repeat the commands whenever the uploaded or written "
+	       "file changes,\n");
+	printf("           until interrupted\n");
+	printf("--daemon   Keep the GameDrive open and run commands sent by "
+	       "other jaggd\n");
+	printf("           invocations until interrupted\n");
+	printf("--trace file\n");
+	printf("           Record how long each step and USB transfer takes "
+	       "to file, in\n");
+	printf("           Chrome trace event format\n\n");
+
 	printf("Prefix numbers with '$' or '0x' for hex, otherwise decimal is "
 	       "assumed.\n");
 }
@@ -63,19 +108,43 @@ static bool ParseNumber(const char *str, uint32_t *num)
 	}
 }
 
-static bool ParseFile(char *opt,
+/* Copy an argument so it can be tokenized without modifying argv */
+static char *CopyArg(const char *arg)
+{
+	char *copy = malloc(strlen(arg) + 1);
+
+	if (!copy) {
+		fprintf(stderr, "Failed to allocate %zu bytes for argument\n",
+			strlen(arg) + 1);
+		return NULL;
+	}
+
+	strcpy(copy, arg);
+
+	return copy;
+}
+
+static bool ParseFile(const char *arg,
 		      char **oFileName,
 		      uint32_t *oBase,
 		      uint32_t *oSize,
 		      uint32_t *oOffset,
 		      uint32_t *oExec)
 {
-	char *tok = strtok(opt, ",");
+	char *opt = CopyArg(arg);
+	char *tok;
 	size_t nameLen;
+	bool success = false;
+
+	if (!opt) {
+		return false;
+	}
+
+	tok = strtok(opt, ",");
 
 	if (!tok) {
 		usage();
-		return false;
+		goto cleanup;
 	}
 
 	nameLen = strlen(tok) + 1;
@@ -85,7 +154,7 @@ static bool ParseFile(char *opt,
 	if (!*oFileName) {
 		fprintf(stderr, "Failed to allocate %zd bytes for file name\n",
 			nameLen);
-		return false;
+		goto cleanup;
 	}
 
 	strcpy(*oFileName, tok);
@@ -105,33 +174,90 @@ static bool ParseFile(char *opt,
 
 		if (!subOptGood) {
 			free(*oFileName); *oFileName = NULL;
-			return false;
+			goto cleanup;
 		}
 	}
 
-	return true;
+	success = true;
+
+cleanup:
+	free(opt);
+	return success;
 }
 
-bool ParseOptions(int argc, char *argv[],
-		  bool *oReset,
-		  bool *oDebug,
-		  bool *oBoot,
-		  bool *oBootRom,
-		  char **oFileName,
-		  uint32_t *oBase,
-		  uint32_t *oSize,
-		  uint32_t *oOffset,
-		  uint32_t *oExec,
-		  char **oEepromName,
-		  uint8_t *oEepromType,
-		  char **oWriteFileName)
+static bool ParseEeprom(const char *arg, char **oEepromName,
+			uint8_t *oEepromType)
+{
+	char *opt = CopyArg(arg);
+	char *tok;
+	bool success = false;
+
+	if (!opt) {
+		return false;
+	}
+
+	tok = strtok(opt, ",");
+
+	if (!tok) {
+		goto cleanup;
+	}
+
+	if (!(*oEepromName = CopyArg(tok))) {
+		goto cleanup;
+	}
+
+	tok = strtok(NULL, ",");
+
+	if (tok) {
+		uint32_t eepromSize;
+
+		if (!ParseNumber(tok, &eepromSize)) {
+			goto cleanup;
+		}
+
+		switch (eepromSize) {
+		case 128:
+			*oEepromType = 0;
+			break;
+		case 256:
+		case 512:
+			*oEepromType = 1;
+			break;
+		case 1024:
+		case 2048:
+			*oEepromType = 2;
+			break;
+		default:
+			goto cleanup;
+		}
+	}
+
+	success = true;
+
+cleanup:
+	if (!success) {
+		free(*oEepromName); *oEepromName = NULL;
+	}
+
+	free(opt);
+	return success;
+}
+
+bool ParseOptions(int argc, char *argv[], Options *opts)
 {
 	char *outName = NULL;
 	char *outEeprom = NULL;
 	char *outWriteFileName = NULL;
+	char *outSyncDir = NULL;
+	char *outBatchName = NULL;
+	char *outDevices = NULL;
+	char *outTraceName = NULL;
 	int i;
 	bool success = true;
 
+	memset(opts, 0, sizeof(*opts));
+	opts->offset = 0xffffffffu;
+
 	for (i = 1; i < argc; i++) {
 		size_t optLen = strlen(argv[i]);
 
@@ -144,9 +270,9 @@ bool ParseOptions(int argc, char *argv[],
 				}
 
 				if (argv[i][2] == 'd') {
-					*oDebug = true;
+					opts->debug = true;
 				} else if (argv[i][2] == 'r') {
-					*oBootRom = true;
+					opts->bootRom = true;
 				} else {
 					usage();
 					success = false;
@@ -154,12 +280,12 @@ bool ParseOptions(int argc, char *argv[],
 				}
 			}
 
-			*oReset = true;
+			opts->reset = true;
 		} else if (!strncmp(argv[i], "-u", 2)) {
 			switch (optLen) {
 			case 4:
 				if (argv[i][3] == 'r') {
-					*oBootRom = true;
+					opts->bootRom = true;
 				} else {
 					success = false;
 					break;
@@ -167,7 +293,11 @@ bool ParseOptions(int argc, char *argv[],
 				// Fall through
 			case 3:
 				if (argv[i][2] == 'x') {
-					*oBoot = true;
+					opts->boot = true;
+				} else if ((optLen == 3) &&
+					   (argv[i][2] == 'z')) {
+					opts->pack = true;
+					opts->boot = true;
 				} else {
 					success = false;
 					break;
@@ -188,7 +318,8 @@ bool ParseOptions(int argc, char *argv[],
 			}
 
 			if (!ParseFile(argv[i], &outName,
-				       oBase, oSize, oOffset, oExec)) {
+				       &opts->base, &opts->size,
+				       &opts->offset, &opts->exec)) {
 				usage();
 				success = false;
 				break;
@@ -200,106 +331,119 @@ bool ParseOptions(int argc, char *argv[],
 				break;
 			}
 
-			if (!ParseNumber(argv[i], oExec)) {
+			if (!ParseNumber(argv[i], &opts->exec)) {
 				usage();
 				success = false;
 				break;
 			}
 
-			*oBoot = true;
+			opts->boot = true;
 		} else if (!strcmp(argv[i], "-xr")) {
-			*oBoot = true;
-			*oBootRom = true;
+			opts->boot = true;
+			opts->bootRom = true;
 		} else if (!strcmp(argv[i], "-e")) {
-			char *tok;
-			size_t nameLen;
-
 			if (++i >= argc) {
 				usage();
 				success = false;
 				break;
 			}
 
-			tok = strtok(argv[i], ",");
-
-			if (!tok) {
+			free(outEeprom);
+			if (!ParseEeprom(argv[i], &outEeprom,
+					 &opts->eepromType)) {
 				usage();
 				success = false;
 				break;
 			}
-
-			nameLen = strlen(tok) + 1;
-
-			if (nameLen == 0) {
+		} else if (!strcmp(argv[i], "-wf")) {
+			if (++i >= argc) {
 				usage();
 				success = false;
 				break;
 			}
 
-			outEeprom = malloc(nameLen);
-
-			if (!outEeprom) {
-				fprintf(stderr, "Failed to allocate %zu bytes for EEPROM name\n",
-					nameLen);
+			free(outWriteFileName);
+			if (!(outWriteFileName = CopyArg(argv[i]))) {
+				success = false;
+				break;
+			}
+		} else if (!strcmp(argv[i], "-sync")) {
+			if (++i >= argc) {
+				usage();
 				success = false;
 				break;
 			}
 
-			strcpy(outEeprom, tok);
-
-			tok = strtok(NULL, ",");
-
-			if (tok) {
-				uint32_t eepromSize;
-				if (!ParseNumber(tok, &eepromSize)) {
-					usage();
-					success = false;
-					break;
-				}
-				switch (eepromSize) {
-				case 128:
-					*oEepromType = 0;
-					break;
-				case 256:
-				case 512:
-					*oEepromType = 1;
-					break;
-				case 1024:
-				case 2048:
-					*oEepromType = 2;
-					break;
-				default:
-					success = false;
-					break;
+			free(outSyncDir);
+			if (!(outSyncDir = CopyArg(argv[i]))) {
+				success = false;
+				break;
+			}
+		} else if (!strcmp(argv[i], "-q")) {
+			uint32_t depth;
 
-				}
+			if (++i >= argc) {
+				usage();
+				success = false;
+				break;
+			}
 
-				if (!success) {
-					usage();
-					break;
-				}
+			if (!ParseNumber(argv[i], &depth) ||
+			    (depth < 1) || (depth > 32)) {
+				usage();
+				success = false;
+				break;
 			}
-		} else if (!strcmp(argv[i], "-wf")) {
-			size_t nameLen;
 
+			opts->queueDepth = depth;
+		} else if (!strcmp(argv[i], "--calibrate")) {
+			opts->calibrate = true;
+		} else if (!strcmp(argv[i], "--delta")) {
+			opts->delta = true;
+		} else if (!strcmp(argv[i], "--sparse")) {
+			opts->sparse = true;
+		} else if (!strcmp(argv[i], "--resume")) {
+			opts->resume = true;
+		} else if (!strcmp(argv[i], "--daemon")) {
+			opts->daemon = true;
+		} else if (!strcmp(argv[i], "--watch")) {
+			opts->watch = true;
+		} else if (!strcmp(argv[i], "-dev")) {
 			if (++i >= argc) {
 				usage();
 				success = false;
 				break;
 			}
 
-			nameLen = strlen(argv[i]);
-
-			outWriteFileName = malloc(nameLen);
+			free(outDevices);
+			if (!(outDevices = CopyArg(argv[i]))) {
+				success = false;
+				break;
+			}
+		} else if (!strcmp(argv[i], "-b")) {
+			if (++i >= argc) {
+				usage();
+				success = false;
+				break;
+			}
 
-			if (!outWriteFileName) {
-				fprintf(stderr, "Failed to allocate %zu bytes for write file name\n",
-					nameLen);
+			free(outBatchName);
+			if (!(outBatchName = CopyArg(argv[i]))) {
+				success = false;
+				break;
+			}
+		} else if (!strcmp(argv[i], "--trace")) {
+			if (++i >= argc) {
+				usage();
 				success = false;
 				break;
 			}
 
-			strcpy(outWriteFileName, argv[i]);
+			free(outTraceName);
+			if (!(outTraceName = CopyArg(argv[i]))) {
+				success = false;
+				break;
+			}
 		} else {
 			usage();
 			success = false;
@@ -308,20 +452,150 @@ bool ParseOptions(int argc, char *argv[],
 	}
 
 	/* The user didn't ask us to do anything. Complain. */
-	if (!*oReset && !outName && !*oBoot && !outEeprom && !outWriteFileName) {
+	if (!opts->reset && !outName && !opts->boot && !outEeprom &&
+	    !outWriteFileName && !outSyncDir && !opts->calibrate &&
+	    !opts->daemon && !outBatchName) {
+		usage();
+		success = false;
+	}
+
+	/* A batch brings its own commands */
+	if (success && outBatchName &&
+	    (opts->reset || outName || opts->boot || outEeprom ||
+	     outWriteFileName || outSyncDir || opts->calibrate ||
+	     opts->daemon || opts->watch)) {
+		usage();
+		success = false;
+	}
+
+	/* There must be a file to watch */
+	if (success && opts->watch &&
+	    ((!outName && !outWriteFileName) || opts->daemon)) {
+		usage();
+		success = false;
+	}
+
+	/* Only -wf has anything to resume. -sync always picks up. */
+	if (success && opts->resume && !outWriteFileName) {
 		usage();
 		success = false;
 	}
 
+	/* A stream can only be read once, and doesn't say where it goes */
+	if (success && outName && !strcmp(outName, "-") &&
+	    (!opts->base || !opts->size || (opts->offset != 0xffffffffu) ||
+	     opts->pack || opts->delta || opts->sparse || opts->watch)) {
+		fprintf(stderr, "-u - needs a:addr and s:size, and can't be "
+			"used with o:, -uz,\n--delta, --sparse or --watch\n");
+		success = false;
+	}
+
 	if (!success) {
 		free(outName); outName = NULL;
 		free(outEeprom); outEeprom = NULL;
 		free(outWriteFileName); outWriteFileName = NULL;
+		free(outSyncDir); outSyncDir = NULL;
+		free(outBatchName); outBatchName = NULL;
+		free(outDevices); outDevices = NULL;
+		free(outTraceName); outTraceName = NULL;
 		return false;
 	}
 
-	*oFileName = outName;
-	*oEepromName = outEeprom;
-	*oWriteFileName = outWriteFileName;
+	opts->fileName = outName;
+	opts->eepromName = outEeprom;
+	opts->writeFileName = outWriteFileName;
+	opts->syncDir = outSyncDir;
+	opts->batchName = outBatchName;
+	opts->devices = outDevices;
+	opts->traceName = outTraceName;
 	return true;
 }
+
+#define MAX_LINE_ARGS 64
+
+/*
+ * Parse a line of a batch file. The line is split into arguments at spaces
+ * and tabs, except within single or double quotes, and a '#' at the start
+ * of an argument begins a comment.
+ */
+bool ParseLine(const char *line, Options *opts)
+{
+	char *args[MAX_LINE_ARGS + 1];
+	char *copy = CopyArg(line);
+	char *in, *out;
+	int argc = 0;
+	bool success = false;
+
+	memset(opts, 0, sizeof(*opts));
+
+	if (!copy) {
+		return false;
+	}
+
+	/* ParseOptions() skips the program name */
+	args[argc++] = "jaggd";
+
+	in = out = copy;
+
+	while (true) {
+		char quote = '\0';
+
+		while ((*in == ' ') || (*in == '\t') ||
+		       (*in == '\r') || (*in == '\n')) {
+			in++;
+		}
+
+		if ((*in == '\0') || (*in == '#')) {
+			break;
+		}
+
+		if (argc >= MAX_LINE_ARGS) {
+			fprintf(stderr, "Too many arguments on one line\n");
+			goto cleanup;
+		}
+
+		/* Unquote in place. The result is never longer. */
+		args[argc++] = out;
+
+		for (; *in != '\0'; in++) {
+			if (quote) {
+				if (*in == quote) quote = '\0';
+				else *out++ = *in;
+			} else if ((*in == '\'') || (*in == '"')) {
+				quote = *in;
+			} else if ((*in == ' ') || (*in == '\t') ||
+				   (*in == '\r') || (*in == '\n')) {
+				break;
+			} else {
+				*out++ = *in;
+			}
+		}
+
+		if (quote) {
+			fprintf(stderr, "Unterminated quote\n");
+			goto cleanup;
+		}
+
+		if (*in != '\0') in++;
+		*out++ = '\0';
+	}
+
+	args[argc] = NULL;
+
+	success = ParseOptions(argc, args, opts);
+
+cleanup:
+	free(copy);
+	return success;
+}
+
+void FreeOptions(Options *opts)
+{
+	free(opts->traceName); opts->traceName = NULL;
+	free(opts->devices); opts->devices = NULL;
+	free(opts->batchName); opts->batchName = NULL;
+	free(opts->syncDir); opts->syncDir = NULL;
+	free(opts->writeFileName); opts->writeFileName = NULL;
+	free(opts->eepromName); opts->eepromName = NULL;
+	free(opts->fileName); opts->fileName = NULL;
+}
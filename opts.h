@@ -10,17 +10,55 @@
 #include <stdbool.h>
 #include <stdint.h>
 
-extern bool ParseOptions(int argc, char *argv[],
-			 bool *oReset,
-			 bool *oDebug,
-			 bool *oBoot,
-			 bool *oBootRom,
-			 char **oFileName,
-			 uint32_t *oBase,
-			 uint32_t *oSize,
-			 uint32_t *oOffset,
-			 uint32_t *oExec,
-			 char **oEepromName,
-			 uint8_t *oEepromType,
-			 char **oWriteFileName);
+typedef struct {
+	bool reset;
+	bool debug;
+	bool boot;
+	bool bootRom;
+
+	/* -u file and its sub-options */
+	char *fileName;
+	uint32_t base;
+	uint32_t size;
+	uint32_t offset; /* 0xffffffff if not specified */
+	uint32_t exec;
+	bool pack;
+	bool delta;
+	bool sparse;
+
+	char *eepromName;
+	uint8_t eepromType;
+
+	char *writeFileName;
+	bool resume;
+
+	/* -sync directory */
+	char *syncDir;
+
+	unsigned int queueDepth; /* 0 for the default */
+	bool calibrate;
+	bool daemon;
+	bool watch;
+
+	/* -b file, or "-" for stdin */
+	char *batchName;
+
+	/* -dev: "all", or comma-separated bus/port paths. NULL for the first. */
+	char *devices;
+
+	/* --trace output file */
+	char *traceName;
+
+	/*
+	 * Not set by any option: read files into memory rather than mapping
+	 * them. The daemon must, as a client's file shrinking under a mapping
+	 * would kill it with SIGBUS.
+	 */
+	bool copyFiles;
+} Options;
+
+extern bool ParseOptions(int argc, char *argv[], Options *opts);
+extern bool ParseLine(const char *line, Options *opts);
+extern void FreeOptions(Options *opts);
+
 #endif /* OPTS_H_ */
@@ -0,0 +1,414 @@
+/*
+ * SPDX-License-Identifier: CC0-1.0
+ *
+ * Author: James Jones
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "pack.h"
+
+/*
+ * Compressed stream format. A stream is a sequence of tokens, each starting
+ * with a control byte c:
+ *
+ *   c < 0x80:  Literal run. The next c + 1 bytes are copied to the output.
+ *   c >= 0x80: Match. Copy (c & 0x7f) + 3 bytes starting from the 16-bit
+ *              big-endian distance that follows back in the output.
+ *
+ * The stream ends when its input is exhausted. This is deliberately simple
+ * so the 68k side stays small and has no tables to set up.
+ */
+#define MIN_MATCH 3
+#define MAX_MATCH (0x7f + MIN_MATCH)
+#define MAX_LITERALS 0x80
+#define MAX_DISTANCE 0xffff
+
+#define WINDOW_SIZE 0x10000
+#define HASH_BITS 15
+#define HASH_SIZE (1 << HASH_BITS)
+
+/* How many earlier occurrences of a 3-byte prefix to try per position */
+#define MAX_CHAIN 32
+
+/*
+ * 68000 unpacker. Assembled by hand from:
+ *
+ * 00  45fa 003e        lea     params(pc),a2
+ * 04  225a             movea.l (a2)+,a1        ; destination
+ * 06  265a             movea.l (a2)+,a3        ; entry point
+ * 08  201a             move.l  (a2)+,d0        ; packed length
+ * 0a  204a             movea.l a2,a0           ; packed data
+ * 0c  49f0 0800        lea     0(a0,d0.l),a4   ; end of packed data
+ * 10  b1cc     loop:   cmpa.l  a4,a0
+ * 12  6428             bcc.s   done
+ * 14  7200             moveq   #0,d1
+ * 16  1218             move.b  (a0)+,d1
+ * 18  6b08             bmi.s   match
+ * 1a  12d8     lit:    move.b  (a0)+,(a1)+
+ * 1c  51c9 fffc        dbra    d1,lit
+ * 20  60ee             bra.s   loop
+ * 22  0201 007f match: andi.b  #$7f,d1
+ * 26  5441             addq.w  #2,d1           ; length - 1
+ * 28  7400             moveq   #0,d2
+ * 2a  1418             move.b  (a0)+,d2
+ * 2c  e14a             lsl.w   #8,d2
+ * 2e  1418             move.b  (a0)+,d2
+ * 30  2a49             movea.l a1,a5
+ * 32  9bc2             suba.l  d2,a5
+ * 34  12dd     copy:   move.b  (a5)+,(a1)+
+ * 36  51c9 fffc        dbra    d1,copy
+ * 3a  60d4             bra.s   loop
+ * 3c  4ed3     done:   jmp     (a3)
+ * 3e  4e71             nop
+ * 40           params: dc.l    dst, entry, length
+ * 4c           packed data follows
+ */
+static const uint8_t UNPACK_STUB[] = {
+	0x45, 0xfa, 0x00, 0x3e, 0x22, 0x5a, 0x26, 0x5a,
+	0x20, 0x1a, 0x20, 0x4a, 0x49, 0xf0, 0x08, 0x00,
+	0xb1, 0xcc, 0x64, 0x28, 0x72, 0x00, 0x12, 0x18,
+	0x6b, 0x08, 0x12, 0xd8, 0x51, 0xc9, 0xff, 0xfc,
+	0x60, 0xee, 0x02, 0x01, 0x00, 0x7f, 0x54, 0x41,
+	0x74, 0x00, 0x14, 0x18, 0xe1, 0x4a, 0x14, 0x18,
+	0x2a, 0x49, 0x9b, 0xc2, 0x12, 0xdd, 0x51, 0xc9,
+	0xff, 0xfc, 0x60, 0xd4, 0x4e, 0xd3, 0x4e, 0x71,
+};
+
+#define STUB_OFF_DST 0x40
+#define STUB_OFF_ENTRY 0x44
+#define STUB_OFF_LENGTH 0x48
+#define STUB_HEADER_SIZE 0x4c
+
+/*
+ * Where packed images may be placed: the stub-accessible RAM above $2000,
+ * skipping the first 8KiB after it and the top 64KiB of RAM, where the
+ * GameDrive stub and the stack are likely to live.
+ */
+#define PACK_RAM_LOW 0x4000U
+#define PACK_RAM_HIGH 0x1f0000U
+
+/* End of the 2MB of RAM. The unpacker can't write anything above it. */
+#define JAG_RAM_END 0x200000U
+
+/*
+ * Estimates used to decide whether packing pays off. The unpacker costs
+ * roughly 22 68000 cycles per output byte at 13.3MHz. The link rate is a
+ * conservative guess at what the GameDrive sustains through its stub.
+ */
+#define EST_UNPACK_RATE (600U * 1024U)
+#define EST_LINK_RATE (384U * 1024U)
+
+/* Below this, the packed upload can't save enough to be worth it */
+#define MIN_PACK_SIZE (64 * 1024)
+
+static inline void write32BE(uint8_t *ptr, uint32_t val)
+{
+	ptr[0] = (val >> 24) & 0xff;
+	ptr[1] = (val >> 16) & 0xff;
+	ptr[2] = (val >>  8) & 0xff;
+	ptr[3] = (val      ) & 0xff;
+}
+
+static inline uint32_t Hash3(const uint8_t *p)
+{
+	uint32_t v = (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+
+	return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+static void FlushLiterals(const uint8_t *lit, size_t numLit,
+			  uint8_t *dst, size_t *dstPos)
+{
+	while (numLit > 0) {
+		size_t run = (numLit > MAX_LITERALS) ? MAX_LITERALS : numLit;
+
+		dst[(*dstPos)++] = run - 1;
+		memcpy(&dst[*dstPos], lit, run);
+		*dstPos += run;
+		lit += run;
+		numLit -= run;
+	}
+}
+
+/*
+ * Greedy LZ77 with hash chains. Returns a malloc()ed buffer in *oDst.
+ */
+bool Compress(const uint8_t *src, size_t srcLen,
+	      uint8_t **oDst, size_t *oDstLen)
+{
+	int32_t *head = malloc(HASH_SIZE * sizeof(*head));
+	int32_t *prev = malloc(WINDOW_SIZE * sizeof(*prev));
+	/*
+	 * Worst case: a match never takes more bytes than it covers, but
+	 * each one can split the literals around it into another run, and
+	 * every run of literals costs a control byte.
+	 */
+	uint8_t *dst = malloc(srcLen + (srcLen / MIN_MATCH) +
+			      (srcLen / MAX_LITERALS) + 1);
+	size_t dstPos = 0;
+	size_t litStart = 0;
+	size_t pos = 0;
+	size_t i;
+
+	if (!head || !prev || !dst) {
+		fprintf(stderr, "Failed to alloc compression buffers\n");
+		free(head);
+		free(prev);
+		free(dst);
+		return false;
+	}
+
+	for (i = 0; i < HASH_SIZE; i++) {
+		head[i] = -1;
+	}
+
+	while (pos < srcLen) {
+		size_t bestLen = 0;
+		size_t bestDist = 0;
+
+		if ((srcLen - pos) >= MIN_MATCH) {
+			uint32_t h = Hash3(&src[pos]);
+			int32_t cand = head[h];
+			size_t maxLen = srcLen - pos;
+			unsigned int chain;
+
+			if (maxLen > MAX_MATCH) maxLen = MAX_MATCH;
+
+			for (chain = 0; (chain < MAX_CHAIN) && (cand >= 0) &&
+			     ((pos - cand) <= MAX_DISTANCE); chain++) {
+				size_t len = 0;
+
+				while ((len < maxLen) &&
+				       (src[cand + len] == src[pos + len])) {
+					len++;
+				}
+
+				if (len > bestLen) {
+					bestLen = len;
+					bestDist = pos - cand;
+					if (len == maxLen) break;
+				}
+
+				cand = prev[cand % WINDOW_SIZE];
+			}
+		}
+
+		if (bestLen < MIN_MATCH) {
+			bestLen = 1;
+		} else {
+			FlushLiterals(&src[litStart], pos - litStart,
+				      dst, &dstPos);
+			dst[dstPos++] = 0x80 | (bestLen - MIN_MATCH);
+			dst[dstPos++] = (bestDist >> 8) & 0xff;
+			dst[dstPos++] = bestDist & 0xff;
+		}
+
+		/* Insert every position covered into the hash chains */
+		for (i = 0; i < bestLen; i++, pos++) {
+			if ((srcLen - pos) >= MIN_MATCH) {
+				uint32_t h = Hash3(&src[pos]);
+
+				prev[pos % WINDOW_SIZE] = head[h];
+				head[h] = pos;
+			}
+		}
+
+		if (bestLen >= MIN_MATCH) {
+			litStart = pos;
+		}
+	}
+
+	FlushLiterals(&src[litStart], pos - litStart, dst, &dstPos);
+
+	free(head);
+	free(prev);
+
+	*oDst = dst;
+	*oDstLen = dstPos;
+
+	return true;
+}
+
+/*
+ * Reference implementation of the 68k unpacker. Unlike the stub it checks
+ * every access, and it fails unless the output comes to exactly dstLen.
+ */
+bool Decompress(const uint8_t *src, size_t srcLen,
+		uint8_t *dst, size_t dstLen)
+{
+	size_t srcPos = 0;
+	size_t dstPos = 0;
+
+	while (srcPos < srcLen) {
+		uint8_t c = src[srcPos++];
+
+		if (c < 0x80) {
+			size_t run = (size_t)c + 1;
+
+			if (((srcLen - srcPos) < run) ||
+			    ((dstLen - dstPos) < run)) {
+				return false;
+			}
+
+			memcpy(&dst[dstPos], &src[srcPos], run);
+			srcPos += run;
+			dstPos += run;
+		} else {
+			size_t len = (size_t)(c & 0x7f) + MIN_MATCH;
+			size_t dist;
+
+			if ((srcLen - srcPos) < 2) {
+				return false;
+			}
+
+			dist = (size_t)src[srcPos] << 8 | src[srcPos + 1];
+			srcPos += 2;
+
+			if ((dist == 0) || (dist > dstPos) ||
+			    ((dstLen - dstPos) < len)) {
+				return false;
+			}
+
+			/* Byte at a time: matches may overlap their output */
+			while (len--) {
+				dst[dstPos] = dst[dstPos - dist];
+				dstPos++;
+			}
+		}
+	}
+
+	return dstPos == dstLen;
+}
+
+static bool Overlaps(uint32_t aStart, size_t aSize,
+		     uint32_t bStart, size_t bSize)
+{
+	return ((uint64_t)aStart < ((uint64_t)bStart + bSize)) &&
+		((uint64_t)bStart < ((uint64_t)aStart + aSize));
+}
+
+/* Find somewhere in RAM for the blob that the unpacked data won't touch */
+static bool PlaceBlob(size_t blobSize, uint32_t baseAddr, size_t size,
+		      uint32_t *oAddr)
+{
+	const uint32_t candidates[] = {
+		PACK_RAM_LOW,
+		(uint32_t)((baseAddr + size + 3) & ~3U),
+	};
+	unsigned int i;
+
+	for (i = 0; i < sizeof(candidates) / sizeof(candidates[0]); i++) {
+		uint32_t addr = candidates[i];
+
+		if ((addr < PACK_RAM_LOW) ||
+		    (((uint64_t)addr + blobSize) > PACK_RAM_HIGH) ||
+		    Overlaps(addr, blobSize, baseAddr, size)) {
+			continue;
+		}
+
+		*oAddr = addr;
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * Build a self-unpacking image for data, to be unpacked to baseAddr and
+ * started at execAddr. Returns false, saying why, if packing isn't possible
+ * or isn't expected to be faster than a plain upload.
+ */
+bool PackImage(const uint8_t *data, size_t size,
+	       uint32_t baseAddr, uint32_t execAddr,
+	       PackedImage *oImage)
+{
+	uint8_t *packed = NULL;
+	uint8_t *check = NULL;
+	size_t packedLen;
+	size_t blobSize;
+	double plainTime, packedTime;
+	bool success = false;
+
+	memset(oImage, 0, sizeof(*oImage));
+
+	if (size < MIN_PACK_SIZE) {
+		printf("Not packing: only %zu bytes\n", size);
+		return false;
+	}
+
+	if (((uint64_t)baseAddr + size) > JAG_RAM_END) {
+		printf("Not packing: $%" PRIx32 " isn't RAM the 68000 can "
+		       "unpack to\n", baseAddr);
+		return false;
+	}
+
+	if (!Compress(data, size, &packed, &packedLen)) {
+		return false;
+	}
+
+	blobSize = STUB_HEADER_SIZE + packedLen;
+
+	plainTime = (double)size / EST_LINK_RATE;
+	packedTime = (double)blobSize / EST_LINK_RATE +
+		(double)size / EST_UNPACK_RATE;
+
+	if (packedTime >= plainTime) {
+		printf("Not packing: %zu -> %zu bytes wouldn't be faster to "
+		       "send and unpack\n", size, packedLen);
+		goto cleanup;
+	}
+
+	if (!PlaceBlob(blobSize, baseAddr, size, &oImage->addr)) {
+		printf("Not packing: no room in RAM for %zu byte packed "
+		       "image\n", blobSize);
+		goto cleanup;
+	}
+
+	/* Make sure the unpacker will reproduce the data exactly */
+	if (!(check = malloc(size))) {
+		fprintf(stderr, "Failed to alloc %zu bytes to verify packed "
+			"data\n", size);
+		goto cleanup;
+	}
+
+	if (!Decompress(packed, packedLen, check, size) ||
+	    memcmp(check, data, size)) {
+		fprintf(stderr, "Packed data failed to verify\n");
+		goto cleanup;
+	}
+
+	if (!(oImage->blob = malloc(blobSize))) {
+		fprintf(stderr, "Failed to alloc %zu bytes for packed image\n",
+			blobSize);
+		goto cleanup;
+	}
+
+	memcpy(oImage->blob, UNPACK_STUB, sizeof(UNPACK_STUB));
+	write32BE(&oImage->blob[STUB_OFF_DST], baseAddr);
+	write32BE(&oImage->blob[STUB_OFF_ENTRY], execAddr);
+	write32BE(&oImage->blob[STUB_OFF_LENGTH], packedLen);
+	memcpy(&oImage->blob[STUB_HEADER_SIZE], packed, packedLen);
+	oImage->size = blobSize;
+
+	success = true;
+
+cleanup:
+	free(check);
+	free(packed);
+
+	if (!success) {
+		FreePackedImage(oImage);
+	}
+
+	return success;
+}
+
+void FreePackedImage(PackedImage *image)
+{
+	free(image->blob); image->blob = NULL;
+	image->size = 0;
+}
@@ -0,0 +1,38 @@
+/*
+ * SPDX-License-Identifier: CC0-1.0
+ *
+ * Author: James Jones
+ */
+
+#ifndef PACK_H_
+#define PACK_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A packed image is a small 68k unpacker followed by its parameters and an
+ * LZ-compressed copy of the payload. It is uploaded to Jaguar RAM and
+ * executed; it unpacks the payload to its destination and jumps to the
+ * payload's entry point.
+ */
+typedef struct {
+	uint8_t *blob;
+	size_t size;
+
+	/* Where the blob must be uploaded to, and executed from */
+	uint32_t addr;
+} PackedImage;
+
+extern bool PackImage(const uint8_t *data, size_t size,
+		      uint32_t baseAddr, uint32_t execAddr,
+		      PackedImage *oImage);
+extern void FreePackedImage(PackedImage *image);
+
+extern bool Compress(const uint8_t *src, size_t srcLen,
+		     uint8_t **oDst, size_t *oDstLen);
+extern bool Decompress(const uint8_t *src, size_t srcLen,
+		       uint8_t *dst, size_t dstLen);
+
+#endif /* PACK_H_ */
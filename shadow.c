@@ -0,0 +1,322 @@
+/*
+ * SPDX-License-Identifier: CC0-1.0
+ *
+ * Author: James Jones
+ */
+
+/* Needed to get dirent and unlink() definitions with -std=c99 */
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "shadow.h"
+
+/* Granularity at which shadows are compared */
+#define DELTA_BLOCK_SIZE 4096
+
+/*
+ * Changed blocks closer together than this are sent as one range. Each
+ * range costs a control transfer and a queue drain, which is worth roughly
+ * this many bytes of bulk data.
+ */
+#define DELTA_MERGE_GAP (64 * 1024)
+
+static const char SHADOW_MAGIC[4] = { 'J', 'G', 'D', 'S' };
+
+typedef struct {
+	char magic[4];
+	uint32_t baseAddr;
+	uint32_t size;
+} ShadowHeader;
+
+static bool ShadowPath(char *path, size_t pathLen,
+		       const char *devKey, uint32_t baseAddr)
+{
+	return CachePath(path, pathLen, "shadow-%s-%06" PRIx32 ".bin",
+			 devKey, baseAddr);
+}
+
+static bool ReadHeader(FILE *fp, ShadowHeader *hdr)
+{
+	return (fread(hdr, sizeof(*hdr), 1, fp) == 1) &&
+		!memcmp(hdr->magic, SHADOW_MAGIC, sizeof(hdr->magic));
+}
+
+/*
+ * Returns a malloc()ed copy of the shadow for baseAddr, or NULL if there is
+ * none.
+ */
+uint8_t *LoadShadow(const char *devKey, uint32_t baseAddr, size_t *oSize)
+{
+	char path[4096];
+	ShadowHeader hdr;
+	uint8_t *data = NULL;
+	FILE *fp;
+
+	if (!ShadowPath(path, sizeof(path), devKey, baseAddr)) {
+		return NULL;
+	}
+
+	if (!(fp = fopen(path, "rb"))) {
+		return NULL;
+	}
+
+	if (!ReadHeader(fp, &hdr) || (hdr.baseAddr != baseAddr)) {
+		goto cleanup;
+	}
+
+	if (!(data = malloc(hdr.size ? hdr.size : 1))) {
+		goto cleanup;
+	}
+
+	if (fread(data, 1, hdr.size, fp) != hdr.size) {
+		free(data); data = NULL;
+		goto cleanup;
+	}
+
+	*oSize = hdr.size;
+
+cleanup:
+	fclose(fp);
+	return data;
+}
+
+/*
+ * Record that data now lives at baseAddr. Failing to save just means the
+ * next upload will be a full one, so errors are reported but not fatal.
+ */
+void SaveShadow(const char *devKey, uint32_t baseAddr,
+		const uint8_t *data, size_t size)
+{
+	char path[4096];
+	char tmpPath[4096 + 4];
+	ShadowHeader hdr;
+	FILE *fp;
+
+	/* Drop any other shadows this upload overwrote */
+	InvalidateShadows(devKey, baseAddr, baseAddr + size);
+
+	if (!ShadowPath(path, sizeof(path), devKey, baseAddr)) {
+		return;
+	}
+
+	snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+
+	if (!(fp = fopen(tmpPath, "wb"))) {
+		fprintf(stderr, "Failed to create '%s':\n  %s\n",
+			tmpPath, strerror(errno));
+		return;
+	}
+
+	memcpy(hdr.magic, SHADOW_MAGIC, sizeof(hdr.magic));
+	hdr.baseAddr = baseAddr;
+	hdr.size = size;
+
+	if ((fwrite(&hdr, sizeof(hdr), 1, fp) != 1) ||
+	    (fwrite(data, 1, size, fp) != size)) {
+		fprintf(stderr, "Failed to write '%s'\n", tmpPath);
+		fclose(fp);
+		unlink(tmpPath);
+		return;
+	}
+
+	if (fclose(fp) || rename(tmpPath, path)) {
+		fprintf(stderr, "Failed to save '%s':\n  %s\n",
+			path, strerror(errno));
+		unlink(tmpPath);
+	}
+}
+
+/*
+ * Forget every shadow for the device that overlaps [start, end), because
+ * something other than a delta upload may have changed that memory.
+ */
+void InvalidateShadows(const char *devKey, uint32_t start, uint32_t end)
+{
+	char dir[4096];
+	char prefix[256];
+	size_t prefixLen;
+	struct dirent *ent;
+	DIR *d;
+
+	if (!CacheDir(dir, sizeof(dir), false)) {
+		return;
+	}
+
+	if (!(d = opendir(dir))) {
+		return;
+	}
+
+	snprintf(prefix, sizeof(prefix), "shadow-%s-", devKey);
+	prefixLen = strlen(prefix);
+
+	while ((ent = readdir(d))) {
+		char path[4096 + 256];
+		ShadowHeader hdr;
+		bool overlaps = true;
+		FILE *fp;
+
+		if (strncmp(ent->d_name, prefix, prefixLen)) {
+			continue;
+		}
+
+		snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+
+		if ((fp = fopen(path, "rb"))) {
+			if (ReadHeader(fp, &hdr)) {
+				uint64_t hdrEnd = (uint64_t)hdr.baseAddr +
+					hdr.size;
+
+				overlaps = (hdr.baseAddr < end) &&
+					(hdrEnd > start);
+			}
+			fclose(fp);
+		}
+
+		if (overlaps) {
+			unlink(path);
+		}
+	}
+
+	closedir(d);
+}
+
+/*
+ * Add the block at off to a growing, sorted list of ranges to send, merging
+ * it into the last range if the gap between them is small enough.
+ */
+static bool AddBlock(DeltaRange **ranges, unsigned int *numRanges,
+		     size_t *maxRanges, size_t off, size_t len)
+{
+	DeltaRange *last = *numRanges ? &(*ranges)[*numRanges - 1] : NULL;
+
+	if (last && ((off - (last->offset + last->size)) < DELTA_MERGE_GAP)) {
+		last->size = off + len - last->offset;
+		return true;
+	}
+
+	if (*numRanges == *maxRanges) {
+		size_t newMax = *maxRanges ? *maxRanges * 2 : 16;
+		DeltaRange *newRanges = realloc(*ranges,
+						newMax * sizeof(**ranges));
+
+		if (!newRanges) {
+			fprintf(stderr, "Failed to alloc delta ranges\n");
+			free(*ranges); *ranges = NULL;
+			return false;
+		}
+
+		*ranges = newRanges;
+		*maxRanges = newMax;
+	}
+
+	(*ranges)[*numRanges].offset = off;
+	(*ranges)[*numRanges].size = len;
+	(*numRanges)++;
+
+	return true;
+}
+
+/*
+ * Compare new data against a shadow block by block and build the list of
+ * ranges, relative to the start of data, that must be re-sent. Anything
+ * beyond the end of the shadow counts as changed. An empty list means
+ * nothing changed.
+ */
+bool ComputeDelta(const uint8_t *shadow, size_t shadowSize,
+		  const uint8_t *data, size_t size,
+		  DeltaRange **oRanges, unsigned int *oNumRanges)
+{
+	DeltaRange *ranges = NULL;
+	unsigned int numRanges = 0;
+	size_t maxRanges = 0;
+	size_t off;
+
+	*oRanges = NULL;
+
+	for (off = 0; off < size; off += DELTA_BLOCK_SIZE) {
+		size_t len = ((size - off) > DELTA_BLOCK_SIZE) ?
+			DELTA_BLOCK_SIZE : (size - off);
+
+		if (((off + len) <= shadowSize) &&
+		    !memcmp(shadow + off, data + off, len)) {
+			continue;
+		}
+
+		if (!AddBlock(&ranges, &numRanges, &maxRanges, off, len)) {
+			return false;
+		}
+	}
+
+	*oRanges = ranges;
+	*oNumRanges = numRanges;
+	return true;
+}
+
+/* True if every byte of the block is $00, or every byte is $FF */
+static bool IsFill(const uint8_t *block, size_t len)
+{
+	size_t i;
+
+	if ((block[0] != 0x00) && (block[0] != 0xff)) {
+		return false;
+	}
+
+	for (i = 1; i < len; i++) {
+		if (block[i] != block[0]) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Narrow down ranges of data to send so that runs of $00 or $FF padding
+ * are skipped. Only whole blocks of fill are skipped, and only where there
+ * are enough of them in a row to be worth an extra upload command, so the
+ * ranges left over never have gaps smaller than DELTA_MERGE_GAP.
+ */
+bool SkipFill(const uint8_t *data,
+	      const DeltaRange *inRanges, unsigned int numInRanges,
+	      DeltaRange **oRanges, unsigned int *oNumRanges)
+{
+	DeltaRange *ranges = NULL;
+	unsigned int numRanges = 0;
+	size_t maxRanges = 0;
+	unsigned int r;
+	size_t off;
+
+	*oRanges = NULL;
+
+	for (r = 0; r < numInRanges; r++) {
+		const size_t end = (size_t)inRanges[r].offset +
+			inRanges[r].size;
+
+		for (off = inRanges[r].offset; off < end;
+		     off += DELTA_BLOCK_SIZE) {
+			size_t len = ((end - off) > DELTA_BLOCK_SIZE) ?
+				DELTA_BLOCK_SIZE : (end - off);
+
+			if (IsFill(data + off, len)) {
+				continue;
+			}
+
+			if (!AddBlock(&ranges, &numRanges, &maxRanges,
+				      off, len)) {
+				return false;
+			}
+		}
+	}
+
+	*oRanges = ranges;
+	*oNumRanges = numRanges;
+	return true;
+}
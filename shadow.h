@@ -0,0 +1,39 @@
+/*
+ * SPDX-License-Identifier: CC0-1.0
+ *
+ * Author: James Jones
+ */
+
+#ifndef SHADOW_H_
+#define SHADOW_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A shadow is a host-side copy of what the last delta upload to a given
+ * address on a given GameDrive left in Jaguar memory, kept in the cache
+ * directory. Devices are identified by a key built from their bus and port
+ * path.
+ */
+
+typedef struct {
+	uint32_t offset;
+	uint32_t size;
+} DeltaRange;
+
+extern uint8_t *LoadShadow(const char *devKey, uint32_t baseAddr,
+			   size_t *oSize);
+extern void SaveShadow(const char *devKey, uint32_t baseAddr,
+		       const uint8_t *data, size_t size);
+extern void InvalidateShadows(const char *devKey,
+			      uint32_t start, uint32_t end);
+extern bool ComputeDelta(const uint8_t *shadow, size_t shadowSize,
+			 const uint8_t *data, size_t size,
+			 DeltaRange **oRanges, unsigned int *oNumRanges);
+extern bool SkipFill(const uint8_t *data,
+		     const DeltaRange *inRanges, unsigned int numInRanges,
+		     DeltaRange **oRanges, unsigned int *oNumRanges);
+
+#endif /* SHADOW_H_ */
@@ -0,0 +1,422 @@
+/*
+ * SPDX-License-Identifier: CC0-1.0
+ *
+ * Author: James Jones
+ */
+
+/* Needed to get dirent, st_mtim and strdup() definitions with -std=c99 */
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "sync.h"
+
+static const char MANIFEST_MAGIC[] = "jaggd-sync 1";
+
+static bool ManifestPath(char *path, size_t pathLen, const char *devKey)
+{
+	return CachePath(path, pathLen, "sync-%s.txt", devKey);
+}
+
+static int CompareEntries(const void *a, const void *b)
+{
+	return strcmp(((const SyncEntry *)a)->name,
+		      ((const SyncEntry *)b)->name);
+}
+
+/* Append a zeroed entry to *entries, growing it as needed */
+static SyncEntry *AddEntry(SyncEntry **entries, unsigned int *num,
+			   unsigned int *max)
+{
+	if (*num == *max) {
+		unsigned int newMax = *max ? *max * 2 : 64;
+		SyncEntry *newEntries = realloc(*entries,
+						newMax * sizeof(**entries));
+
+		if (!newEntries) {
+			fprintf(stderr, "Failed to alloc sync entries\n");
+			return NULL;
+		}
+
+		*entries = newEntries;
+		*max = newMax;
+	}
+
+	memset(&(*entries)[*num], 0, sizeof(**entries));
+	return &(*entries)[(*num)++];
+}
+
+void FreeSyncPlan(SyncPlan *plan)
+{
+	free(plan->dir); plan->dir = NULL;
+	free(plan->files); plan->files = NULL;
+	free(plan->manifest); plan->manifest = NULL;
+	plan->numFiles = plan->numManifest = 0;
+}
+
+/*
+ * List the regular files directly in dir. Nothing is read from them yet.
+ * Hidden files are skipped, as are files whose names are too long for the
+ * SD card, with a warning.
+ */
+bool ScanSyncDir(const char *dir, SyncPlan *plan)
+{
+	unsigned int maxFiles = 0;
+	struct dirent *ent;
+	DIR *d;
+
+	memset(plan, 0, sizeof(*plan));
+
+	if (!(d = opendir(dir))) {
+		fprintf(stderr, "Failed to open directory '%s':\n  %s\n",
+			dir, strerror(errno));
+		return false;
+	}
+
+	if (!(plan->dir = strdup(dir))) {
+		fprintf(stderr, "Failed to alloc sync directory name\n");
+		goto fail;
+	}
+
+	while ((ent = readdir(d))) {
+		char path[4096];
+		struct stat st;
+		SyncEntry *e;
+
+		if (ent->d_name[0] == '.') {
+			continue;
+		}
+
+		snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+
+		if (stat(path, &st) || !S_ISREG(st.st_mode)) {
+			continue;
+		}
+
+		if (strlen(ent->d_name) > SYNC_MAX_NAME) {
+			fprintf(stderr, "Skipping '%s': file name must be <= "
+				"%d characters long\n", path, SYNC_MAX_NAME);
+			continue;
+		}
+
+		if (st.st_size > UINT32_MAX) {
+			fprintf(stderr, "Skipping '%s': file is too big. Must "
+				"be <=4GB\n", path);
+			continue;
+		}
+
+		if (!(e = AddEntry(&plan->files, &plan->numFiles, &maxFiles))) {
+			goto fail;
+		}
+
+		strcpy(e->name, ent->d_name);
+		e->size = st.st_size;
+		e->mtimeNs = (int64_t)st.st_mtim.tv_sec * 1000000000 +
+			st.st_mtim.tv_nsec;
+	}
+
+	closedir(d);
+
+	if (plan->numFiles) {
+		qsort(plan->files, plan->numFiles, sizeof(*plan->files),
+		      CompareEntries);
+	}
+
+	return true;
+
+fail:
+	closedir(d);
+	FreeSyncPlan(plan);
+	return false;
+}
+
+/*
+ * Read what was last written to the GameDrive's SD card. A missing or
+ * unreadable manifest just means every file gets sent.
+ */
+void LoadSyncManifest(const char *devKey, SyncPlan *plan)
+{
+	char path[4096];
+	char line[256];
+	unsigned int maxManifest = 0;
+	FILE *fp;
+
+	if (!ManifestPath(path, sizeof(path), devKey)) {
+		return;
+	}
+
+	if (!(fp = fopen(path, "r"))) {
+		return;
+	}
+
+	if (!fgets(line, sizeof(line), fp) ||
+	    strncmp(line, MANIFEST_MAGIC, strlen(MANIFEST_MAGIC))) {
+		goto cleanup;
+	}
+
+	/* One "hash size mtime name" line per file */
+	while (fgets(line, sizeof(line), fp)) {
+		SyncEntry e = { .state = SYNC_UNCHECKED };
+		int nameStart;
+		size_t nameLen;
+
+		if (sscanf(line, "%" SCNx64 " %" SCNu32 " %" SCNd64 " %n",
+			   &e.hash, &e.size, &e.mtimeNs, &nameStart) < 3) {
+			continue;
+		}
+
+		nameLen = strcspn(&line[nameStart], "\r\n");
+
+		if ((nameLen == 0) || (nameLen > SYNC_MAX_NAME)) {
+			continue;
+		}
+
+		memcpy(e.name, &line[nameStart], nameLen);
+
+		if (!AddEntry(&plan->manifest, &plan->numManifest,
+			      &maxManifest)) {
+			break;
+		}
+
+		plan->manifest[plan->numManifest - 1] = e;
+	}
+
+	if (plan->numManifest) {
+		qsort(plan->manifest, plan->numManifest,
+		      sizeof(*plan->manifest), CompareEntries);
+	}
+
+cleanup:
+	fclose(fp);
+}
+
+/* 64-bit FNV-1a of a file's contents */
+static bool HashFile(const char *path, uint64_t *oHash)
+{
+	static const uint64_t FNV_PRIME = 0x100000001b3ull;
+	uint8_t buf[64 * 1024];
+	uint64_t hash = 0xcbf29ce484222325ull;
+	size_t len, i;
+	FILE *fp;
+
+	if (!(fp = fopen(path, "rb"))) {
+		fprintf(stderr, "Failed to open '%s' for reading\n", path);
+		return false;
+	}
+
+	while ((len = fread(buf, 1, sizeof(buf), fp)) > 0) {
+		for (i = 0; i < len; i++) {
+			hash = (hash ^ buf[i]) * FNV_PRIME;
+		}
+	}
+
+	if (ferror(fp)) {
+		fprintf(stderr, "Failed to read '%s'\n", path);
+		fclose(fp);
+		return false;
+	}
+
+	fclose(fp);
+	*oHash = hash;
+	return true;
+}
+
+static const SyncEntry *FindManifestEntry(const SyncPlan *plan,
+					  const SyncEntry *e)
+{
+	if (!plan->numManifest) {
+		return NULL;
+	}
+
+	return bsearch(e, plan->manifest, plan->numManifest,
+		       sizeof(*plan->manifest), CompareEntries);
+}
+
+/* Compare e, read from path, with what the manifest has under its name */
+static bool CheckEntry(const SyncPlan *plan, SyncEntry *e, const char *path)
+{
+	const SyncEntry *old = FindManifestEntry(plan, e);
+
+	if (old && (old->size == e->size) && (old->mtimeNs == e->mtimeNs)) {
+		e->hash = old->hash;
+		e->state = SYNC_UNCHANGED;
+		return true;
+	}
+
+	if (!HashFile(path, &e->hash)) {
+		return false;
+	}
+
+	if (old && (old->size == e->size) && (old->hash == e->hash)) {
+		e->state = SYNC_UNCHANGED;
+	} else {
+		e->state = SYNC_CHANGED;
+	}
+
+	return true;
+}
+
+/*
+ * Work out whether file i has to be sent, setting its state to
+ * SYNC_UNCHANGED or SYNC_CHANGED. Files whose size and modification time
+ * match the manifest are taken as unchanged without reading them. Returns
+ * false if the file couldn't be read.
+ */
+bool CheckSyncFile(SyncPlan *plan, unsigned int i)
+{
+	char path[4096];
+
+	snprintf(path, sizeof(path), "%s/%s", plan->dir, plan->files[i].name);
+
+	return CheckEntry(plan, &plan->files[i], path);
+}
+
+static bool WriteEntry(FILE *fp, const SyncEntry *e)
+{
+	return fprintf(fp, "%016" PRIx64 " %" PRIu32 " %" PRId64 " %s\n",
+		       e->hash, e->size, e->mtimeNs, e->name) > 0;
+}
+
+/* Save the manifest, going by only the first numFiles of plan's files */
+static void WriteManifest(const char *devKey, const SyncPlan *plan,
+			  unsigned int numFiles)
+{
+	char path[4096];
+	char tmpPath[4096 + 4];
+	unsigned int f = 0, m = 0;
+	bool ok;
+	FILE *fp;
+
+	if (!ManifestPath(path, sizeof(path), devKey)) {
+		return;
+	}
+
+	snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+
+	if (!(fp = fopen(tmpPath, "w"))) {
+		fprintf(stderr, "Failed to create '%s':\n  %s\n",
+			tmpPath, strerror(errno));
+		return;
+	}
+
+	ok = fprintf(fp, "%s\n", MANIFEST_MAGIC) > 0;
+
+	/* Both lists are sorted by name, so merge them */
+	while (ok && ((f < numFiles) || (m < plan->numManifest))) {
+		const SyncEntry *file = (f < numFiles) ?
+			&plan->files[f] : NULL;
+		const SyncEntry *old = (m < plan->numManifest) ?
+			&plan->manifest[m] : NULL;
+		int order = !file ? 1 : !old ? -1 : CompareEntries(file, old);
+
+		if (order > 0) {
+			ok = WriteEntry(fp, old);
+			m++;
+			continue;
+		}
+
+		if ((file->state == SYNC_SENT) ||
+		    (file->state == SYNC_UNCHANGED)) {
+			ok = WriteEntry(fp, file);
+		} else if ((order == 0) && (file->state != SYNC_FAILED)) {
+			ok = WriteEntry(fp, old);
+		}
+
+		f++;
+		if (order == 0) m++;
+	}
+
+	if (!ok) {
+		fprintf(stderr, "Failed to write '%s'\n", tmpPath);
+		fclose(fp);
+		unlink(tmpPath);
+		return;
+	}
+
+	if (fclose(fp) || rename(tmpPath, path)) {
+		fprintf(stderr, "Failed to save '%s':\n  %s\n",
+			path, strerror(errno));
+		unlink(tmpPath);
+	}
+}
+
+/*
+ * Record the outcome of a sync. Files now known to be on the SD card are
+ * added or updated, and files that were only partly written are dropped so
+ * they get sent again. Everything else the manifest held is left alone, as
+ * files removed from the directory are still on the card. As with shadows,
+ * failing to save only costs resending files next time.
+ */
+void SaveSyncManifest(const char *devKey, const SyncPlan *plan)
+{
+	WriteManifest(devKey, plan, plan->numFiles);
+}
+
+/*
+ * Save the manifest part way through a sync, as if only the first numDone
+ * files had been looked at, so a sync that gets interrupted picks up where
+ * it left off. Later files may still be being checked on another thread.
+ */
+void CheckpointSyncManifest(const char *devKey, const SyncPlan *plan,
+			    unsigned int numDone)
+{
+	WriteManifest(devKey, plan, numDone);
+}
+
+/*
+ * Work out whether the SD card already holds what -wf would write to it
+ * from path, going by the manifest as CheckSyncFile() does. e->name and
+ * e->size must be the name and size it would be written with, which differ
+ * from path's for archives. Returns false if path couldn't be read.
+ */
+bool CheckWriteFile(const char *devKey, const char *path, SyncEntry *e)
+{
+	SyncPlan plan = { 0 };
+	struct stat st;
+	bool ok;
+
+	if (stat(path, &st)) {
+		fprintf(stderr, "Failed to read '%s':\n  %s\n",
+			path, strerror(errno));
+		return false;
+	}
+
+	e->mtimeNs = (int64_t)st.st_mtim.tv_sec * 1000000000 +
+		st.st_mtim.tv_nsec;
+
+	LoadSyncManifest(devKey, &plan);
+	ok = CheckEntry(&plan, e, path);
+	FreeSyncPlan(&plan);
+
+	return ok;
+}
+
+/*
+ * Bring the manifest up to date with a -wf write: SYNC_SENT once e is on
+ * the SD card, or SYNC_FAILED when whatever the card held under its name
+ * is about to be, or has been, overwritten with something incomplete.
+ */
+void RecordWriteFile(const char *devKey, const SyncEntry *e)
+{
+	SyncPlan plan = {
+		.files = (SyncEntry *)e,
+		.numFiles = 1,
+	};
+
+	LoadSyncManifest(devKey, &plan);
+
+	/* Don't create a manifest just to leave a file out of it */
+	if ((e->state == SYNC_SENT) || FindManifestEntry(&plan, e)) {
+		WriteManifest(devKey, &plan, plan.numFiles);
+	}
+
+	free(plan.manifest);
+}
@@ -0,0 +1,63 @@
+/*
+ * SPDX-License-Identifier: CC0-1.0
+ *
+ * Author: James Jones
+ */
+
+#ifndef SYNC_H_
+#define SYNC_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * A sync copies the files in a local directory to the root of a GameDrive's
+ * SD card. A manifest of what was last written to each GameDrive, keyed by
+ * its bus/port path like shadows are, is kept in the cache directory so that
+ * only new and changed files need sending. The manifest is saved after each
+ * file, so an interrupted sync resumes from the file it stopped in. Files
+ * written with -wf are recorded in it too.
+ */
+
+/* Longest SD card file name the write file command takes */
+#define SYNC_MAX_NAME 47
+
+typedef enum {
+	SYNC_UNCHECKED,
+	SYNC_UNCHANGED,	/* The SD card already has this content */
+	SYNC_CHANGED,	/* Needs sending */
+	SYNC_SENT,
+	SYNC_FAILED,	/* Sending started but didn't finish */
+} SyncState;
+
+typedef struct {
+	char name[SYNC_MAX_NAME + 1];
+	uint32_t size;
+	int64_t mtimeNs;
+	uint64_t hash;
+	SyncState state;
+} SyncEntry;
+
+typedef struct {
+	char *dir;
+
+	/* Files in dir, sorted by name */
+	SyncEntry *files;
+	unsigned int numFiles;
+
+	/* What the manifest says the SD card holds */
+	SyncEntry *manifest;
+	unsigned int numManifest;
+} SyncPlan;
+
+extern bool ScanSyncDir(const char *dir, SyncPlan *plan);
+extern void LoadSyncManifest(const char *devKey, SyncPlan *plan);
+extern bool CheckSyncFile(SyncPlan *plan, unsigned int i);
+extern void SaveSyncManifest(const char *devKey, const SyncPlan *plan);
+extern void CheckpointSyncManifest(const char *devKey, const SyncPlan *plan,
+				   unsigned int numDone);
+extern bool CheckWriteFile(const char *devKey, const char *path, SyncEntry *e);
+extern void RecordWriteFile(const char *devKey, const SyncEntry *e);
+extern void FreeSyncPlan(SyncPlan *plan);
+
+#endif /* SYNC_H_ */
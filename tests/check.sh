@@ -0,0 +1,237 @@
+#!/bin/sh
+#
+# SPDX-License-Identifier: CC0-1.0
+#
+# Author: James Jones
+#
+# Checks that what jaggd uploads arrives intact, using the simulated
+# GameDrive (gdsim.c). Each check runs jaggd against it, then compares the
+# memory it dumps at exit, or the files in its stand-in SD card directory,
+# with what was sent. Run through 'make check', which builds jaggd and
+# libgdsim.so first, or directly from the top of the source tree:
+#
+#   tests/check.sh
+#
+# Covered are raw binaries, COFF and ELF executables and ROM images, -uz
+# packed uploads (unpacked here as the 68000 would), --sparse and --delta,
+# write file and -sync, writing to several GameDrives at once, and recovering
+# from stalled bulk transfers and command packets. Archives are checked too
+# unless ZLIB=0.
+
+set -e
+
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:-"-std=c99 -O2 -Wall -Werror"}
+ZLIB=${ZLIB:-1}
+
+if [ ! -f jaggd.c ]; then
+	echo "Run tests/check.sh from the top of the jaggd source tree" >&2
+	exit 1
+fi
+
+if [ ! -x jaggd ] || [ ! -f libgdsim.so ]; then
+	echo "Build jaggd and libgdsim.so first, or use 'make check'" >&2
+	exit 1
+fi
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+$CC $CFLAGS -o "$work/mkpayload" bench/mkpayload.c
+$CC $CFLAGS -o "$work/unpack" tests/unpack.c
+
+passed=0
+failed=0
+SIMENV=
+
+# in_mem file offset addr size
+#
+# Whether size bytes of file from offset ended up in memory at addr
+in_mem() {
+	cmp -n "$4" -i "$(($2)):$(($3))" "$1" "$work/mem"
+}
+
+# upload name check jaggd-args...
+#
+# Run jaggd on a fresh simulated GameDrive, with SIMENV added to its
+# settings, then the check function. jaggd's output goes to
+# $work/name.log.
+upload() {
+	name=$1
+	check=$2
+	shift 2
+
+	# Nothing sent before counts: memory, SD card and jaggd's caches
+	rm -rf "$work"/sd* "$work"/mem* "$work/cache"
+	mkdir "$work/sd" "$work/sd.1"
+
+	if ! env LD_PRELOAD="$PWD/libgdsim.so" \
+	     GDSIM_MEM_DUMP="$work/mem" \
+	     GDSIM_SD_DIR="$work/sd" \
+	     XDG_CACHE_HOME="$work/cache" \
+	     JAGGD_SOCKET="$work/no-daemon" \
+	     ${SIMENV} ./jaggd "$@" > "$work/$name.log" 2>&1; then
+		echo "FAIL $name: jaggd failed"
+		sed 's/^/    /' "$work/$name.log"
+		failed=$((failed + 1))
+	elif ! "$check" > "$work/check.log" 2>&1; then
+		echo "FAIL $name"
+		sed 's/^/    /' "$work/check.log"
+		failed=$((failed + 1))
+	else
+		echo "PASS $name"
+		passed=$((passed + 1))
+	fi
+}
+
+SIZE=1048576
+# An eighth of executables' data goes to RAM, as in mkpayload.c
+DATA=$(((SIZE / 8) & ~1))
+TEXT=$((SIZE - DATA))
+COFF_TEXT=$((0x14 + 0x1c + 3 * 0x28))
+ELF_TEXT=0x1000
+
+for fmt in bin cof elf rom; do
+	"$work/mkpayload" "$fmt" "$SIZE" "$work/payload.$fmt"
+done
+
+# Highly compressible, for -uz
+: > "$work/text.bin"
+for i in 1 2 3 4 5 6 7 8 9 10 11 12; do
+	cat jaggd.c >> "$work/text.bin"
+done
+TEXT_SIZE=$(wc -c < "$work/text.bin")
+
+# Random data with a long run of $FF padding in the middle, for --sparse
+SPARSE_SIZE=393216
+head -c 65536 "$work/payload.bin" > "$work/sparse.bin"
+head -c 262144 /dev/zero | tr '\000' '\377' >> "$work/sparse.bin"
+tail -c 65536 "$work/payload.bin" >> "$work/sparse.bin"
+head -c $SPARSE_SIZE /dev/zero | tr '\000' '\377' > "$work/ff.bin"
+
+# The payload with a few bytes changed in two places, for --delta
+cp "$work/payload.bin" "$work/changed.bin"
+for at in 4096 700000; do
+	printf changed | dd of="$work/changed.bin" bs=1 seek=$at \
+		conv=notrunc 2>/dev/null
+done
+
+mkdir "$work/syncdir"
+for n in 1 2 3; do
+	head -c $((n * 100000)) "$work/payload.cof" > "$work/syncdir/file$n.bin"
+done
+
+check_bin_ram() {
+	in_mem "$work/payload.bin" 0 0x4000 300000
+}
+upload bin-ram check_bin_ram -u "$work/payload.bin,a:\$4000,s:300000"
+
+check_bin_cart() {
+	in_mem "$work/payload.bin" 0 0x802000 $SIZE
+}
+upload bin-cart check_bin_cart -u "$work/payload.bin,a:\$802000"
+
+# Text goes to cartridge space and data to RAM, as in mkpayload.c
+check_cof() {
+	in_mem "$work/payload.cof" $COFF_TEXT 0x802000 $TEXT &&
+	in_mem "$work/payload.cof" $((COFF_TEXT + TEXT)) 0x4000 $DATA
+}
+upload cof check_cof -u "$work/payload.cof"
+
+check_elf() {
+	in_mem "$work/payload.elf" $ELF_TEXT 0x802000 $TEXT &&
+	in_mem "$work/payload.elf" $((ELF_TEXT + TEXT)) 0x4000 $DATA
+}
+upload elf check_elf -u "$work/payload.elf"
+
+check_rom() {
+	in_mem "$work/payload.rom" 0x2000 0x802000 $SIZE
+}
+upload rom check_rom -u "$work/payload.rom"
+
+# Unpack the image jaggd says it uploaded, then compare
+check_packed() {
+	addr=$(sed -n 's/.*PACKED [0-9]* BYTES AT \$\([0-9a-fA-F]*\).*/\1/p' \
+		"$work/packed.log")
+	[ -n "$addr" ] &&
+	"$work/unpack" "$work/mem" "0x$addr" "$work/unpacked" &&
+	cmp -n $TEXT_SIZE -i 0:$((0x4000)) "$work/text.bin" "$work/unpacked"
+}
+upload packed check_packed -uz "$work/text.bin,a:\$4000"
+
+# Too high in RAM for the unpacker, so it has to be sent as it is
+check_packed_fallback() {
+	grep -q 'Not packing' "$work/packed-fallback.log" &&
+	in_mem "$work/text.bin" 0 0x1f0000 $TEXT_SIZE
+}
+upload packed-fallback check_packed_fallback -uz "$work/text.bin,a:\$1f0000"
+
+# Memory doesn't outlive jaggd, so fill it first in the same batch
+printf '%s\n' "-u $work/ff.bin,a:\$802000" \
+	"--sparse -u $work/sparse.bin,a:\$802000" > "$work/sparse.batch"
+check_sparse() {
+	grep -q SPARSE "$work/sparse.log" &&
+	in_mem "$work/sparse.bin" 0 0x802000 $SPARSE_SIZE
+}
+upload sparse check_sparse -b "$work/sparse.batch"
+
+printf '%s\n' "--delta -u $work/payload.bin,a:\$802000" \
+	"--delta -u $work/changed.bin,a:\$802000" > "$work/delta.batch"
+check_delta() {
+	grep -q DELTA "$work/delta.log" &&
+	in_mem "$work/changed.bin" 0 0x802000 $SIZE
+}
+upload delta check_delta -b "$work/delta.batch"
+
+check_write_file() {
+	cmp "$work/payload.bin" "$work/sd/payload.bin"
+}
+upload write-file check_write_file -wf "$work/payload.bin"
+
+check_sync() {
+	for n in 1 2 3; do
+		cmp "$work/syncdir/file$n.bin" "$work/sd/file$n.bin" || return 1
+	done
+}
+upload sync check_sync -sync "$work/syncdir"
+
+if [ "$ZLIB" = 1 ]; then
+	gzip -c "$work/payload.bin" > "$work/payload.bin.gz"
+	upload gzip check_bin_cart -u "$work/payload.bin.gz,a:\$802000"
+
+	# Every GameDrive gets the file decompressed, not the archive
+	check_fan_out_gzip() {
+		cmp "$work/payload.bin" "$work/sd/payload.bin" &&
+		cmp "$work/payload.bin" "$work/sd.1/payload.bin"
+	}
+	SIMENV=GDSIM_DEVICES=2
+	upload fan-out-gzip check_fan_out_gzip -dev all \
+		-wf "$work/payload.bin.gz"
+	SIMENV=
+fi
+
+# Stall bulk transfers and command packets every so often
+check_retry_cof() {
+	grep -q Retrying "$work/retry-cof.log" && check_cof
+}
+SIMENV=GDSIM_FAIL_EVERY=7
+upload retry-cof check_retry_cof -u "$work/payload.cof"
+
+
+check_retry_command() {
+	grep -q Retrying "$work/retry-command.log" && check_elf
+}
+# Files are written from the start again after a stall, so one every few
+# transfers would never let them finish. Stall their commands instead.
+check_retry_sync() {
+	grep -q Retrying "$work/retry-sync.log" && check_sync
+}
+
+SIMENV=GDSIM_CMD_FAIL_EVERY=2
+upload retry-command check_retry_command -r -u "$work/payload.elf"
+upload retry-sync check_retry_sync -sync "$work/syncdir"
+SIMENV=
+
+echo "$passed passed, $failed failed"
+
+[ "$failed" -eq 0 ]
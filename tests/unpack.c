@@ -0,0 +1,122 @@
+/*
+ * SPDX-License-Identifier: CC0-1.0
+ *
+ * Author: James Jones
+ */
+
+/*
+ * Does what the 68000 unpacker uploaded by 'jaggd -uz' would: reads a dump
+ * of Jaguar memory, unpacks the packed image at the given address into it
+ * the way the unpacker in pack.c does, byte by byte, and writes the result
+ * out for comparing with the original file. The dump itself comes from the
+ * simulated GameDrive, which can't run 68000 code.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#define MEM_SIZE (16 * 1024 * 1024)
+
+/* Where the unpacker's parameters and data sit in the packed image */
+#define PARAMS_OFF 0x40
+#define DATA_OFF 0x4c
+
+static uint32_t Get32(const uint8_t *mem, uint32_t addr)
+{
+	return ((uint32_t)mem[addr] << 24) | ((uint32_t)mem[addr + 1] << 16) |
+		((uint32_t)mem[addr + 2] << 8) | mem[addr + 3];
+}
+
+static int Unpack(uint8_t *mem, uint32_t image)
+{
+	uint32_t dst = Get32(mem, image + PARAMS_OFF);
+	uint32_t len = Get32(mem, image + PARAMS_OFF + 8);
+	uint32_t src = image + DATA_OFF;
+	uint32_t end = src + len;
+
+	if ((end > MEM_SIZE) || (dst >= MEM_SIZE)) {
+		fprintf(stderr, "Packed image at $%x is out of range\n", image);
+		return -1;
+	}
+
+	while (src < end) {
+		uint32_t c = mem[src++];
+		uint32_t count, from;
+
+		if (c < 0x80) {
+			/* Literal run of c + 1 bytes */
+			for (count = c + 1; count; count--) {
+				if ((dst >= MEM_SIZE) || (src >= end)) return -1;
+				mem[dst++] = mem[src++];
+			}
+		} else {
+			/* Match of (c & 0x7f) + 3 bytes from a 16-bit distance */
+			if ((src + 2) > end) return -1;
+			from = dst - (((uint32_t)mem[src] << 8) | mem[src + 1]);
+			src += 2;
+
+			for (count = (c & 0x7f) + 3; count; count--) {
+				if ((dst >= MEM_SIZE) || (from >= MEM_SIZE)) {
+					return -1;
+				}
+				mem[dst++] = mem[from++];
+			}
+		}
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	uint8_t *mem;
+	uint32_t image;
+	FILE *fp;
+	int ret = -1;
+
+	if (argc != 4) {
+		fprintf(stderr, "Usage: unpack dump address out\n");
+		return -1;
+	}
+
+	image = strtoul(argv[2], NULL, 0);
+
+	if (!(mem = calloc(1, MEM_SIZE))) {
+		fprintf(stderr, "Failed to alloc memory image\n");
+		return -1;
+	}
+
+	if (!(fp = fopen(argv[1], "rb"))) {
+		fprintf(stderr, "Failed to open '%s'\n", argv[1]);
+		goto cleanup;
+	}
+
+	if (fread(mem, 1, MEM_SIZE, fp) != MEM_SIZE) {
+		fprintf(stderr, "Failed to read '%s'\n", argv[1]);
+		fclose(fp);
+		goto cleanup;
+	}
+	fclose(fp);
+
+	if ((image > (MEM_SIZE - DATA_OFF)) || Unpack(mem, image)) {
+		fprintf(stderr, "Failed to unpack image at $%x\n", image);
+		goto cleanup;
+	}
+
+	if (!(fp = fopen(argv[3], "wb"))) {
+		fprintf(stderr, "Failed to create '%s'\n", argv[3]);
+		goto cleanup;
+	}
+
+	if ((fwrite(mem, 1, MEM_SIZE, fp) != MEM_SIZE) | fclose(fp)) {
+		fprintf(stderr, "Failed to write '%s'\n", argv[3]);
+		goto cleanup;
+	}
+
+	ret = 0;
+
+cleanup:
+	free(mem);
+	return ret;
+}
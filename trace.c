@@ -0,0 +1,173 @@
+/*
+ * SPDX-License-Identifier: CC0-1.0
+ *
+ * Author: James Jones
+ */
+
+/* Needed to get pthread definitions with -std=c99 */
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "trace.h"
+
+/* Threads beyond this many share the last track */
+#define TRACE_MAX_THREADS 64
+
+static struct {
+	pthread_mutex_t lock;
+	FILE *fp;
+	uint64_t startUs;
+	bool firstEvent;
+
+	pthread_t threads[TRACE_MAX_THREADS];
+	unsigned int numThreads;
+} trace = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static uint64_t NowUs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Start recording spans to fileName, replacing anything already there */
+bool TraceOpen(const char *fileName)
+{
+	FILE *fp = fopen(fileName, "w");
+
+	if (!fp) {
+		fprintf(stderr, "Failed to create trace file '%s':\n  %s\n",
+			fileName, strerror(errno));
+		return false;
+	}
+
+	fprintf(fp, "[\n");
+
+	pthread_mutex_lock(&trace.lock);
+	trace.fp = fp;
+	trace.startUs = NowUs();
+	trace.firstEvent = true;
+	trace.numThreads = 0;
+	pthread_mutex_unlock(&trace.lock);
+
+	return true;
+}
+
+void TraceClose(void)
+{
+	pthread_mutex_lock(&trace.lock);
+
+	if (trace.fp) {
+		fprintf(trace.fp, "\n]\n");
+
+		if (fclose(trace.fp)) {
+			fprintf(stderr, "Failed to write trace file\n");
+		}
+
+		trace.fp = NULL;
+	}
+
+	pthread_mutex_unlock(&trace.lock);
+}
+
+/* Timestamp for the start of a span, or 0 if not tracing */
+uint64_t TraceNow(void)
+{
+	/* Racy, but a span straddling TraceOpen() can safely be dropped */
+	return trace.fp ? NowUs() : 0;
+}
+
+/* Small, stable id for the calling thread. Call with trace.lock held. */
+static unsigned int ThreadId(void)
+{
+	pthread_t self = pthread_self();
+	unsigned int i;
+
+	for (i = 0; i < trace.numThreads; i++) {
+		if (pthread_equal(trace.threads[i], self)) {
+			return i + 1;
+		}
+	}
+
+	if (trace.numThreads == TRACE_MAX_THREADS) {
+		return TRACE_MAX_THREADS;
+	}
+
+	trace.threads[trace.numThreads++] = self;
+	return trace.numThreads;
+}
+
+/*
+ * Record a span that began at start and ends now. argsFmt, if not NULL,
+ * builds the members of the span's args object, e.g. "\"bytes\": %u".
+ * Strings that may need escaping must go through TraceEscape() first.
+ */
+void TraceSpan(uint64_t start, const char *cat, const char *name,
+	       const char *argsFmt, ...)
+{
+	uint64_t end;
+	va_list ap;
+
+	if (!start) {
+		return;
+	}
+
+	end = NowUs();
+
+	pthread_mutex_lock(&trace.lock);
+
+	if (!trace.fp || (start < trace.startUs)) {
+		pthread_mutex_unlock(&trace.lock);
+		return;
+	}
+
+	fprintf(trace.fp, "%s{\"name\": \"%s\", \"cat\": \"%s\", "
+		"\"ph\": \"X\", \"pid\": 1, \"tid\": %u, "
+		"\"ts\": %" PRIu64 ", \"dur\": %" PRIu64,
+		trace.firstEvent ? "" : ",\n", name, cat, ThreadId(),
+		start - trace.startUs, end - start);
+
+	if (argsFmt) {
+		fprintf(trace.fp, ", \"args\": {");
+		va_start(ap, argsFmt);
+		vfprintf(trace.fp, argsFmt, ap);
+		va_end(ap);
+		fprintf(trace.fp, "}");
+	}
+
+	fprintf(trace.fp, "}");
+	trace.firstEvent = false;
+
+	pthread_mutex_unlock(&trace.lock);
+}
+
+/* Copy str into buf as the contents of a JSON string */
+const char *TraceEscape(char *buf, size_t bufLen, const char *str)
+{
+	size_t out = 0;
+
+	for (; *str && ((out + 7) < bufLen); str++) {
+		unsigned char c = *str;
+
+		if ((c == '"') || (c == '\\')) {
+			buf[out++] = '\\';
+			buf[out++] = c;
+		} else if (c < 0x20) {
+			out += snprintf(&buf[out], bufLen - out, "\\u%04x", c);
+		} else {
+			buf[out++] = c;
+		}
+	}
+
+	buf[out] = '\0';
+	return buf;
+}
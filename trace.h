@@ -0,0 +1,29 @@
+/*
+ * SPDX-License-Identifier: CC0-1.0
+ *
+ * Author: James Jones
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Records how long each phase of a run takes, for --trace. Spans are written
+ * in Chrome's trace event format, which chrome://tracing and Perfetto can
+ * display. Until TraceOpen() is called, TraceNow() returns 0 and spans
+ * starting at 0 are dropped, so tracing costs next to nothing when off.
+ */
+
+extern bool TraceOpen(const char *fileName);
+extern void TraceClose(void);
+extern uint64_t TraceNow(void);
+extern void TraceSpan(uint64_t start, const char *cat, const char *name,
+		      const char *argsFmt, ...)
+	__attribute__((format(printf, 4, 5)));
+extern const char *TraceEscape(char *buf, size_t bufLen, const char *str);
+
+#endif /* TRACE_H_ */
@@ -0,0 +1,248 @@
+/*
+ * SPDX-License-Identifier: CC0-1.0
+ *
+ * Author: James Jones
+ */
+
+/* Needed to get sigaction() and strdup() definitions with -std=c99 */
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
+#include "watch.h"
+
+#define MAX_WATCHED 8
+
+/*
+ * Files are watched through their directories rather than directly, so
+ * that replacing a file by renaming a new one over it, as some linkers do,
+ * is seen as well as rewriting it in place.
+ */
+typedef struct {
+	int wd;
+	char *dir;
+	char *name;
+} WatchedFile;
+
+struct Watch {
+	int fd;
+	WatchedFile files[MAX_WATCHED];
+	unsigned int numFiles;
+
+	struct sigaction oldInt;
+	struct sigaction oldTerm;
+};
+
+static volatile sig_atomic_t stopWatching;
+
+static void StopWatching(int sig)
+{
+	stopWatching = 1;
+}
+
+void FreeWatch(Watch *watch)
+{
+	unsigned int i;
+
+	if (!watch) {
+		return;
+	}
+
+	for (i = 0; i < watch->numFiles; i++) {
+		free(watch->files[i].dir);
+		free(watch->files[i].name);
+	}
+
+#ifdef __linux__
+	if (watch->fd >= 0) {
+		close(watch->fd);
+		sigaction(SIGINT, &watch->oldInt, NULL);
+		sigaction(SIGTERM, &watch->oldTerm, NULL);
+	}
+#endif
+
+	free(watch);
+}
+
+/* Split path into its directory and file name */
+static bool SplitPath(const char *path, char **oDir, char **oName)
+{
+	const char *slash = strrchr(path, '/');
+
+	if (slash) {
+		size_t dirLen = (slash == path) ? 1 : (size_t)(slash - path);
+
+		*oDir = malloc(dirLen + 1);
+
+		if (*oDir) {
+			memcpy(*oDir, path, dirLen);
+			(*oDir)[dirLen] = '\0';
+		}
+
+		*oName = strdup(slash + 1);
+	} else {
+		*oDir = strdup(".");
+		*oName = strdup(path);
+	}
+
+	if (!*oDir || !*oName) {
+		fprintf(stderr, "Failed to alloc watch path\n");
+		free(*oDir); *oDir = NULL;
+		free(*oName); *oName = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Start watching the given files for changes. Until the watch is freed,
+ * SIGINT and SIGTERM make WaitForChange() return false rather than killing
+ * the process, so the caller can shut down cleanly.
+ */
+Watch *WatchFiles(const char *const *paths, unsigned int numPaths)
+{
+#ifdef __linux__
+	static const uint32_t WATCH_EVENTS =
+		IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_MODIFY;
+
+	Watch *watch = calloc(1, sizeof(*watch));
+	struct sigaction sa;
+	unsigned int i;
+
+	if (!watch) {
+		fprintf(stderr, "Failed to alloc watch\n");
+		return NULL;
+	}
+
+	if ((watch->fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK)) < 0) {
+		fprintf(stderr, "Failed to initialize inotify:\n  %s\n",
+			strerror(errno));
+		free(watch);
+		return NULL;
+	}
+
+	for (i = 0; (i < numPaths) && (i < MAX_WATCHED); i++) {
+		WatchedFile *wf = &watch->files[i];
+
+		if (!SplitPath(paths[i], &wf->dir, &wf->name)) {
+			goto fail;
+		}
+
+		watch->numFiles++;
+
+		/* Watching the same directory twice returns the same wd */
+		wf->wd = inotify_add_watch(watch->fd, wf->dir, WATCH_EVENTS);
+
+		if (wf->wd < 0) {
+			fprintf(stderr, "Failed to watch '%s':\n  %s\n",
+				wf->dir, strerror(errno));
+			goto fail;
+		}
+	}
+
+	/* No SA_RESTART, so poll() returns when asked to stop */
+	stopWatching = 0;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = StopWatching;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, &watch->oldInt);
+	sigaction(SIGTERM, &sa, &watch->oldTerm);
+
+	return watch;
+
+fail:
+	close(watch->fd);
+	watch->fd = -1;
+	FreeWatch(watch);
+	return NULL;
+#else
+	fprintf(stderr, "Watching files is only supported on Linux\n");
+	return NULL;
+#endif
+}
+
+#ifdef __linux__
+/*
+ * Drain pending events, returning true if any of them were for a watched
+ * file. The inotify descriptor is non-blocking, so this stops once the
+ * queue is empty.
+ */
+static bool ReadEvents(Watch *watch)
+{
+	/* Aligned as inotify requires */
+	union {
+		struct inotify_event ev;
+		char buf[4096];
+	} events;
+	bool changed = false;
+	ssize_t len;
+
+	while ((len = read(watch->fd, events.buf, sizeof(events.buf))) > 0) {
+		const char *ptr = events.buf;
+
+		while (ptr < (events.buf + len)) {
+			const struct inotify_event *ev = (const void *)ptr;
+			unsigned int i;
+
+			for (i = 0; ev->len && (i < watch->numFiles); i++) {
+				if ((ev->wd == watch->files[i].wd) &&
+				    !strcmp(ev->name, watch->files[i].name)) {
+					changed = true;
+				}
+			}
+
+			ptr += sizeof(*ev) + ev->len;
+		}
+	}
+
+	return changed;
+}
+#endif
+
+/*
+ * Block until a watched file changes and then goes quietMs without changing
+ * again, so a file still being written by a linker isn't picked up half
+ * done. Returns false if interrupted by SIGINT or SIGTERM, or on error.
+ */
+bool WaitForChange(Watch *watch, unsigned int quietMs)
+{
+#ifdef __linux__
+	struct pollfd pfd = { .fd = watch->fd, .events = POLLIN };
+	bool changed = false;
+
+	while (!stopWatching) {
+		int res = poll(&pfd, 1, changed ? (int)quietMs : -1);
+
+		if (res < 0) {
+			if (errno == EINTR) continue;
+
+			fprintf(stderr, "Failed to wait for file changes:\n"
+				"  %s\n", strerror(errno));
+			return false;
+		}
+
+		if (res == 0) {
+			/* Changed, then quiet for long enough */
+			return true;
+		}
+
+		if (ReadEvents(watch)) {
+			changed = true;
+		}
+	}
+#endif
+
+	return false;
+}
@@ -0,0 +1,18 @@
+/*
+ * SPDX-License-Identifier: CC0-1.0
+ *
+ * Author: James Jones
+ */
+
+#ifndef WATCH_H_
+#define WATCH_H_
+
+#include <stdbool.h>
+
+typedef struct Watch Watch;
+
+extern Watch *WatchFiles(const char *const *paths, unsigned int numPaths);
+extern bool WaitForChange(Watch *watch, unsigned int quietMs);
+extern void FreeWatch(Watch *watch);
+
+#endif /* WATCH_H_ */
@@ -0,0 +1,869 @@
+/*
+ * SPDX-License-Identifier: CC0-1.0
+ *
+ * Author: James Jones
+ */
+
+/* Needed to get pthread definitions with -std=c99 */
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "cache.h"
+#include "trace.h"
+#include "usberr.h"
+#include "xfer.h"
+
+/* Used if the descriptors don't say otherwise */
+#define DEFAULT_BULK_OUT_EP (LIBUSB_ENDPOINT_OUT | 2)
+#define DEFAULT_MAX_PACKET_SIZE 512
+
+static const char TUNING_MAGIC[] = "jaggd-link 1";
+
+/* 2 minute timeout per transfer */
+#define BULK_TIMEOUT (1000 * 60 * 2)
+
+/*
+ * Recovery from failed transfers: up to this many attempts in a row without
+ * getting any further, waiting twice as long before each.
+ */
+#define XFER_MAX_RETRIES 5
+#define XFER_RETRY_DELAY_MS 100
+
+typedef struct {
+	XferSource *src;
+	uint64_t size;
+	size_t chunkSize;
+
+	/* Bytes handed to libusb so far */
+	uint64_t submitted;
+
+	/* Bytes the device has accepted so far */
+	uint64_t done;
+
+	unsigned int inFlight;
+	enum libusb_transfer_status status;
+	bool srcFailed;
+
+	XferProgressFn progress;
+	void *progressData;
+
+	/* For --trace: when each of the queued transfers was submitted */
+	struct libusb_transfer **xfers;
+	uint64_t traceStart[XFER_MAX_DEPTH];
+} XferState;
+
+static int TransferStatusToError(enum libusb_transfer_status status)
+{
+	switch (status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		return LIBUSB_SUCCESS;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case LIBUSB_TRANSFER_STALL:
+		return LIBUSB_ERROR_PIPE;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return LIBUSB_ERROR_NO_DEVICE;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		return LIBUSB_ERROR_OVERFLOW;
+	case LIBUSB_TRANSFER_CANCELLED:
+		return LIBUSB_ERROR_INTERRUPTED;
+	default:
+		return LIBUSB_ERROR_IO;
+	}
+}
+
+/* Slot of xfer in the queue, for looking up its trace start time */
+static unsigned int TransferSlot(const XferState *xs,
+				 const struct libusb_transfer *xfer)
+{
+	unsigned int i;
+
+	for (i = 0; (i < XFER_MAX_DEPTH - 1) && (xs->xfers[i] != xfer); i++);
+
+	return i;
+}
+
+/* Point a transfer at the next chunk from the source and queue it */
+static bool SubmitNext(XferState *xs, struct libusb_transfer *xfer)
+{
+	uint64_t remaining = xs->size - xs->submitted;
+	size_t len = (remaining > xs->chunkSize) ?
+		xs->chunkSize : (size_t)remaining;
+	uint8_t *buf = xs->src->next(xs->src, len, &len);
+	int res;
+
+	if (!buf || (len == 0)) {
+		xs->srcFailed = true;
+		return false;
+	}
+
+	xfer->buffer = buf;
+	xfer->length = (int)len;
+
+	xs->traceStart[TransferSlot(xs, xfer)] = TraceNow();
+
+	if ((res = libusb_submit_transfer(xfer)) < 0) {
+		if (xs->src->release) {
+			xs->src->release(xs->src, buf);
+		}
+
+		/* Fail the way a transfer would, so the queue drains */
+		xs->status = (res == LIBUSB_ERROR_NO_DEVICE) ?
+			LIBUSB_TRANSFER_NO_DEVICE : LIBUSB_TRANSFER_ERROR;
+		return false;
+	}
+
+	xs->submitted += len;
+	xs->inFlight++;
+
+	return true;
+}
+
+static void LIBUSB_CALL TransferDone(struct libusb_transfer *xfer)
+{
+	XferState *xs = xfer->user_data;
+
+	TraceSpan(xs->traceStart[TransferSlot(xs, xfer)], "usb",
+		  "bulk transfer",
+		  "\"bytes\": %d, \"actual\": %d, \"status\": \"%s\"",
+		  xfer->length, xfer->actual_length,
+		  libusb_error_name(TransferStatusToError(xfer->status)));
+
+	xs->inFlight--;
+
+	if (xs->src->release) {
+		xs->src->release(xs->src, xfer->buffer);
+	}
+
+	if ((xs->status != LIBUSB_TRANSFER_COMPLETED) || xs->srcFailed) {
+		/* Already failed. Just let the remaining transfers drain. */
+		return;
+	}
+
+	if ((xfer->status != LIBUSB_TRANSFER_COMPLETED) ||
+	    (xfer->actual_length != xfer->length)) {
+		xs->status = (xfer->status != LIBUSB_TRANSFER_COMPLETED) ?
+			xfer->status : LIBUSB_TRANSFER_ERROR;
+		return;
+	}
+
+	xs->done += xfer->actual_length;
+
+	if (xs->progress) {
+		xs->progress(xs->progressData, xs->done, xs->size);
+	}
+
+	if (xs->submitted < xs->size) {
+		SubmitNext(xs, xfer);
+	}
+}
+
+/*
+ * Round chunkSize down to a whole number of packets, so that only the last
+ * transfer of an upload ends in a short packet.
+ */
+void SetXferChunkSize(XferLink *link, size_t chunkSize)
+{
+	if (chunkSize > XFER_MAX_CHUNK_SIZE) {
+		chunkSize = XFER_MAX_CHUNK_SIZE;
+	}
+
+	chunkSize -= chunkSize % link->maxPacketSize;
+
+	link->chunkSize = chunkSize ? chunkSize : link->maxPacketSize;
+}
+
+/*
+ * Find the bulk OUT endpoint of the GameDrive's interface 0 and its packet
+ * size, and set up the default chunk size and queue depth to go with it.
+ */
+void GetXferLink(libusb_device_handle *hGD, XferLink *link)
+{
+	struct libusb_config_descriptor *config;
+	int i;
+
+	memset(link, 0, sizeof(*link));
+	link->endpoint = DEFAULT_BULK_OUT_EP;
+	link->maxPacketSize = DEFAULT_MAX_PACKET_SIZE;
+	link->depth = XFER_DEFAULT_DEPTH;
+
+	if (libusb_get_active_config_descriptor(libusb_get_device(hGD),
+						&config) == LIBUSB_SUCCESS) {
+		if ((config->bNumInterfaces > 0) &&
+		    (config->interface[0].num_altsetting > 0)) {
+			const struct libusb_interface_descriptor *intf =
+				&config->interface[0].altsetting[0];
+
+			for (i = 0; i < intf->bNumEndpoints; i++) {
+				const struct libusb_endpoint_descriptor *ep =
+					&intf->endpoint[i];
+				/* Bits 11-12 are only used by periodic EPs */
+				uint16_t maxPacket = ep->wMaxPacketSize & 0x7ff;
+
+				if (((ep->bmAttributes &
+				      LIBUSB_TRANSFER_TYPE_MASK) ==
+				     LIBUSB_TRANSFER_TYPE_BULK) &&
+				    ((ep->bEndpointAddress &
+				      LIBUSB_ENDPOINT_DIR_MASK) ==
+				     LIBUSB_ENDPOINT_OUT) && maxPacket) {
+					link->endpoint = ep->bEndpointAddress;
+					link->maxPacketSize = maxPacket;
+					break;
+				}
+			}
+		}
+
+		libusb_free_config_descriptor(config);
+	}
+
+	SetXferChunkSize(link, XFER_CHUNK_SIZE);
+}
+
+static bool TuningPath(char *path, size_t pathLen, const char *devKey)
+{
+	return CachePath(path, pathLen, "link-%s.txt", devKey);
+}
+
+/*
+ * Apply the chunk size and queue depth saved by the last calibration of
+ * this GameDrive, if any. Call after GetXferLink().
+ */
+void LoadXferTuning(const char *devKey, XferLink *link)
+{
+	char path[4096];
+	char line[64];
+	unsigned int depth;
+	size_t chunkSize;
+	FILE *fp;
+
+	if (!TuningPath(path, sizeof(path), devKey) ||
+	    !(fp = fopen(path, "r"))) {
+		return;
+	}
+
+	/* "chunkSize depth" */
+	if (fgets(line, sizeof(line), fp) &&
+	    !strncmp(line, TUNING_MAGIC, strlen(TUNING_MAGIC)) &&
+	    (fscanf(fp, "%zu %u", &chunkSize, &depth) == 2) &&
+	    (depth >= 1) && (depth <= XFER_MAX_DEPTH)) {
+		SetXferChunkSize(link, chunkSize);
+		link->depth = depth;
+	}
+
+	fclose(fp);
+}
+
+/* As with shadows, failing to save only costs the tuning next time */
+void SaveXferTuning(const char *devKey, const XferLink *link)
+{
+	char path[4096];
+	FILE *fp;
+
+	if (!TuningPath(path, sizeof(path), devKey)) {
+		return;
+	}
+
+	if (!(fp = fopen(path, "w"))) {
+		fprintf(stderr, "Failed to create '%s':\n  %s\n",
+			path, strerror(errno));
+		return;
+	}
+
+	fprintf(fp, "%s\n%zu %u\n", TUNING_MAGIC,
+		link->chunkSize, link->depth);
+
+	if (fclose(fp)) {
+		fprintf(stderr, "Failed to save '%s'\n", path);
+	}
+}
+
+/*
+ * Keep up to depth transfers queued until the data is sent or one fails. The
+ * queued transfers point into this call's state, so it only returns once
+ * they are all back, even if the event loop itself is failing meanwhile.
+ */
+static void RunQueue(libusb_context *usbctx,
+		     XferState *xs,
+		     struct libusb_transfer **xfers,
+		     unsigned int depth)
+{
+	bool cancelled = false;
+	unsigned int loopErrors = 0;
+	unsigned int i;
+	int res;
+
+	for (i = 0; (i < depth) && (xs->submitted < xs->size); i++) {
+		if (!SubmitNext(xs, xfers[i])) {
+			break;
+		}
+	}
+
+	while (xs->inFlight > 0) {
+		if ((res = libusb_handle_events_completed(usbctx, NULL)) < 0) {
+			REPORT_USB_ERR(res, "libusb_handle_events_completed");
+
+			/* Fail the upload, and give the loop time to recover */
+			if (xs->status == LIBUSB_TRANSFER_COMPLETED) {
+				xs->status = LIBUSB_TRANSFER_ERROR;
+			}
+
+			if (loopErrors < XFER_MAX_RETRIES) {
+				loopErrors++;
+			}
+			usleep((XFER_RETRY_DELAY_MS << (loopErrors - 1)) * 1000);
+		} else {
+			loopErrors = 0;
+		}
+
+		if ((xs->status != LIBUSB_TRANSFER_COMPLETED) &&
+		    (xs->inFlight > 0) && !cancelled) {
+			/* Don't leave the rest of the queue on the wire */
+			for (i = 0; i < depth; i++) {
+				libusb_cancel_transfer(xfers[i]);
+			}
+			cancelled = true;
+		}
+	}
+}
+
+/*
+ * Failures worth clearing the endpoint and resending for. A device that has
+ * gone away has to be found again first, which is left to the caller.
+ */
+static bool IsTransient(enum libusb_transfer_status status)
+{
+	return (status == LIBUSB_TRANSFER_ERROR) ||
+		(status == LIBUSB_TRANSFER_TIMED_OUT) ||
+		(status == LIBUSB_TRANSFER_STALL) ||
+		(status == LIBUSB_TRANSFER_OVERFLOW);
+}
+
+/*
+ * Get ready to send the rest of the data again from offset: back off, clear
+ * the halt the failure may have left on the endpoint, rewind the source and
+ * have the device expect the data again.
+ */
+static bool Recover(libusb_device_handle *hGD,
+		    const XferLink *link,
+		    XferSource *src,
+		    const XferResume *resume,
+		    uint64_t offset,
+		    unsigned int attempt)
+{
+	const unsigned int delayMs = XFER_RETRY_DELAY_MS << (attempt - 1);
+	uint64_t traceStart = TraceNow();
+	int res;
+	bool ok;
+
+	fprintf(stderr, "Retrying from byte %" PRIu64 " in %u ms "
+		"(attempt %u of %u)\n", offset, delayMs, attempt,
+		XFER_MAX_RETRIES);
+	usleep(delayMs * 1000);
+
+	res = libusb_clear_halt(hGD, link->endpoint);
+
+	if ((res < 0) && (res != LIBUSB_ERROR_NOT_FOUND)) {
+		fprintf(stderr, "Failed to clear bulk endpoint: %s\n",
+			libusb_error_name(res));
+		ok = false;
+	} else {
+		ok = src->rewind(src, offset) &&
+			resume->restart(resume->data, offset);
+	}
+
+	TraceSpan(traceStart, "usb", "recover",
+		  "\"offset\": %" PRIu64 ", \"attempt\": %u, \"ok\": %s",
+		  offset, attempt, ok ? "true" : "false");
+
+	return ok;
+}
+
+/*
+ * Send size bytes from src to the bulk endpoint in link->chunkSize pieces,
+ * keeping up to link->depth transfers queued in the host controller at
+ * once so the bus never sits idle waiting on a round trip. Returns once the
+ * device has accepted all the data, or something failed.
+ *
+ * If a transfer fails and resume is given, the endpoint is cleared and the
+ * data is sent again from the last byte the device confirmed, or from the
+ * start if resume->fromStart is set. This needs a source that can rewind.
+ */
+XferResult BulkSend(libusb_context *usbctx,
+		    libusb_device_handle *hGD,
+		    const XferLink *link,
+		    XferSource *src,
+		    uint64_t size,
+		    const XferResume *resume,
+		    XferProgressFn progress,
+		    void *progressData)
+{
+	struct libusb_transfer *xfers[XFER_MAX_DEPTH] = { NULL };
+	unsigned int depth = link->depth;
+	XferState xs = {
+		.src = src,
+		.size = size,
+		.chunkSize = link->chunkSize,
+		.status = LIBUSB_TRANSFER_COMPLETED,
+		.progress = progress,
+		.progressData = progressData,
+		.xfers = xfers,
+	};
+	uint64_t traceStart = TraceNow();
+	uint64_t failedAt = 0;
+	unsigned int attempts = 0;
+	XferResult result;
+	unsigned int i;
+
+	if (depth < 1)
+		depth = 1;
+	if (depth > XFER_MAX_DEPTH)
+		depth = XFER_MAX_DEPTH;
+
+	for (i = 0; i < depth; i++) {
+		xfers[i] = libusb_alloc_transfer(0);
+
+		if (!xfers[i]) {
+			REPORT_USB_ERR(LIBUSB_ERROR_NO_MEM,
+				       "libusb_alloc_transfer");
+			result = XFER_USB_FAILED;
+			goto cleanup;
+		}
+
+		libusb_fill_bulk_transfer(xfers[i], hGD, link->endpoint,
+					  NULL, 0, TransferDone, &xs,
+					  BULK_TIMEOUT);
+	}
+
+	for (;;) {
+		uint64_t offset;
+		bool recovered = false;
+
+		RunQueue(usbctx, &xs, xfers, depth);
+
+		if (xs.srcFailed) {
+			result = XFER_SOURCE_FAILED;
+			break;
+		}
+
+		if (xs.status == LIBUSB_TRANSFER_COMPLETED) {
+			result = XFER_OK;
+			break;
+		}
+
+		fprintf(stderr, "\nBulk transfer failed after %" PRIu64
+			" of %" PRIu64 " bytes: %s\n", xs.done, size,
+			libusb_error_name(TransferStatusToError(xs.status)));
+
+		result = XFER_USB_FAILED;
+
+		if (!resume || !src->rewind || !IsTransient(xs.status)) {
+			break;
+		}
+
+		/* Only give up on failures that keep happening in one place */
+		if (xs.done > failedAt) {
+			attempts = 0;
+		}
+		failedAt = xs.done;
+
+		offset = resume->fromStart ? 0 : xs.done;
+
+		while (!recovered && (attempts < XFER_MAX_RETRIES)) {
+			recovered = Recover(hGD, link, src, resume, offset,
+					    ++attempts);
+		}
+
+		if (!recovered) {
+			fprintf(stderr, "Giving up on bulk transfer\n");
+			break;
+		}
+
+		xs.submitted = xs.done = offset;
+		xs.status = LIBUSB_TRANSFER_COMPLETED;
+	}
+
+cleanup:
+	for (i = 0; i < depth; i++) {
+		libusb_free_transfer(xfers[i]);
+	}
+
+	TraceSpan(traceStart, "usb", "BulkSend",
+		  "\"bytes\": %" PRIu64 ", \"depth\": %u", xs.done, depth);
+
+	return result;
+}
+
+typedef struct {
+	XferSource src;
+	uint8_t *buf;
+	uint64_t offset;
+} MemSource;
+
+static uint8_t *MemNext(XferSource *src, size_t maxLen, size_t *len)
+{
+	MemSource *ms = (MemSource *)src;
+	uint8_t *ptr = ms->buf + ms->offset;
+
+	ms->offset += maxLen;
+	*len = maxLen;
+
+	return ptr;
+}
+
+static bool MemRewind(XferSource *src, uint64_t offset)
+{
+	((MemSource *)src)->offset = offset;
+	return true;
+}
+
+/*
+ * Upload straight out of an in-memory buffer. The transfers point into buf
+ * directly, so no staging copies are made.
+ */
+XferResult BulkUpload(libusb_context *usbctx,
+		      libusb_device_handle *hGD,
+		      const XferLink *link,
+		      uint8_t *buf,
+		      size_t size,
+		      const XferResume *resume,
+		      XferProgressFn progress,
+		      void *progressData)
+{
+	MemSource ms = {
+		.src = { .next = MemNext, .rewind = MemRewind },
+		.buf = buf,
+	};
+
+	return BulkSend(usbctx, hGD, link, &ms.src, size, resume,
+			progress, progressData);
+}
+
+/*
+ * Memory for transfer buffers. Where libusb and the kernel support it, this
+ * is mapped from usbfs so the kernel can DMA straight out of it instead of
+ * copying each transfer into a buffer of its own. Otherwise, and when the
+ * kernel runs out of such memory, it comes from the heap.
+ */
+static uint8_t *AllocXferBuf(libusb_device_handle *hGD, size_t len,
+			     bool *oDevMem)
+{
+	uint8_t *buf = NULL;
+
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+	buf = libusb_dev_mem_alloc(hGD, len);
+#endif
+
+	*oDevMem = (buf != NULL);
+
+	return buf ? buf : malloc(len);
+}
+
+static void FreeXferBuf(libusb_device_handle *hGD, uint8_t *buf, size_t len,
+			bool devMem)
+{
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+	if (devMem) {
+		libusb_dev_mem_free(hGD, buf, len);
+		return;
+	}
+#endif
+
+	free(buf);
+}
+
+/*
+ * Streaming source for files: a reader thread fills a ring of chunk-sized
+ * slots from the file while earlier slots are on the wire, so disk reads
+ * and USB transfers overlap rather than taking turns. The ring holds a few
+ * more slots than the transfer queue so the reader can run ahead. Data is
+ * read straight into the slots with pread(), bypassing stdio's buffer, or
+ * with read() from pipes and other streams that can't seek.
+ */
+#define RING_SLOTS (XFER_MAX_DEPTH + 2)
+
+typedef struct {
+	XferSource src;
+	int fd;
+	off_t start;	/* Negative for a stream */
+	uint64_t size;
+	size_t chunkSize;
+
+	/* Where in the data the reader thread starts */
+	uint64_t from;
+	pthread_t reader;
+	bool readerRunning;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	uint8_t *slots[RING_SLOTS];
+	size_t lengths[RING_SLOTS];
+	bool devMem[RING_SLOTS];
+	unsigned int numSlots;
+
+	/* Slots filled by the reader, and slots handed to / freed by USB */
+	uint64_t filled;
+	uint64_t taken;
+	uint64_t released;
+
+	bool readFailed;
+	bool stop;
+} FileSource;
+
+static bool ReadFully(int fd, uint8_t *buf, size_t len, off_t offset)
+{
+	while (len > 0) {
+		ssize_t got = (offset < 0) ? read(fd, buf, len) :
+			pread(fd, buf, len, offset);
+
+		if (got < 0) {
+			if (errno == EINTR) continue;
+			return false;
+		}
+
+		if (got == 0) {
+			/* The file shrank, or the stream ended early */
+			return false;
+		}
+
+		buf += got;
+		len -= got;
+		if (offset >= 0) offset += got;
+	}
+
+	return true;
+}
+
+static void *FileReader(void *data)
+{
+	FileSource *fs = data;
+	uint64_t pos = fs->from;
+
+	while (pos < fs->size) {
+		unsigned int slot;
+		size_t len;
+		bool stop;
+
+		pthread_mutex_lock(&fs->lock);
+		while (!fs->stop &&
+		       ((fs->filled - fs->released) >= fs->numSlots)) {
+			pthread_cond_wait(&fs->cond, &fs->lock);
+		}
+		slot = fs->filled % fs->numSlots;
+		stop = fs->stop;
+		pthread_mutex_unlock(&fs->lock);
+
+		if (stop) {
+			break;
+		}
+
+		len = ((fs->size - pos) > fs->chunkSize) ?
+			fs->chunkSize : (size_t)(fs->size - pos);
+
+		if (!ReadFully(fs->fd, fs->slots[slot], len, (fs->start < 0) ?
+				fs->start : fs->start + (off_t)pos)) {
+			pthread_mutex_lock(&fs->lock);
+			fs->readFailed = true;
+			pthread_cond_broadcast(&fs->cond);
+			pthread_mutex_unlock(&fs->lock);
+			break;
+		}
+
+		pos += len;
+
+		pthread_mutex_lock(&fs->lock);
+		fs->lengths[slot] = len;
+		fs->filled++;
+		pthread_cond_broadcast(&fs->cond);
+		pthread_mutex_unlock(&fs->lock);
+	}
+
+	return NULL;
+}
+
+static uint8_t *FileNext(XferSource *src, size_t maxLen, size_t *len)
+{
+	FileSource *fs = (FileSource *)src;
+	uint8_t *buf = NULL;
+	unsigned int slot;
+
+	pthread_mutex_lock(&fs->lock);
+	while (!fs->readFailed && (fs->taken >= fs->filled)) {
+		pthread_cond_wait(&fs->cond, &fs->lock);
+	}
+
+	if (fs->taken < fs->filled) {
+		slot = fs->taken % fs->numSlots;
+		buf = fs->slots[slot];
+		*len = fs->lengths[slot];
+		fs->taken++;
+	}
+	pthread_mutex_unlock(&fs->lock);
+
+	return buf;
+}
+
+static void FileRelease(XferSource *src, uint8_t *buf)
+{
+	FileSource *fs = (FileSource *)src;
+
+	pthread_mutex_lock(&fs->lock);
+	fs->released++;
+	pthread_cond_broadcast(&fs->cond);
+	pthread_mutex_unlock(&fs->lock);
+}
+
+static void StopReader(FileSource *fs)
+{
+	if (!fs->readerRunning) {
+		return;
+	}
+
+	pthread_mutex_lock(&fs->lock);
+	fs->stop = true;
+	pthread_cond_broadcast(&fs->cond);
+	pthread_mutex_unlock(&fs->lock);
+
+	pthread_join(fs->reader, NULL);
+	fs->readerRunning = false;
+}
+
+/* Only called once every buffer handed out has been released */
+static bool FileRewind(XferSource *src, uint64_t offset)
+{
+	FileSource *fs = (FileSource *)src;
+
+	StopReader(fs);
+
+	fs->from = offset;
+	fs->filled = fs->taken = fs->released = 0;
+	fs->readFailed = fs->stop = false;
+
+	if (pthread_create(&fs->reader, NULL, FileReader, fs)) {
+		fprintf(stderr, "Failed to restart file reader thread\n");
+		return false;
+	}
+
+	fs->readerRunning = true;
+	return true;
+}
+
+static XferResult UploadFd(libusb_context *usbctx,
+			   libusb_device_handle *hGD,
+			   const XferLink *link,
+			   int fd,
+			   off_t start,
+			   uint64_t size,
+			   const XferResume *resume,
+			   XferProgressFn progress,
+			   void *progressData)
+{
+	FileSource fs = {
+		.src = {
+			.next = FileNext,
+			.release = FileRelease,
+			/* What has been read from a stream is gone */
+			.rewind = (start >= 0) ? FileRewind : NULL,
+		},
+		.fd = fd,
+		.start = start,
+		.size = size,
+		.chunkSize = link->chunkSize,
+	};
+	unsigned int depth = link->depth;
+	XferResult result = XFER_SOURCE_FAILED;
+	unsigned int i;
+
+	if (depth > XFER_MAX_DEPTH)
+		depth = XFER_MAX_DEPTH;
+
+	fs.numSlots = depth + 2;
+
+	for (i = 0; i < fs.numSlots; i++) {
+		if (!(fs.slots[i] = AllocXferBuf(hGD, fs.chunkSize,
+						 &fs.devMem[i]))) {
+			fprintf(stderr, "Failed to alloc %zu byte transfer "
+				"buffer\n", fs.chunkSize);
+			goto cleanup;
+		}
+	}
+
+	pthread_mutex_init(&fs.lock, NULL);
+	pthread_cond_init(&fs.cond, NULL);
+
+	if (pthread_create(&fs.reader, NULL, FileReader, &fs)) {
+		fprintf(stderr, "Failed to start file reader thread\n");
+		goto destroy;
+	}
+	fs.readerRunning = true;
+
+	result = BulkSend(usbctx, hGD, link, &fs.src, size, resume,
+			  progress, progressData);
+
+	StopReader(&fs);
+
+destroy:
+	pthread_cond_destroy(&fs.cond);
+	pthread_mutex_destroy(&fs.lock);
+
+cleanup:
+	for (i = 0; i < fs.numSlots; i++) {
+		FreeXferBuf(hGD, fs.slots[i], fs.chunkSize, fs.devMem[i]);
+	}
+
+	return result;
+}
+
+/*
+ * Upload size bytes read from fp, starting at its current position. fp's
+ * position is left where it was, unless it is a pipe. Fails with
+ * XFER_SOURCE_FAILED if the file could not be read.
+ */
+XferResult BulkUploadFile(libusb_context *usbctx,
+			  libusb_device_handle *hGD,
+			  const XferLink *link,
+			  FILE *fp,
+			  uint64_t size,
+			  const XferResume *resume,
+			  XferProgressFn progress,
+			  void *progressData)
+{
+	off_t start = ftello(fp);
+
+	if ((start < 0) && (errno != ESPIPE)) {
+		fprintf(stderr, "Failed to query file position\n");
+		return XFER_SOURCE_FAILED;
+	}
+
+	/*
+	 * Pipes, such as those StreamArchive() returns, are read as streams
+	 * so what was sent can't be sent again if a transfer fails
+	 */
+	return UploadFd(usbctx, hGD, link, fileno(fp), start, size, resume,
+			progress, progressData);
+}
+
+/*
+ * Upload the next size bytes read from fd, which may be a pipe. Transfers
+ * start as soon as the first chunk arrives rather than once all of it has.
+ * Fails with XFER_SOURCE_FAILED if fd ended or failed first.
+ */
+XferResult BulkUploadStream(libusb_context *usbctx,
+			    libusb_device_handle *hGD,
+			    const XferLink *link,
+			    int fd,
+			    uint64_t size,
+			    XferProgressFn progress,
+			    void *progressData)
+{
+	return UploadFd(usbctx, hGD, link, fd, -1, size, NULL,
+			progress, progressData);
+}
@@ -0,0 +1,124 @@
+/*
+ * SPDX-License-Identifier: CC0-1.0
+ *
+ * Author: James Jones
+ */
+
+#ifndef XFER_H_
+#define XFER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <libusb-1.0/libusb.h>
+
+/*
+ * Default size of each individual bulk transfer, before rounding down to
+ * a whole number of packets. Can be overridden for benchmarks.
+ */
+#ifndef XFER_CHUNK_SIZE
+#define XFER_CHUNK_SIZE (16 * 1024)
+#endif
+
+/* Largest chunk size calibration may pick */
+#define XFER_MAX_CHUNK_SIZE (256 * 1024)
+
+/* Number of bulk transfers kept in flight by default, and at most */
+#define XFER_DEFAULT_DEPTH 4
+#define XFER_MAX_DEPTH 32
+
+/* How bulk data is sent to a particular GameDrive */
+typedef struct {
+	unsigned char endpoint;
+	uint16_t maxPacketSize;
+	size_t chunkSize;	/* Always a multiple of maxPacketSize */
+	unsigned int depth;
+} XferLink;
+
+/*
+ * Called from the event loop each time a bulk transfer completes with the
+ * total number of bytes the device has accepted so far.
+ */
+typedef void (*XferProgressFn)(void *data, uint64_t done, uint64_t total);
+
+/*
+ * Supplies the data for a bulk upload one chunk at a time. Buffers are
+ * requested and released in the same order, and a buffer handed out by
+ * next() stays in use until it is passed back to release().
+ */
+typedef struct XferSource XferSource;
+struct XferSource {
+	/* Return up to maxLen bytes in *len, or NULL on failure */
+	uint8_t *(*next)(XferSource *src, size_t maxLen, size_t *len);
+
+	/* The device has consumed buf. Optional. */
+	void (*release)(XferSource *src, uint8_t *buf);
+
+	/*
+	 * Start handing out data from offset again, once every buffer has
+	 * been released. Optional, but transfers can't be resumed without it.
+	 */
+	bool (*rewind)(XferSource *src, uint64_t offset);
+};
+
+/*
+ * How to get the device to expect the rest of the data again after a failed
+ * transfer. restart() is called with the offset sending will resume from,
+ * which is always 0 if fromStart is set, for commands that can't begin part
+ * way through.
+ */
+typedef struct {
+	bool (*restart)(void *data, uint64_t offset);
+	void *data;
+	bool fromStart;
+} XferResume;
+
+typedef enum {
+	XFER_OK,
+	XFER_SOURCE_FAILED,	/* The data couldn't be read */
+	XFER_USB_FAILED,	/* The device didn't take it, even on retrying */
+} XferResult;
+
+extern void GetXferLink(libusb_device_handle *hGD, XferLink *link);
+extern void SetXferChunkSize(XferLink *link, size_t chunkSize);
+extern void LoadXferTuning(const char *devKey, XferLink *link);
+extern void SaveXferTuning(const char *devKey, const XferLink *link);
+
+extern XferResult BulkSend(libusb_context *usbctx,
+			   libusb_device_handle *hGD,
+			   const XferLink *link,
+			   XferSource *src,
+			   uint64_t size,
+			   const XferResume *resume,
+			   XferProgressFn progress,
+			   void *progressData);
+
+extern XferResult BulkUpload(libusb_context *usbctx,
+			     libusb_device_handle *hGD,
+			     const XferLink *link,
+			     uint8_t *buf,
+			     size_t size,
+			     const XferResume *resume,
+			     XferProgressFn progress,
+			     void *progressData);
+
+extern XferResult BulkUploadFile(libusb_context *usbctx,
+				 libusb_device_handle *hGD,
+				 const XferLink *link,
+				 FILE *fp,
+				 uint64_t size,
+				 const XferResume *resume,
+				 XferProgressFn progress,
+				 void *progressData);
+
+extern XferResult BulkUploadStream(libusb_context *usbctx,
+				   libusb_device_handle *hGD,
+				   const XferLink *link,
+				   int fd,
+				   uint64_t size,
+				   XferProgressFn progress,
+				   void *progressData);
+
+#endif /* XFER_H_ */